@@ -0,0 +1,699 @@
+/* 	x11game -- Demonstrates how to make a simple game in C++ using X11.
+
+    Copyright (C) 2022 Punched Tape Media
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* The parts of the game that don't touch X and that the headless games in
+   vecenv.cpp share with it: geometry, the cell grid, the generator, spawn
+   placement and the task pool.
+*/
+#ifndef X11GAME_CORE_H
+#define X11GAME_CORE_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+
+namespace mygame {
+
+class Time {
+public:
+    Time()
+    {
+        start_ = std::chrono::high_resolution_clock::now();
+    }
+
+    long time()
+    {
+        std::chrono::duration<long, std::nano> elap = std::chrono::high_resolution_clock::now() - start_;
+        return elap.count();
+    }
+
+private:
+    std::chrono::high_resolution_clock::time_point start_;
+};
+
+struct Point {
+	int x, y;
+};
+
+struct Size {
+	int width, height;
+};
+
+struct Rect {
+	int x, y;
+	int width, height;
+
+	inline Point tl() const
+	{
+		return {std::min(x,x+width), std::min(y, y+height)};
+	}
+	inline Point br() const
+	{
+		return {std::max(x,x+width), std::max(y, y+height)};
+	}
+	inline Point tr() const
+	{
+		return {std::max(x,x+width), std::min(y, y+height)};
+	}
+	inline Point bl() const
+	{
+		return {std::min(x,x+width), std::max(y, y+height)};
+	}
+};
+
+// The window's size in pixels when nothing else is asked for.
+constexpr int WINDOW_WIDTH = 800;
+constexpr int WINDOW_HEIGHT = 600;
+
+const Point PLAYER_SPAWN {10, 10};
+
+// Food and walls only ever sit on the 10px grid, so they are stored as one
+// bit per grid cell.  Each row is padded to whole 64-bit words so a row can be walked
+// on its own.  remaining() is kept up to date by set()/testAndClear() and can
+// be rebuilt with a popcount over the words.
+class CellGrid {
+public:
+	static constexpr int CELL_SIZE = 10;
+
+	void reset(int cols, int rows)
+	{
+		cols_ = cols;
+		rows_ = rows;
+		words_per_row_ = (cols + 63) / 64;
+		bits_.assign(static_cast<std::size_t>(words_per_row_) * rows, 0);
+		remaining_ = 0;
+	}
+
+	void clear()
+	{
+		std::fill(bits_.begin(), bits_.end(), 0);
+		remaining_ = 0;
+	}
+
+	bool inGrid(int cx, int cy) const
+	{
+		return (cx >= 0 && cx < cols_ && cy >= 0 && cy < rows_);
+	}
+
+	void set(int cx, int cy)
+	{
+		std::uint64_t &w = word(cx, cy);
+		std::uint64_t mask = bitMask(cx);
+		remaining_ += !(w & mask);
+		w |= mask;
+	}
+
+	bool test(int cx, int cy) const
+	{
+		return inGrid(cx, cy) && (bits_[index(cx, cy)] & bitMask(cx));
+	}
+
+	// Clears the cell and returns true if there was food on it.
+	bool testAndClear(int cx, int cy)
+	{
+		if (!inGrid(cx, cy))
+			return false;
+
+		std::uint64_t &w = word(cx, cy);
+		std::uint64_t mask = bitMask(cx);
+		bool had_food = (w & mask) != 0;
+		w &= ~mask;
+		remaining_ -= had_food;
+		return had_food;
+	}
+
+	// Takes a copy of another grid's words(), as saved by SimState.
+	void assign(int cols, int rows, const std::uint64_t *words)
+	{
+		reset(cols, rows);
+		std::copy_n(words, bits_.size(), bits_.begin());
+		recount();
+	}
+
+	void recount()
+	{
+		remaining_ = 0;
+		for (std::uint64_t w: bits_)
+			remaining_ += __builtin_popcountll(w);
+	}
+
+	// Calls f(cx, cy) for every cell holding food, skipping empty words.
+	template <typename F>
+	void forEach(F f) const
+	{
+		for (int cy = 0; cy < rows_; ++cy)
+		{
+			const std::uint64_t *row = &bits_[static_cast<std::size_t>(cy) * words_per_row_];
+			for (int wi = 0; wi < words_per_row_; ++wi)
+			{
+				std::uint64_t w = row[wi];
+				while (w)
+				{
+					int bit = __builtin_ctzll(w);
+					f(wi * 64 + bit, cy);
+					w &= w - 1;
+				}
+			}
+		}
+	}
+
+	// forEach limited to cells in [cx0, cx1) x [cy0, cy1), so the cost
+	// depends on the size of the rectangle rather than of the grid.
+	template <typename F>
+	void forEachIn(int cx0, int cy0, int cx1, int cy1, F f) const
+	{
+		cx0 = std::max(cx0, 0);
+		cy0 = std::max(cy0, 0);
+		cx1 = std::min(cx1, cols_);
+		cy1 = std::min(cy1, rows_);
+		if (cx0 >= cx1)
+			return;
+
+		int first = cx0 >> 6;
+		int last = (cx1 - 1) >> 6;
+		std::uint64_t first_mask = ~std::uint64_t(0) << (cx0 & 63);
+		std::uint64_t last_mask = ~std::uint64_t(0) >> (63 - ((cx1 - 1) & 63));
+		for (int cy = cy0; cy < cy1; ++cy)
+		{
+			const std::uint64_t *row = &bits_[static_cast<std::size_t>(cy) * words_per_row_];
+			for (int wi = first; wi <= last; ++wi)
+			{
+				std::uint64_t w = row[wi];
+				if (wi == first)
+					w &= first_mask;
+				if (wi == last)
+					w &= last_mask;
+				while (w)
+				{
+					int bit = __builtin_ctzll(w);
+					f(wi * 64 + bit, cy);
+					w &= w - 1;
+				}
+			}
+		}
+	}
+
+	std::size_t remaining() const { return remaining_; }
+	int cols() const { return cols_; }
+	int rows() const { return rows_; }
+	int wordsPerRow() const { return words_per_row_; }
+	const std::uint64_t *words() const { return bits_.data(); }
+	// For filling in place after reset(); recount() afterwards.
+	std::uint64_t *words() { return bits_.data(); }
+	std::size_t memoryBytes() const { return bits_.size() * sizeof(std::uint64_t); }
+
+private:
+	int cols_ = 0;
+	int rows_ = 0;
+	int words_per_row_ = 0;
+	std::size_t remaining_ = 0;
+	std::vector<std::uint64_t> bits_;
+
+	std::size_t index(int cx, int cy) const
+	{
+		return static_cast<std::size_t>(cy) * words_per_row_ + (cx >> 6);
+	}
+	std::uint64_t &word(int cx, int cy) { return bits_[index(cx, cy)]; }
+	static std::uint64_t bitMask(int cx) { return std::uint64_t(1) << (cx & 63); }
+};
+
+// Small, fast generator (splitmix64).  The whole state is one integer, so it
+// can be seeded per tile/level and copied around freely.
+struct Rng {
+	std::uint64_t state;
+
+	explicit Rng(std::uint64_t seed = 0) : state(seed) {}
+
+	std::uint64_t next()
+	{
+		std::uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+
+	// Uniform integer in [0, n).
+	int uniform(int n)
+	{
+		return static_cast<int>(((next() >> 32) * static_cast<std::uint64_t>(n)) >> 32);
+	}
+};
+
+// Where entities may be placed.  Everything is in grid cells.  Exclusion
+// rects are half-open: [x, x+width) x [y, y+height).
+struct SpawnRules {
+	int cols = 0;
+	int rows = 0;
+	int min_separation = 1;          // Chebyshev distance between any two spawns
+	std::vector<Rect> exclusions;
+	const CellGrid *walls = nullptr;
+	unsigned threads = 0;            // 0 = one per hardware thread
+};
+
+// Blue-noise placement by dart throwing against a bucket grid.  Buckets are
+// min_separation cells wide, so each holds at most one spawn and a candidate
+// only has to be checked against the 3x3 buckets around it.  Large requests
+// are split into tiles processed in four checkerboard phases; tiles in the
+// same phase never touch each other's buckets, so they run on separate
+// threads without locking and the result only depends on the seed.
+class SpawnPlacer {
+public:
+	static constexpr std::size_t PARALLEL_THRESHOLD = 4096;
+	static constexpr int TILE_BUCKETS = 64;
+	static constexpr int MAX_FAILS = 30;
+
+	// Returns up to count cells in random order; fewer if the area is full.
+	std::vector<Point> place(const SpawnRules &rules, std::size_t count, std::uint64_t seed);
+
+private:
+	static constexpr std::uint16_t EMPTY = 0xffff;
+
+	const SpawnRules *rules_ = nullptr;
+	int sep_ = 1;
+	int bcols_ = 0;
+	int brows_ = 0;
+	std::vector<std::uint16_t> buckets_;   // packed (dx, dy) of the spawn, or EMPTY
+
+	bool isFree(int x, int y) const;
+	bool tryInsert(int x, int y);
+	void fillArea(int bx0, int by0, int bx1, int by1, std::size_t quota, Rng &rng,
+	              std::vector<Point> &out);
+};
+
+inline bool SpawnPlacer::isFree(int x, int y) const
+{
+	if (rules_->walls && rules_->walls->test(x, y))
+		return false;
+
+	for (const Rect &r: rules_->exclusions)
+		if (x >= r.x && x < r.x + r.width && y >= r.y && y < r.y + r.height)
+			return false;
+
+	int bx = x / sep_;
+	int by = y / sep_;
+	for (int ny = std::max(by - 1, 0); ny <= std::min(by + 1, brows_ - 1); ++ny)
+	{
+		for (int nx = std::max(bx - 1, 0); nx <= std::min(bx + 1, bcols_ - 1); ++nx)
+		{
+			std::uint16_t b = buckets_[static_cast<std::size_t>(ny) * bcols_ + nx];
+			if (b == EMPTY)
+				continue;
+			int ox = nx * sep_ + (b & 0xff);
+			int oy = ny * sep_ + (b >> 8);
+			if (std::abs(ox - x) < sep_ && std::abs(oy - y) < sep_)
+				return false;
+		}
+	}
+	return true;
+}
+
+inline bool SpawnPlacer::tryInsert(int x, int y)
+{
+	if (!isFree(x, y))
+		return false;
+
+	int bx = x / sep_;
+	int by = y / sep_;
+	buckets_[static_cast<std::size_t>(by) * bcols_ + bx] =
+		static_cast<std::uint16_t>((x - bx * sep_) | ((y - by * sep_) << 8));
+	return true;
+}
+
+inline void SpawnPlacer::fillArea(int bx0, int by0, int bx1, int by1, std::size_t quota, Rng &rng,
+                                  std::vector<Point> &out)
+{
+	int x0 = bx0 * sep_;
+	int y0 = by0 * sep_;
+	int w = std::min(bx1 * sep_, rules_->cols) - x0;
+	int h = std::min(by1 * sep_, rules_->rows) - y0;
+	if (w <= 0 || h <= 0)
+		return;
+
+	int fails = 0;
+	while (quota > 0 && fails < MAX_FAILS)
+	{
+		int x = x0 + rng.uniform(w);
+		int y = y0 + rng.uniform(h);
+		if (tryInsert(x, y))
+		{
+			out.push_back({x, y});
+			--quota;
+			fails = 0;
+		}
+		else
+		{
+			++fails;
+		}
+	}
+}
+
+inline std::vector<Point> SpawnPlacer::place(const SpawnRules &rules, std::size_t count, std::uint64_t seed)
+{
+	rules_ = &rules;
+	sep_ = std::min(std::max(rules.min_separation, 1), 255);
+	bcols_ = (rules.cols + sep_ - 1) / sep_;
+	brows_ = (rules.rows + sep_ - 1) / sep_;
+	buckets_.assign(static_cast<std::size_t>(bcols_) * brows_, EMPTY);
+
+	std::vector<Point> out;
+	out.reserve(count);
+	Rng rng(seed);
+
+	if (count >= PARALLEL_THRESHOLD && bcols_ * brows_ > TILE_BUCKETS * TILE_BUCKETS)
+	{
+		int tcols = (bcols_ + TILE_BUCKETS - 1) / TILE_BUCKETS;
+		int trows = (brows_ + TILE_BUCKETS - 1) / TILE_BUCKETS;
+		std::size_t tiles = static_cast<std::size_t>(tcols) * trows;
+		std::vector<std::vector<Point>> tile_out(tiles);
+
+		// Quota proportional to tile area; the remainder goes to the first tiles.
+		double total_area = static_cast<double>(rules.cols) * rules.rows;
+		std::vector<std::size_t> quota(tiles);
+		std::size_t assigned = 0;
+		for (std::size_t t = 0; t < tiles; ++t)
+		{
+			int tx = static_cast<int>(t % tcols);
+			int ty = static_cast<int>(t / tcols);
+			int w = std::min((tx + 1) * TILE_BUCKETS * sep_, rules.cols) - tx * TILE_BUCKETS * sep_;
+			int h = std::min((ty + 1) * TILE_BUCKETS * sep_, rules.rows) - ty * TILE_BUCKETS * sep_;
+			quota[t] = static_cast<std::size_t>(count * (static_cast<double>(w) * h / total_area));
+			assigned += quota[t];
+		}
+		for (std::size_t t = 0; assigned < count; t = (t + 1) % tiles, ++assigned)
+			++quota[t];
+
+		unsigned nthreads = rules.threads ? rules.threads : std::max(1u, std::thread::hardware_concurrency());
+		for (int phase = 0; phase < 4; ++phase)
+		{
+			std::vector<std::size_t> phase_tiles;
+			for (std::size_t t = 0; t < tiles; ++t)
+				if (static_cast<int>(t % tcols) % 2 == phase % 2 && static_cast<int>(t / tcols) % 2 == phase / 2)
+					phase_tiles.push_back(t);
+
+			auto work = [&](unsigned worker) {
+				for (std::size_t i = worker; i < phase_tiles.size(); i += nthreads)
+				{
+					std::size_t t = phase_tiles[i];
+					int tx = static_cast<int>(t % tcols) * TILE_BUCKETS;
+					int ty = static_cast<int>(t / tcols) * TILE_BUCKETS;
+					Rng tile_rng(seed ^ (0xa0761d6478bd642full * (t + 1)));
+					tile_out[t].reserve(quota[t]);
+					fillArea(tx, ty, std::min(tx + TILE_BUCKETS, bcols_), std::min(ty + TILE_BUCKETS, brows_),
+					         quota[t], tile_rng, tile_out[t]);
+				}
+			};
+
+			std::vector<std::thread> workers;
+			for (unsigned w = 1; w < nthreads; ++w)
+				workers.emplace_back(work, w);
+			work(0);
+			for (auto &th: workers)
+				th.join();
+		}
+
+		for (auto &v: tile_out)
+			out.insert(out.end(), v.begin(), v.end());
+	}
+
+	// Serial pass: small requests, and topping up tiles that came up short.
+	if (out.size() < count)
+		fillArea(0, 0, bcols_, brows_, count - out.size(), rng, out);
+
+	// Tile order is spatially biased, so shuffle before handing out.
+	for (std::size_t i = out.size(); i > 1; --i)
+		std::swap(out[i - 1], out[static_cast<std::size_t>(rng.next() % i)]);
+
+	rules_ = nullptr;
+	return out;
+}
+
+class JobPool;
+
+// A fixed set of tasks and what each must wait for, built once and run
+// again every frame.  Dependencies have to be added before the tasks that
+// need them, so the order tasks were added in is always a valid serial
+// order.  Each task keeps totals of its run time and of how long it sat
+// ready before a thread picked it up.
+class TaskGraph {
+public:
+	using TaskId = int;
+
+	explicit TaskGraph(const char *name) : name_(name) {}
+
+	TaskId add(const char *name, std::function<void()> fn, std::initializer_list<TaskId> deps = {})
+	{
+		TaskId id = static_cast<TaskId>(tasks_.size());
+		tasks_.emplace_back();
+		tasks_.back().name = name;
+		tasks_.back().fn = std::move(fn);
+		for (TaskId d: deps)
+		{
+			tasks_[d].successors.push_back(id);
+			++tasks_[id].deps;
+		}
+		return id;
+	}
+
+	// On the pool if there is one, else in order on this thread.
+	void run(JobPool *pool);
+
+	const char *name() const { return name_; }
+	long runs() const { return runs_; }
+	double meanWallUs() const { return runs_ ? wall_ns_ / 1e3 / runs_ : 0; }
+
+	// Time spent in the tasks against time the whole graph took.
+	void printStats() const;
+	// One cluster of a Graphviz digraph, labelled with mean times.
+	void writeDot(FILE *f) const;
+
+private:
+	friend class JobPool;
+
+	struct Task {
+		const char *name;
+		std::function<void()> fn;
+		std::vector<TaskId> successors;
+		int deps = 0;
+		int waiting = 0;          // unfinished dependencies in the current run
+		long ready_ns = 0;
+		long busy_ns = 0;         // totals over all runs
+		long wait_ns = 0;
+	};
+
+	const char *name_;
+	std::vector<Task> tasks_;
+	std::size_t remaining_ = 0;   // tasks of the current run not yet finished
+	long start_ns_ = 0;
+	long runs_ = 0;
+	long wall_ns_ = 0;
+	Time clock_;
+
+	long execute(TaskId id);
+};
+
+// Worker threads that run TaskGraphs.  The thread calling run() takes tasks
+// too, so a pool of n threads starts n - 1 workers.  Graphs passed to one
+// run() share the workers, which is how one frame's drawing overlaps the
+// next tick.  The ready queue is a plain mutex-guarded deque; tasks here are
+// tens of microseconds or more, so the lock is not what limits it.
+class JobPool {
+public:
+	explicit JobPool(unsigned threads)
+	{
+		for (unsigned i = 1; i < std::max(threads, 1u); ++i)
+			workers_.emplace_back([this] { work(); });
+	}
+
+	~JobPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopping_ = true;
+		}
+		changed_.notify_all();
+		for (auto &th: workers_)
+			th.join();
+	}
+
+	unsigned size() const { return static_cast<unsigned>(workers_.size()) + 1; }
+
+	// Returns once every task of every graph has finished.
+	void run(std::initializer_list<TaskGraph *> graphs)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		for (TaskGraph *g: graphs)
+		{
+			g->start_ns_ = g->clock_.time();
+			g->remaining_ = g->tasks_.size();
+			for (TaskGraph::TaskId id = 0; id < static_cast<TaskGraph::TaskId>(g->tasks_.size()); ++id)
+			{
+				TaskGraph::Task &t = g->tasks_[id];
+				t.waiting = t.deps;
+				if (t.deps == 0)
+					push(g, id, g->start_ns_);
+			}
+		}
+		changed_.notify_all();
+
+		auto finished = [&] {
+			return std::all_of(graphs.begin(), graphs.end(), [](TaskGraph *g) { return g->remaining_ == 0; });
+		};
+		while (!finished())
+		{
+			if (ready_.empty())
+				changed_.wait(lock);
+			else
+				runOne(lock);
+		}
+
+		for (TaskGraph *g: graphs)
+		{
+			++g->runs_;
+			g->wall_ns_ += g->clock_.time() - g->start_ns_;
+		}
+	}
+
+private:
+	struct Job {
+		TaskGraph *graph;
+		TaskGraph::TaskId id;
+	};
+
+	std::mutex mutex_;
+	std::condition_variable changed_;   // a task became ready or a graph finished
+	std::deque<Job> ready_;
+	std::vector<std::thread> workers_;
+	bool stopping_ = false;
+
+	void push(TaskGraph *g, TaskGraph::TaskId id, long now_ns)
+	{
+		g->tasks_[id].ready_ns = now_ns;
+		ready_.push_back({g, id});
+	}
+
+	// Called and returns with the lock held.
+	void runOne(std::unique_lock<std::mutex> &lock)
+	{
+		Job job = ready_.front();
+		ready_.pop_front();
+		lock.unlock();
+		long now = job.graph->execute(job.id);
+		lock.lock();
+
+		bool pushed = false;
+		for (TaskGraph::TaskId s: job.graph->tasks_[job.id].successors)
+		{
+			if (--job.graph->tasks_[s].waiting == 0)
+			{
+				push(job.graph, s, now);
+				pushed = true;
+			}
+		}
+		if (--job.graph->remaining_ == 0)
+			changed_.notify_all();
+		else if (pushed)
+			changed_.notify_one();
+	}
+
+	void work()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (true)
+		{
+			changed_.wait(lock, [&] { return stopping_ || !ready_.empty(); });
+			if (stopping_)
+				return;
+			runOne(lock);
+		}
+	}
+};
+
+// Returns when the task finished.
+inline long TaskGraph::execute(TaskId id)
+{
+	Task &t = tasks_[id];
+	long start = clock_.time();
+	t.wait_ns += start - t.ready_ns;
+	t.fn();
+	long end = clock_.time();
+	t.busy_ns += end - start;
+	return end;
+}
+
+inline void TaskGraph::run(JobPool *pool)
+{
+	if (pool)
+	{
+		pool->run({this});
+		return;
+	}
+
+	start_ns_ = clock_.time();
+	long now = start_ns_;
+	for (TaskId id = 0; id < static_cast<TaskId>(tasks_.size()); ++id)
+	{
+		tasks_[id].ready_ns = now;
+		now = execute(id);
+	}
+	++runs_;
+	wall_ns_ += now - start_ns_;
+}
+
+inline void TaskGraph::printStats() const
+{
+	if (runs_ == 0)
+		return;
+
+	long busy = 0;
+	for (const Task &t: tasks_)
+		busy += t.busy_ns;
+	printf("%s graph: %ld runs, %.1f us wall, %.1f us in tasks (%.2fx)\n", name_, runs_, meanWallUs(),
+	       busy / 1e3 / runs_, wall_ns_ ? static_cast<double>(busy) / wall_ns_ : 0.0);
+	for (const Task &t: tasks_)
+		printf("  %-16s %9.2f us run, %7.2f us waiting to start\n", t.name, t.busy_ns / 1e3 / runs_,
+		       t.wait_ns / 1e3 / runs_);
+}
+
+inline void TaskGraph::writeDot(FILE *f) const
+{
+	fprintf(f, "  subgraph \"cluster_%s\" {\n    label=\"%s (%.1f us)\";\n", name_, name_, meanWallUs());
+	for (TaskId id = 0; id < static_cast<TaskId>(tasks_.size()); ++id)
+	{
+		const Task &t = tasks_[id];
+		double busy = runs_ ? t.busy_ns / 1e3 / runs_ : 0;
+		double wait = runs_ ? t.wait_ns / 1e3 / runs_ : 0;
+		fprintf(f, "    \"%s.%d\" [label=\"%s\\n%.1f us (+%.1f)\"];\n", name_, id, t.name, busy, wait);
+		for (TaskId s: t.successors)
+			fprintf(f, "    \"%s.%d\" -> \"%s.%d\";\n", name_, id, name_, s);
+	}
+	fprintf(f, "  }\n");
+}
+
+
+}
+
+#endif
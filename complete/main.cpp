@@ -16,7 +16,34 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/XKBlib.h>
+#include <X11/keysym.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef HAVE_XTEST
+#include <X11/extensions/XTest.h>
+#endif
+#ifdef HAVE_XCB
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <cstdio>
+#include <cctype>
 #include <stdexcept>
 #include <vector>
 #include <cstdlib>
@@ -24,63 +51,28 @@
 #include <algorithm>
 #include <iostream>
 #include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <cmath>
+#include <future>
+#include <memory>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <csignal>
+#include <cerrno>
 
-#define KEY_ESCAPE     9
-#define KEY_SPACEBAR  65
-#define KEY_UP       111
-#define KEY_RIGHT    114
-#define KEY_DOWN     116
-#define KEY_LEFT     113
+#include "vecenv.h"
 
 namespace mygame {
 
-class Time {
-public:
-    Time()
-    {
-        start_ = std::chrono::high_resolution_clock::now();
-    }
-
-    long time()
-    {
-        std::chrono::duration<long, std::nano> elap = std::chrono::high_resolution_clock::now() - start_;
-        return elap.count();
-    }
-
-private:
-    std::chrono::high_resolution_clock::time_point start_;
-};
-
-struct Point {
-	int x, y;
-};
-
-struct Size {
-	int width, height;
-};
-
-struct Rect {
-	int x, y;
-	int width, height;
-
-	inline Point tl() const
-	{
-		return {std::min(x,x+width), std::min(y, y+height)};
-	}
-	inline Point br() const
-	{
-		return {std::max(x,x+width), std::max(y, y+height)};
-	}
-	inline Point tr() const
-	{
-		return {std::max(x,x+width), std::min(y, y+height)};
-	}
-	inline Point bl() const
-	{
-		return {std::min(x,x+width), std::max(y, y+height)};
-	}
-};
-
 inline bool pointInRect(const Point &p, const Rect &r)
 {
     return (   p.x >= r.tl().x && p.x <= r.br().x
@@ -115,408 +107,7529 @@ bool rectangleIntersect(const Rect &r1, const Rect &r2)
 	return false;
 }
 
-class GameDisplay {
-public:
-	const int DEFAULT_WIDTH = 800;
-	const int DEFAULT_HEIGHT = 600;
-	GameDisplay();
-	~GameDisplay();
+// dst = src * alpha + dst * (1 - alpha) per channel, rounding as x / 255.
+// Four pixels at a time with SSE2; the frame buffer's alpha byte is left 0.
+inline void blendRow(std::uint32_t *dst, const std::uint32_t *src, int n)
+{
+	int i = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i c255 = _mm_set1_epi16(255);
+	const __m128i c128 = _mm_set1_epi16(128);
+	const __m128i rgb_mask = _mm_set1_epi32(0x00ffffff);
 
-	Display *getDisplay();
+	auto blend = [&](__m128i s, __m128i d) {
+		__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		__m128i r = _mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, _mm_sub_epi16(c255, a)));
+		r = _mm_add_epi16(r, c128);
+		return _mm_srli_epi16(_mm_add_epi16(r, _mm_srli_epi16(r, 8)), 8);
+	};
 
-	void drawRect(unsigned long col, int x, int y, int width, int height) const;
-	void redraw();
-	Rect getGeometry();
-    void drawText(int x, int y, const std::string &str) const;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+		__m128i lo = blend(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+		__m128i hi = blend(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_and_si128(_mm_packus_epi16(lo, hi), rgb_mask));
+	}
+#endif
+	for (; i < n; ++i)
+	{
+		// Red and blue share one multiply; neither can carry into the other.
+		std::uint32_t s = src[i];
+		std::uint32_t d = dst[i];
+		std::uint32_t a = s >> 24;
+		std::uint32_t rb = (s & 0xff00ff) * a + (d & 0xff00ff) * (255 - a) + 0x800080;
+		std::uint32_t g = (s & 0xff00) * a + (d & 0xff00) * (255 - a) + 0x8000;
+		rb = ((rb + ((rb >> 8) & 0xff00ff)) >> 8) & 0xff00ff;
+		g = ((g + ((g >> 8) & 0xff00)) >> 8) & 0xff00;
+		dst[i] = rb | g;
+	}
+}
 
-private:
-	Display *display_;
-	int screen_;
-	Window window_;
+
+enum SpriteId {
+	SPRITE_PLAYER, SPRITE_GHOST, SPRITE_FOOD, SPRITE_WALL, SPRITE_COUNT
 };
 
-GameDisplay::GameDisplay()
-{
-	display_ = XOpenDisplay(NULL);
-	if (display_ == NULL)
-	{
-		throw std::runtime_error("Unable to open the display");
-	}
+// Straight-alpha RGBA sprites, SPRITE_SIZE square, laid out left to right in
+// SpriteId order.  Pixels are 0xAARRGGBB.
+struct SpriteAtlas {
+	static constexpr int SPRITE_SIZE = 10;
 
-	screen_ = DefaultScreen(display_);
+	int width = 0;
+	int height = 0;
+	std::vector<std::uint32_t> pixels;
 
-	window_ = XCreateSimpleWindow(display_, RootWindow(display_,screen_), 0, 0, DEFAULT_WIDTH, DEFAULT_HEIGHT, 1, 
-                             BlackPixel(display_,screen_), 0x363d4d); //WhitePixel(display_,screen_));
+	std::uint32_t at(int x, int y) const { return pixels[static_cast<std::size_t>(y) * width + x]; }
+	static int originX(int sprite) { return sprite * SPRITE_SIZE; }
 
-	XSelectInput(display_, window_, KeyPressMask | ExposureMask );
-	XMapWindow(display_, window_);
-}
+	// The colour of a pixel blended over background.  Core X has no alpha,
+	// so the X backends upload this and draw any pixel with alpha above 0.
+	std::uint32_t flattened(int x, int y, std::uint32_t background) const;
+	bool opaque(int sprite) const;
 
-GameDisplay::~GameDisplay()
+	static SpriteAtlas load(const std::string &path);
+	static SpriteAtlas makeDefault();
+	void save(const std::string &path) const;
+};
+
+namespace {
+
+// Reads the next whitespace-separated header token, skipping # comments.
+std::string pnmToken(std::FILE *f)
 {
-	XCloseDisplay(display_);
+	std::string tok;
+	int c;
+	while ((c = std::fgetc(f)) != EOF)
+	{
+		if (c == '#')
+		{
+			while ((c = std::fgetc(f)) != EOF && c != '\n')
+				;
+			continue;
+		}
+		if (std::isspace(c))
+		{
+			if (!tok.empty())
+				break;
+			continue;
+		}
+		tok += static_cast<char>(c);
+	}
+	return tok;
 }
 
-Display *GameDisplay::getDisplay()
-{
-	return display_;
 }
 
-void GameDisplay::drawRect(unsigned long col, int x, int y, int width, int height) const
+// Binary PPM (P6, magenta 0xff00ff is transparent) or PAM (P7, RGB or
+// RGB_ALPHA), 8 bits per channel.
+SpriteAtlas SpriteAtlas::load(const std::string &path)
 {
-	XSetForeground(display_, DefaultGC(display_,screen_), col);
-	XFillRectangle(display_, window_, DefaultGC(display_,screen_), x,y, width, height);
+	std::unique_ptr<std::FILE, int (*)(std::FILE *)> f(std::fopen(path.c_str(), "rb"), &std::fclose);
+	if (!f)
+		throw std::runtime_error("Unable to open sprite atlas " + path);
+
+	SpriteAtlas atlas;
+	int depth = 3;
+	int maxval = 0;
+	std::string magic = pnmToken(f.get());
+	if (magic == "P6")
+	{
+		atlas.width = std::atoi(pnmToken(f.get()).c_str());
+		atlas.height = std::atoi(pnmToken(f.get()).c_str());
+		maxval = std::atoi(pnmToken(f.get()).c_str());
+	}
+	else if (magic == "P7")
+	{
+		for (std::string tok = pnmToken(f.get()); tok != "ENDHDR"; tok = pnmToken(f.get()))
+		{
+			if (tok.empty())
+				throw std::runtime_error("Truncated PAM header in " + path);
+			if (tok == "WIDTH")
+				atlas.width = std::atoi(pnmToken(f.get()).c_str());
+			else if (tok == "HEIGHT")
+				atlas.height = std::atoi(pnmToken(f.get()).c_str());
+			else if (tok == "DEPTH")
+				depth = std::atoi(pnmToken(f.get()).c_str());
+			else if (tok == "MAXVAL")
+				maxval = std::atoi(pnmToken(f.get()).c_str());
+			else if (tok == "TUPLTYPE")
+				pnmToken(f.get());
+		}
+	}
+	else
+	{
+		throw std::runtime_error(path + " is not a binary PPM or PAM file");
+	}
+
+	if (maxval != 255 || (depth != 3 && depth != 4))
+		throw std::runtime_error(path + ": only 8-bit RGB or RGBA images are supported");
+	if (atlas.width < originX(SPRITE_COUNT) || atlas.height < SPRITE_SIZE)
+		throw std::runtime_error(path + " is too small to hold every sprite");
+
+	std::vector<unsigned char> raw(static_cast<std::size_t>(atlas.width) * atlas.height * depth);
+	if (std::fread(raw.data(), 1, raw.size(), f.get()) != raw.size())
+		throw std::runtime_error("Truncated pixel data in " + path);
+
+	atlas.pixels.resize(static_cast<std::size_t>(atlas.width) * atlas.height);
+	for (std::size_t i = 0; i < atlas.pixels.size(); ++i)
+	{
+		const unsigned char *p = &raw[i * depth];
+		std::uint32_t rgb = (p[0] << 16) | (p[1] << 8) | p[2];
+		std::uint32_t a = depth == 4 ? p[3] : (rgb == 0xff00ff ? 0 : 255);
+		atlas.pixels[i] = (a << 24) | rgb;
+	}
+	return atlas;
 }
 
-void GameDisplay::redraw()
+void SpriteAtlas::save(const std::string &path) const
 {
-	XClearWindow(display_, window_);
+	std::unique_ptr<std::FILE, int (*)(std::FILE *)> f(std::fopen(path.c_str(), "wb"), &std::fclose);
+	if (!f)
+		throw std::runtime_error("Unable to write " + path);
 
-	Window root_wind;
-	int x, y;
-	unsigned int width, height, border_width, depth;
-	XGetGeometry(display_, window_, &root_wind, &x, &y, &width,
-					  &height, &border_width, &depth);
-					  
-	XEvent ev;
-	ev.xexpose.type = Expose;
-	ev.xexpose.display = display_;
-	ev.xexpose.window = window_;
-	ev.xexpose.x = x;
-	ev.xexpose.y = y;
-	ev.xexpose.width = width;
-	ev.xexpose.height = height;
-	ev.xexpose.count = 0;
-	
-	XSendEvent(display_, window_, false, ExposureMask, &ev);
+	std::fprintf(f.get(), "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", width, height);
+	for (std::uint32_t p: pixels)
+	{
+		unsigned char rgba[4] = {static_cast<unsigned char>(p >> 16), static_cast<unsigned char>(p >> 8),
+		                         static_cast<unsigned char>(p), static_cast<unsigned char>(p >> 24)};
+		std::fwrite(rgba, 1, 4, f.get());
+	}
 }
 
-Rect GameDisplay::getGeometry()
+std::uint32_t SpriteAtlas::flattened(int x, int y, std::uint32_t background) const
 {
-	Window root_wind;
-	int x, y;
-	unsigned int width, height, border_width, depth;
-	XGetGeometry(display_, window_, &root_wind, &x, &y, &width,
-					  &height, &border_width, &depth);
-					  
-	Rect r;
-  
-	r.x = x;
-	r.y = y;
-	r.width = width;
-	r.height = height;
-  
-	return r;
+	std::uint32_t p = at(x, y);
+	blendRow(&background, &p, 1);
+	return background;
 }
 
-void GameDisplay::drawText(int x, int y, const std::string &str) const
+bool SpriteAtlas::opaque(int sprite) const
 {
-    XDrawString(display_, window_, DefaultGC(display_, screen_), x, y, str.c_str(), str.size());
+	for (int y = 0; y < SPRITE_SIZE; ++y)
+		for (int x = originX(sprite); x < originX(sprite) + SPRITE_SIZE; ++x)
+			if ((at(x, y) >> 24) != 255)
+				return false;
+	return true;
 }
 
+// Simple shapes in the game's colours, with a half-transparent rim on the
+// round ones.
+SpriteAtlas SpriteAtlas::makeDefault()
+{
+	const int S = SPRITE_SIZE;
+	SpriteAtlas atlas;
+	atlas.width = originX(SPRITE_COUNT);
+	atlas.height = S;
+	atlas.pixels.assign(static_cast<std::size_t>(atlas.width) * atlas.height, 0);
 
-struct Character {
-	unsigned long color = 0x6091ab;
-	Point position {10, 10};
-	Size size {10, 10};
+	auto put = [&](int sprite, int x, int y, std::uint32_t argb) {
+		atlas.pixels[static_cast<std::size_t>(y) * atlas.width + originX(sprite) + x] = argb;
+	};
+	auto disc = [&](int sprite, double radius, std::uint32_t rgb) {
+		for (int y = 0; y < S; ++y)
+			for (int x = 0; x < S; ++x)
+			{
+				double d = std::hypot(x + 0.5 - S / 2.0, y + 0.5 - S / 2.0);
+				if (d <= radius - 0.5)
+					put(sprite, x, y, 0xff000000u | rgb);
+				else if (d <= radius + 0.5)
+					put(sprite, x, y, 0x80000000u | rgb);
+			}
+	};
 
-	Character(unsigned long new_col, Point new_pos, Size new_sz)
-	: color(new_col), position(new_pos), size(new_sz) {};
-	
-	Rect bounds() const
-	{
-		return {position.x, position.y, size.width, size.height};
-	}
-};
+	disc(SPRITE_PLAYER, 4.5, 0x6091ab);
+	disc(SPRITE_FOOD, 2.5, 0xe0f731);
 
-struct Player : public Character {
-	Player() : Character(0x6091ab, {10,10}, {10,10}) {};
-};
+	// Ghost: dome on top, ragged hem, two eyes.
+	for (int y = 0; y < S; ++y)
+		for (int x = 0; x < S; ++x)
+		{
+			bool body = y >= 4 ? (y < S - 1 || x % 3 != 1) : std::hypot(x + 0.5 - S / 2.0, y + 0.5 - 4.5) <= 4.5;
+			if (body)
+				put(SPRITE_GHOST, x, y, 0xffff0000u);
+		}
+	put(SPRITE_GHOST, 3, 4, 0xffffffffu);
+	put(SPRITE_GHOST, 6, 4, 0xffffffffu);
 
-struct Food : public Character {
-	Food() : Character(0xe0f731, {100, 100}, {10, 10}) {};
-};
+	for (int y = 0; y < S; ++y)
+		for (int x = 0; x < S; ++x)
+		{
+			bool edge = x == 0 || y == 0 || x == S - 1 || y == S - 1;
+			put(SPRITE_WALL, x, y, edge ? 0xff5c6270u : 0xff8a8f99u);
+		}
 
-struct Ghost : public Character {
-	Ghost() : Character(0xff0000, {100, 100}, {10, 10})
-    {
-        time_at_last_move_ns_ = time_.time();
-    };
+	return atlas;
+}
 
-    void move()
-    {
-        int direction = std::rand() % 4;
-        const int MOVE_DIST = 10;
+// A 5x7 font for printable ASCII, one byte per column with bit 0 at the top.
+const std::uint8_t FONT_5X7[95][5] = {
+	{0x00, 0x00, 0x00, 0x00, 0x00}, {0x00, 0x00, 0x5f, 0x00, 0x00}, {0x00, 0x07, 0x00, 0x07, 0x00},
+	{0x14, 0x7f, 0x14, 0x7f, 0x14}, {0x24, 0x2a, 0x7f, 0x2a, 0x12}, {0x23, 0x13, 0x08, 0x64, 0x62},
+	{0x36, 0x49, 0x55, 0x22, 0x50}, {0x00, 0x05, 0x03, 0x00, 0x00}, {0x00, 0x1c, 0x22, 0x41, 0x00},
+	{0x00, 0x41, 0x22, 0x1c, 0x00}, {0x14, 0x08, 0x3e, 0x08, 0x14}, {0x08, 0x08, 0x3e, 0x08, 0x08},
+	{0x00, 0x50, 0x30, 0x00, 0x00}, {0x08, 0x08, 0x08, 0x08, 0x08}, {0x00, 0x60, 0x60, 0x00, 0x00},
+	{0x20, 0x10, 0x08, 0x04, 0x02}, {0x3e, 0x51, 0x49, 0x45, 0x3e}, {0x00, 0x42, 0x7f, 0x40, 0x00},
+	{0x42, 0x61, 0x51, 0x49, 0x46}, {0x21, 0x41, 0x45, 0x4b, 0x31}, {0x18, 0x14, 0x12, 0x7f, 0x10},
+	{0x27, 0x45, 0x45, 0x45, 0x39}, {0x3c, 0x4a, 0x49, 0x49, 0x30}, {0x01, 0x71, 0x09, 0x05, 0x03},
+	{0x36, 0x49, 0x49, 0x49, 0x36}, {0x06, 0x49, 0x49, 0x29, 0x1e}, {0x00, 0x36, 0x36, 0x00, 0x00},
+	{0x00, 0x56, 0x36, 0x00, 0x00}, {0x08, 0x14, 0x22, 0x41, 0x00}, {0x14, 0x14, 0x14, 0x14, 0x14},
+	{0x00, 0x41, 0x22, 0x14, 0x08}, {0x02, 0x01, 0x51, 0x09, 0x06}, {0x32, 0x49, 0x79, 0x41, 0x3e},
+	{0x7e, 0x11, 0x11, 0x11, 0x7e}, {0x7f, 0x49, 0x49, 0x49, 0x36}, {0x3e, 0x41, 0x41, 0x41, 0x22},
+	{0x7f, 0x41, 0x41, 0x22, 0x1c}, {0x7f, 0x49, 0x49, 0x49, 0x41}, {0x7f, 0x09, 0x09, 0x09, 0x01},
+	{0x3e, 0x41, 0x49, 0x49, 0x7a}, {0x7f, 0x08, 0x08, 0x08, 0x7f}, {0x00, 0x41, 0x7f, 0x41, 0x00},
+	{0x20, 0x40, 0x41, 0x3f, 0x01}, {0x7f, 0x08, 0x14, 0x22, 0x41}, {0x7f, 0x40, 0x40, 0x40, 0x40},
+	{0x7f, 0x02, 0x0c, 0x02, 0x7f}, {0x7f, 0x04, 0x08, 0x10, 0x7f}, {0x3e, 0x41, 0x41, 0x41, 0x3e},
+	{0x7f, 0x09, 0x09, 0x09, 0x06}, {0x3e, 0x41, 0x51, 0x21, 0x5e}, {0x7f, 0x09, 0x19, 0x29, 0x46},
+	{0x46, 0x49, 0x49, 0x49, 0x31}, {0x01, 0x01, 0x7f, 0x01, 0x01}, {0x3f, 0x40, 0x40, 0x40, 0x3f},
+	{0x1f, 0x20, 0x40, 0x20, 0x1f}, {0x3f, 0x40, 0x38, 0x40, 0x3f}, {0x63, 0x14, 0x08, 0x14, 0x63},
+	{0x07, 0x08, 0x70, 0x08, 0x07}, {0x61, 0x51, 0x49, 0x45, 0x43}, {0x00, 0x7f, 0x41, 0x41, 0x00},
+	{0x02, 0x04, 0x08, 0x10, 0x20}, {0x00, 0x41, 0x41, 0x7f, 0x00}, {0x04, 0x02, 0x01, 0x02, 0x04},
+	{0x40, 0x40, 0x40, 0x40, 0x40}, {0x00, 0x01, 0x02, 0x04, 0x00}, {0x20, 0x54, 0x54, 0x54, 0x78},
+	{0x7f, 0x48, 0x44, 0x44, 0x38}, {0x38, 0x44, 0x44, 0x44, 0x20}, {0x38, 0x44, 0x44, 0x48, 0x7f},
+	{0x38, 0x54, 0x54, 0x54, 0x18}, {0x08, 0x7e, 0x09, 0x01, 0x02}, {0x0c, 0x52, 0x52, 0x52, 0x3e},
+	{0x7f, 0x08, 0x04, 0x04, 0x78}, {0x00, 0x44, 0x7d, 0x40, 0x00}, {0x20, 0x40, 0x44, 0x3d, 0x00},
+	{0x7f, 0x10, 0x28, 0x44, 0x00}, {0x00, 0x41, 0x7f, 0x40, 0x00}, {0x7c, 0x04, 0x18, 0x04, 0x78},
+	{0x7c, 0x08, 0x04, 0x04, 0x78}, {0x38, 0x44, 0x44, 0x44, 0x38}, {0x7c, 0x14, 0x14, 0x14, 0x08},
+	{0x08, 0x14, 0x14, 0x18, 0x7c}, {0x7c, 0x08, 0x04, 0x04, 0x08}, {0x48, 0x54, 0x54, 0x54, 0x20},
+	{0x04, 0x3f, 0x44, 0x40, 0x20}, {0x3c, 0x40, 0x40, 0x20, 0x7c}, {0x1c, 0x20, 0x40, 0x20, 0x1c},
+	{0x3c, 0x40, 0x30, 0x40, 0x3c}, {0x44, 0x28, 0x10, 0x28, 0x44}, {0x0c, 0x50, 0x50, 0x50, 0x3c},
+	{0x44, 0x64, 0x54, 0x4c, 0x44}, {0x00, 0x08, 0x36, 0x41, 0x00}, {0x00, 0x00, 0x7f, 0x00, 0x00},
+	{0x00, 0x41, 0x36, 0x08, 0x00}, {0x08, 0x04, 0x08, 0x10, 0x08},
+};
 
-        switch (direction)
-        {
-            case 0 : position.y -= MOVE_DIST; break;
-            case 1 : position.y += MOVE_DIST; break;
-            case 2 : position.x -= MOVE_DIST; break;
-            case 3 : position.x += MOVE_DIST; break;
-        }
+// One laid-out character: which glyph, and where its top-left corner goes.
+struct GlyphQuad {
+	std::int16_t x, y;
+	std::uint8_t glyph;
+};
 
-        time_at_last_move_ns_ = time_.time();
-    }
+// The font rasterized once.  Glyphs sit side by side in a coverage map for
+// backends that blit, and are also broken into the few rects that cover
+// each one for backends that can only fill.
+class GlyphAtlas {
+public:
+	static constexpr int GLYPH_WIDTH = 5;
+	static constexpr int GLYPH_HEIGHT = 7;
+	static constexpr int ADVANCE = 6;
+	static constexpr int LINE_HEIGHT = 10;
+	static constexpr int GLYPH_COUNT = 95;
 
-    bool isTimeToMove()
-    {
-        return ((time_.time() - time_at_last_move_ns_) >= move_time_ns_);
-    }
+	static const GlyphAtlas &get();
 
-    long time_at_last_move_ns_;
-    long move_time_ns_ {250'000'000};
-    Time time_;
-};
+	// Anything outside printable ASCII is shown as '?'.
+	static std::uint8_t glyphFor(char c)
+	{
+		return (c >= ' ' && c <= '~') ? static_cast<std::uint8_t>(c - ' ') : '?' - ' ';
+	}
 
-class Game {
-public:
-	Game();
+	// One byte per pixel, 0 or 1, GLYPH_COUNT * GLYPH_WIDTH wide.
+	const std::uint8_t *row(int glyph, int y) const
+	{
+		return &coverage_[static_cast<std::size_t>(y) * GLYPH_COUNT * GLYPH_WIDTH + glyph * GLYPH_WIDTH];
+	}
 
-	void run();
+	// The rects covering glyph, relative to its top-left corner.
+	const Rect *rects(int glyph) const { return &rects_[first_rect_[glyph]]; }
+	std::size_t rectCount(int glyph) const { return first_rect_[glyph + 1] - first_rect_[glyph]; }
 
 private:
-	GameDisplay gamedisplay_;
-	XEvent event_;
-	bool is_running_ = true;
-    bool game_over = false;
-    bool game_won = false;
-	Player player_;
-	std::vector<Food> food_;
-	std::vector<Ghost> ghosts_;
+	GlyphAtlas();
 
-	bool getEvent();
-    void updateGhosts();
-	void handleEvent();
-    void resetGame();
-	bool isPlayerWithinBounds();
-	void drawPlayer();
-	void draw();
-	void createFood();
-	void drawAllFood();
-	void createGhosts();
-	void drawAllGhosts();
-    void drawMessage();
-	void update();
-	void drawCharacter(const Character &obj) const;
+	std::vector<std::uint8_t> coverage_;
+	std::vector<Rect> rects_;
+	std::array<std::uint16_t, GLYPH_COUNT + 1> first_rect_ {};
 };
 
-Game::Game()
+const GlyphAtlas &GlyphAtlas::get()
 {
-	std::srand(std::time(nullptr));
-	createFood();
-	createGhosts();
+	static const GlyphAtlas atlas;
+	return atlas;
 }
 
-void Game::run()
+// Each row of a glyph is split into runs, and a run is merged into the rect
+// above it when both span the same columns.
+GlyphAtlas::GlyphAtlas()
+: coverage_(static_cast<std::size_t>(GLYPH_COUNT) * GLYPH_WIDTH * GLYPH_HEIGHT, 0)
 {
-	while (is_running_)
+	for (int g = 0; g < GLYPH_COUNT; ++g)
 	{
-        if (!game_over)
-            updateGhosts();
+		first_rect_[g] = static_cast<std::uint16_t>(rects_.size());
+		std::size_t open_from = rects_.size();
 
-        if (getEvent())
+		for (int y = 0; y < GLYPH_HEIGHT; ++y)
 		{
-			handleEvent();
-			if (!game_over && !isPlayerWithinBounds())
+			std::uint8_t *cov = &coverage_[static_cast<std::size_t>(y) * GLYPH_COUNT * GLYPH_WIDTH + g * GLYPH_WIDTH];
+			for (int x = 0; x < GLYPH_WIDTH; ++x)
+				cov[x] = (FONT_5X7[g][x] >> y) & 1;
+
+			std::size_t row_from = rects_.size();
+			for (int x = 0; x < GLYPH_WIDTH; )
 			{
-				printf("PLAYER OUT OF BOUNDS -- GAME OVER!! -- YOU LOSE!!\n");
-                game_over = true;
-                game_won = false;
+				if (!cov[x])
+				{
+					++x;
+					continue;
+				}
+				int x0 = x;
+				while (x < GLYPH_WIDTH && cov[x])
+					++x;
+
+				auto above = std::find_if(rects_.begin() + open_from, rects_.begin() + row_from, [&](const Rect &r) {
+					return r.x == x0 && r.width == x - x0 && r.y + r.height == y;
+				});
+				if (above != rects_.begin() + row_from)
+					++above->height;
+				else
+					rects_.push_back({x0, y, x - x0, 1});
 			}
 		}
 	}
+	first_rect_[GLYPH_COUNT] = static_cast<std::uint16_t>(rects_.size());
 }
 
-bool Game::getEvent()
-{
-	if (XPending(gamedisplay_.getDisplay()))
+// A frame's worth of laid-out glyphs in a fixed buffer, so laying out text
+// never allocates.  Glyphs beyond CAPACITY are dropped.
+class TextBatch {
+public:
+	static constexpr std::size_t CAPACITY = 2048;
+
+	// x, y is the baseline of the first line; '\n' starts a new one.
+	void layout(int x, int y, std::string_view str)
 	{
-		XNextEvent(gamedisplay_.getDisplay(), &event_);
-		printf("EVENT: %d\n", event_.type);
-		return true;
+		int pen = x;
+		int top = y - GlyphAtlas::GLYPH_HEIGHT;
+		for (char c: str)
+		{
+			if (c == '\n')
+			{
+				pen = x;
+				top += GlyphAtlas::LINE_HEIGHT;
+				continue;
+			}
+			if (c != ' ' && size_ < CAPACITY)
+				quads_[size_++] = {static_cast<std::int16_t>(pen), static_cast<std::int16_t>(top), GlyphAtlas::glyphFor(c)};
+			pen += GlyphAtlas::ADVANCE;
+		}
 	}
 
-	return false;
+	void append(const TextBatch &other)
+	{
+		std::size_t n = std::min(other.size_, CAPACITY - size_);
+		std::copy_n(other.quads_.begin(), n, quads_.begin() + size_);
+		size_ += n;
+	}
+
+	const GlyphQuad *data() const { return quads_.data(); }
+	std::size_t size() const { return size_; }
+	void clear() { size_ = 0; }
+
+private:
+	std::array<GlyphQuad, CAPACITY> quads_;
+	std::size_t size_ = 0;
+};
+
+// What the display has sent the server.  Backends keep running totals; a
+// frame's cost is the difference between two snapshots.
+struct ProtocolStats {
+	long requests = 0;
+	long bytes = 0;
+	long round_trips = 0;     // calls that blocked until the server replied
+
+	ProtocolStats operator-(const ProtocolStats &o) const
+	{
+		return {requests - o.requests, bytes - o.bytes, round_trips - o.round_trips};
+	}
+};
+
+// Request sizes on the wire, from the core protocol encoding.
+namespace wire {
+	constexpr long pad4(long n) { return (n + 3) & ~3L; }
+	constexpr long POLY_FILL_RECTANGLE = 12;   // plus RECTANGLE per rect
+	constexpr long RECTANGLE = 8;
+	constexpr long CHANGE_GC_ONE_VALUE = 16;
+	constexpr long CLEAR_AREA = 16;
+	constexpr long GET_GEOMETRY = 8;
+	constexpr long GET_INPUT_FOCUS = 4;
+	constexpr long SET_INPUT_FOCUS = 12;
+	constexpr long COPY_AREA = 28;
+	constexpr long CREATE_PIXMAP = 16;
+	constexpr long FREE_PIXMAP = 8;
+	constexpr long PUT_IMAGE = 24;            // plus pad4(data)
+	constexpr long CHANGE_GC_TWO_VALUES = 20;
 }
 
-void Game::drawPlayer()
+// Window, drawing and input for one backend.  Events are handed to the game
+// as XEvents whichever backend produced them, so the game only has one event
+// type to deal with.
+class GameDisplay {
+public:
+	static constexpr int DEFAULT_WIDTH = WINDOW_WIDTH;
+	static constexpr int DEFAULT_HEIGHT = WINDOW_HEIGHT;
+	static constexpr unsigned long BACKGROUND = 0x363d4d;
+	static constexpr unsigned long TEXT_COLOR = 0xf0f0f0;
+
+	virtual ~GameDisplay() = default;
+
+	virtual const char *name() const = 0;
+
+	// Waits up to timeout_ns for an event (forever if negative).  Returns
+	// false if none arrived.
+	virtual bool waitEvent(XEvent &ev, long timeout_ns) = 0;
+	// The next event already read off the connection, without waiting.
+	virtual bool queuedEvent(XEvent &ev) = 0;
+	virtual bool peekQueuedEvent(XEvent &ev) = 0;
+	// The connection's socket, for waiting on alongside other fds; -1 if none.
+	virtual int connectionFd() const = 0;
+
+	virtual unsigned keycodeFor(KeySym sym) = 0;
+	virtual bool hasDetectableAutoRepeat() const = 0;
+	virtual void takeFocus() = 0;
+	// Injects a key event through XTEST.  Returns false if unsupported.
+	virtual bool fakeKey(unsigned keycode, bool press) = 0;
+
+	virtual void drawRect(unsigned long col, int x, int y, int width, int height) = 0;
+	// Lays the string out in the built-in font and queues it.  All of a
+	// frame's text goes out as one batch at flush(), on top of the rest.
+	void drawText(int x, int y, std::string_view str) { text_.layout(x, y, str); }
+	void drawText(const TextBatch &batch) { text_.append(batch); }
+	virtual void clear() = 0;
+	// Sends the queued text, then everything else still buffered.
+	virtual void flush() = 0;
+	// Returns once the server has processed everything sent so far.
+	virtual void sync() = 0;
+	virtual Rect getGeometry() = 0;
+
+	// Walls and food are drawn into a layer that is kept between frames and
+	// copied in whole, so a frame only redraws what moves.  Between begin and
+	// end all drawing goes to the layer; clear_layer starts it over from the
+	// background, otherwise it is patched in place.
+	virtual void beginStaticLayer(bool clear_layer) = 0;
+	virtual void endStaticLayer() = 0;
+	// Replaces the whole window contents with the layer.
+	virtual void drawStaticLayer() = 0;
+
+	// Uploads the atlas once, up front; drawSprites then draws n copies of
+	// one sprite from it at the given top-left positions.
+	virtual void loadSprites(const SpriteAtlas &atlas) = 0;
+	virtual void drawSprites(int sprite, const Point *positions, std::size_t n) = 0;
+
+	const ProtocolStats &protocolTotals() const { return totals_; }
+
+protected:
+	ProtocolStats totals_;
+	TextBatch text_;
+
+	// Draws the frame's glyphs in one colour.  By default every glyph rect
+	// is a drawRect, for backends that already batch fills.
+	virtual void drawGlyphs(const GlyphQuad *quads, std::size_t n, unsigned long col);
+	void flushText();
+};
+
+void GameDisplay::drawGlyphs(const GlyphQuad *quads, std::size_t n, unsigned long col)
 {
-	drawCharacter(player_);
+	const GlyphAtlas &font = GlyphAtlas::get();
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		const Rect *r = font.rects(quads[i].glyph);
+		for (std::size_t k = 0, rn = font.rectCount(quads[i].glyph); k < rn; ++k)
+			drawRect(col, quads[i].x + r[k].x, quads[i].y + r[k].y, r[k].width, r[k].height);
+	}
 }
 
-void Game::draw()
+void GameDisplay::flushText()
 {
-	drawAllFood();
-	drawAllGhosts();
-	drawPlayer();
-    drawMessage();
+	if (text_.size() == 0)
+		return;
+
+	drawGlyphs(text_.data(), text_.size(), TEXT_COLOR);
+	text_.clear();
 }
 
-void Game::createFood()
+class XlibDisplay : public GameDisplay {
+public:
+	XlibDisplay();
+	~XlibDisplay() override;
+
+	const char *name() const override { return "xlib"; }
+
+	bool waitEvent(XEvent &ev, long timeout_ns) override;
+	bool queuedEvent(XEvent &ev) override;
+	bool peekQueuedEvent(XEvent &ev) override;
+	int connectionFd() const override { return ConnectionNumber(display_); }
+
+	unsigned keycodeFor(KeySym sym) override;
+	bool hasDetectableAutoRepeat() const override;
+	void takeFocus() override;
+	bool fakeKey(unsigned keycode, bool press) override;
+
+	void drawRect(unsigned long col, int x, int y, int width, int height) override;
+	void clear() override;
+	void flush() override;
+	void sync() override;
+	Rect getGeometry() override;
+
+	void beginStaticLayer(bool clear_layer) override;
+	void endStaticLayer() override;
+	void drawStaticLayer() override;
+
+	void loadSprites(const SpriteAtlas &atlas) override;
+	void drawSprites(int sprite, const Point *positions, std::size_t n) override;
+
+protected:
+	void drawGlyphs(const GlyphQuad *quads, std::size_t n, unsigned long col) override;
+
+private:
+	Display *display_;
+	int screen_;
+	Window window_;
+	Drawable target_;
+	Pixmap layer_ = None;
+	Size layer_size_ {0, 0};
+	bool detectable_auto_repeat_ = false;
+	Rect geometry_ {0, 0, DEFAULT_WIDTH, DEFAULT_HEIGHT};
+	unsigned long foreground_ = ~0ul;
+	Pixmap atlas_ = None;
+	Pixmap atlas_mask_ = None;
+	GC sprite_gc_ = nullptr;
+	std::array<bool, SPRITE_COUNT> sprite_opaque_ {};
+	std::vector<XRectangle> glyph_rects_;
+
+	template <typename F>
+	void traced(long bytes, long extend_bytes, F call);
+	void trackGeometry(const XEvent &ev);
+};
+
+// Makes one Xlib call and accounts for it.  Requests come from the
+// XNextRequest delta; Xlib may append to the previous request instead (it
+// merges consecutive fills), in which case only extend_bytes went out.  If
+// the server has answered a request sent during the call, the call waited
+// for it.
+template <typename F>
+void XlibDisplay::traced(long bytes, long extend_bytes, F call)
 {
-	food_.clear();
-	food_.resize(10);
-	const int MAXX = 800;
-	const int MAXY = 600;
+	unsigned long first = XNextRequest(display_);
+	call();
+	unsigned long sent = XNextRequest(display_) - first;
 
-	for (auto &f: food_)
-	{
-		f.position.x = (std::rand() % MAXX)/10*10;
-		f.position.y = (std::rand() % MAXY)/10*10;
-	}
+	totals_.requests += sent;
+	totals_.bytes += sent ? bytes : extend_bytes;
+	if (sent && LastKnownRequestProcessed(display_) >= first)
+		++totals_.round_trips;
 }
 
-void Game::drawAllFood()
+XlibDisplay::XlibDisplay()
 {
-	for (auto &f: food_)
+	display_ = XOpenDisplay(NULL);
+	if (display_ == NULL)
 	{
-		drawCharacter(f);
+		throw std::runtime_error("Unable to open the display");
 	}
+
+	screen_ = DefaultScreen(display_);
+
+	window_ = XCreateSimpleWindow(display_, RootWindow(display_,screen_), 0, 0, DEFAULT_WIDTH, DEFAULT_HEIGHT, 1, 
+                             BlackPixel(display_,screen_), BACKGROUND); //WhitePixel(display_,screen_));
+
+	XSelectInput(display_, window_, KeyPressMask | KeyReleaseMask | ExposureMask | FocusChangeMask
+	             | VisibilityChangeMask | StructureNotifyMask);
+	XMapWindow(display_, window_);
+	target_ = window_;
+
+	// Copies from the static layer never need to report exposures.
+	XSetGraphicsExposures(display_, DefaultGC(display_, screen_), False);
+
+	// Without this a held key arrives as a stream of release/press pairs.
+	Bool supported = False;
+	XkbSetDetectableAutoRepeat(display_, True, &supported);
+	detectable_auto_repeat_ = supported;
 }
 
-void Game::createGhosts()
+XlibDisplay::~XlibDisplay()
 {
-	ghosts_.clear();
-	ghosts_.resize(10);
-	const int MAXX = 800;
-	const int MAXY = 600;
+	if (sprite_gc_)
+		XFreeGC(display_, sprite_gc_);
+	if (atlas_mask_ != None)
+		XFreePixmap(display_, atlas_mask_);
+	if (atlas_ != None)
+		XFreePixmap(display_, atlas_);
+	if (layer_ != None)
+		XFreePixmap(display_, layer_);
+	XCloseDisplay(display_);
+}
 
-	for (auto &g: ghosts_)
+bool XlibDisplay::waitEvent(XEvent &ev, long timeout_ns)
+{
+	if (timeout_ns >= 0 && !XPending(display_))
 	{
-		g.position.x = (std::rand() % MAXX)/10*10;
-		g.position.y = (std::rand() % MAXY)/10*10;
+		pollfd pfd {ConnectionNumber(display_), POLLIN, 0};
+		poll(&pfd, 1, static_cast<int>((timeout_ns + 999'999) / 1'000'000));
+		if (!XPending(display_))
+			return false;
 	}
+
+	XNextEvent(display_, &ev);
+	trackGeometry(ev);
+	return true;
 }
 
-void Game::drawAllGhosts()
+bool XlibDisplay::queuedEvent(XEvent &ev)
 {
-	for (auto &g: ghosts_)
-	{
-		drawCharacter(g);
-	}
+	if (XEventsQueued(display_, QueuedAlready) == 0)
+		return false;
+
+	XNextEvent(display_, &ev);
+	trackGeometry(ev);
+	return true;
 }
 
-void Game::drawMessage()
+bool XlibDisplay::peekQueuedEvent(XEvent &ev)
 {
-    if (!game_over)
-        return;
+	if (XEventsQueued(display_, QueuedAfterReading) == 0)
+		return false;
 
-    if (game_won)
-        gamedisplay_.drawText(100, 100, "YOU WIN!!  PRESS SPACEBAR TO RESTART...");
-    else
-        gamedisplay_.drawText(100, 100, "YOU LOSE!! PRESS SPACEBAR TO RESTART...");
+	XPeekEvent(display_, &ev);
+	return true;
 }
 
-void Game::update()
+// StructureNotifyMask already delivers every resize, so the geometry never
+// needs asking for.
+void XlibDisplay::trackGeometry(const XEvent &ev)
 {
-  	auto iter = std::find_if(food_.begin(), food_.end(), [&](const Food &f){
-		return rectangleIntersect(player_.bounds(), f.bounds());
-	});
+	if (ev.type == ConfigureNotify)
+		geometry_ = {ev.xconfigure.x, ev.xconfigure.y, ev.xconfigure.width, ev.xconfigure.height};
+}
 
-	if (iter != food_.end())
-	{
-		food_.erase(iter);
-	}
+unsigned XlibDisplay::keycodeFor(KeySym sym)
+{
+	return XKeysymToKeycode(display_, sym);
+}
+
+bool XlibDisplay::hasDetectableAutoRepeat() const
+{
+	return detectable_auto_repeat_;
+}
+
+// Used by the synthetic input mode, where there may be no window manager to
+// hand the window the keyboard.
+void XlibDisplay::takeFocus()
+{
+	sync();
+	traced(wire::SET_INPUT_FOCUS, 0, [&] { XSetInputFocus(display_, window_, RevertToParent, CurrentTime); });
+}
+
+bool XlibDisplay::fakeKey(unsigned keycode, bool press)
+{
+#ifdef HAVE_XTEST
+	XTestFakeKeyEvent(display_, keycode, press ? True : False, CurrentTime);
+	return true;
+#else
+	(void)keycode;
+	(void)press;
+	return false;
+#endif
+}
 
-	if (food_.empty())
+void XlibDisplay::drawRect(unsigned long col, int x, int y, int width, int height)
+{
+	// The GC change itself goes out with the next drawing request.
+	if (col != foreground_)
 	{
-		game_over = true;
-        game_won = true;
+		XSetForeground(display_, DefaultGC(display_,screen_), col);
+		totals_.bytes += wire::CHANGE_GC_ONE_VALUE;
+		foreground_ = col;
 	}
-  	
-	auto iter_ghosts = std::find_if(ghosts_.begin(), ghosts_.end(), [&](const Ghost &g){
-		return rectangleIntersect(player_.bounds(), g.bounds());
+
+	traced(wire::POLY_FILL_RECTANGLE + wire::RECTANGLE, wire::RECTANGLE, [&] {
+		XFillRectangle(display_, target_, DefaultGC(display_,screen_), x,y, width, height);
 	});
+}
 
-	if (iter_ghosts != ghosts_.end())
-	{
-        game_over = true;
-		game_won = false;
-		std::cout << "YOU LOSE!!\n";
-	}
+void XlibDisplay::clear()
+{
+	traced(wire::CLEAR_AREA, 0, [&] { XClearWindow(display_, window_); });
 }
 
-void Game::drawCharacter(const Character &obj) const
+void XlibDisplay::flush()
 {
-	gamedisplay_.drawRect(obj.color, 
-		obj.position.x,
-		obj.position.y,
-		obj.size.width,
-		obj.size.height);
+	flushText();
+	XFlush(display_);
 }
 
-void Game::updateGhosts()
+void XlibDisplay::sync()
 {
-    bool ghost_moved = false;
-    for (auto &g: ghosts_)
-    {
-        if (g.isTimeToMove()) {
-            g.move();
-            ghost_moved = true;
-        }
-    }
+	traced(wire::GET_INPUT_FOCUS, 0, [&] { XSync(display_, False); });
+}
 
-    if (ghost_moved)
-        gamedisplay_.redraw();
+Rect XlibDisplay::getGeometry()
+{
+	return geometry_;
 }
 
-void Game::handleEvent()
+// Every glyph rect of the frame in one XFillRectangles.  The rect buffer is
+// kept between frames, so it stops growing once it has seen the longest text.
+void XlibDisplay::drawGlyphs(const GlyphQuad *quads, std::size_t n, unsigned long col)
 {
-	if (event_.type == Expose)
+	const GlyphAtlas &font = GlyphAtlas::get();
+	glyph_rects_.clear();
+	for (std::size_t i = 0; i < n; ++i)
 	{
-		draw();
+		const Rect *r = font.rects(quads[i].glyph);
+		for (std::size_t k = 0, rn = font.rectCount(quads[i].glyph); k < rn; ++k)
+			glyph_rects_.push_back({static_cast<short>(quads[i].x + r[k].x), static_cast<short>(quads[i].y + r[k].y),
+			                        static_cast<unsigned short>(r[k].width), static_cast<unsigned short>(r[k].height)});
 	}
 
-	if (event_.type == KeyPress)
+	if (col != foreground_)
 	{
-		printf("KeyPress Event: %d\n", event_.xkey.keycode);
+		XSetForeground(display_, DefaultGC(display_,screen_), col);
+		totals_.bytes += wire::CHANGE_GC_ONE_VALUE;
+		foreground_ = col;
+	}
 
-		switch (event_.xkey.keycode)
-		{
-			case KEY_UP       : printf("KEY_UP\n");    if (!game_over) { player_.position.y -= 10; gamedisplay_.redraw(); } break;
-			case KEY_DOWN     : printf("KEY_DOWN\n");  if (!game_over) { player_.position.y += 10; gamedisplay_.redraw(); } break;
-			case KEY_LEFT     : printf("KEY_LEFT\n");  if (!game_over) { player_.position.x -= 10; gamedisplay_.redraw(); } break;
-			case KEY_RIGHT    : printf("KEY_RIGHT\n"); if (!game_over) { player_.position.x += 10; gamedisplay_.redraw(); } break;
-			
-			case KEY_SPACEBAR : printf("KEY_SPACEBAR\n"); if (game_over) resetGame(); break;
+	long rect_bytes = wire::RECTANGLE * static_cast<long>(glyph_rects_.size());
+	traced(wire::POLY_FILL_RECTANGLE + rect_bytes, rect_bytes, [&] {
+		XFillRectangles(display_, target_, DefaultGC(display_, screen_), glyph_rects_.data(), glyph_rects_.size());
+	});
+}
 
-			case KEY_ESCAPE   : printf("KEY_ESCAPE\n"); 
-							    is_running_ = false; break;
-		}
-		update();
+// The layer is a server-side pixmap the size of the window, recreated if
+// the window has been resized since.
+void XlibDisplay::beginStaticLayer(bool clear_layer)
+{
+	if (layer_ == None || layer_size_.width != geometry_.width || layer_size_.height != geometry_.height)
+	{
+		if (layer_ != None)
+			traced(wire::FREE_PIXMAP, 0, [&] { XFreePixmap(display_, layer_); });
+		layer_size_ = {geometry_.width, geometry_.height};
+		traced(wire::CREATE_PIXMAP, 0, [&] {
+			layer_ = XCreatePixmap(display_, window_, layer_size_.width, layer_size_.height,
+			                       DefaultDepth(display_, screen_));
+		});
+		clear_layer = true;
 	}
+
+	target_ = layer_;
+	if (clear_layer)
+		drawRect(BACKGROUND, 0, 0, layer_size_.width, layer_size_.height);
 }
 
-void Game::resetGame()
+void XlibDisplay::endStaticLayer()
 {
-    player_.position = {10, 10};
-    createFood();
-    createGhosts();
-    game_won = false;
-    game_over = false;
+	target_ = window_;
 }
 
-bool Game::isPlayerWithinBounds()
+void XlibDisplay::drawStaticLayer()
 {
-	Rect w = gamedisplay_.getGeometry();
-	
-	if (   player_.position.x < 0 || player_.position.x > w.width 
-		|| player_.position.y < 0 || player_.position.y > w.height)
+	if (layer_ == None)
 	{
-		return false;
+		clear();
+		return;
 	}
-	
-	return true;
-}
 
+	traced(wire::COPY_AREA, 0, [&] {
+		XCopyArea(display_, layer_, window_, DefaultGC(display_, screen_), 0, 0,
+		          layer_size_.width, layer_size_.height, 0, 0);
+	});
 }
 
-int main()
+// The atlas goes to the server once as an image, with a 1-bit clip mask of
+// the pixels that have any alpha.  Fully opaque sprites skip the mask.
+void XlibDisplay::loadSprites(const SpriteAtlas &atlas)
 {
-	mygame::Game g;
+	const int stride = (atlas.width + 7) / 8;
+	std::vector<char> mask(static_cast<std::size_t>(stride) * atlas.height, 0);
 
-	g.run();
+	int depth = DefaultDepth(display_, screen_);
+	XImage *image = XCreateImage(display_, DefaultVisual(display_, screen_), depth, ZPixmap, 0, nullptr,
+	                             atlas.width, atlas.height, 32, 0);
+	if (!image)
+		throw std::runtime_error("Unable to create the sprite atlas image");
+	image->data = static_cast<char *>(std::malloc(static_cast<std::size_t>(image->bytes_per_line) * atlas.height));
 
-	return 0;
+	for (int y = 0; y < atlas.height; ++y)
+		for (int x = 0; x < atlas.width; ++x)
+		{
+			XPutPixel(image, x, y, atlas.flattened(x, y, BACKGROUND));
+			if (atlas.at(x, y) >> 24)
+				mask[static_cast<std::size_t>(y) * stride + x / 8] |= 1 << (x % 8);
+		}
+
+	traced(wire::CREATE_PIXMAP, 0, [&] {
+		atlas_ = XCreatePixmap(display_, window_, atlas.width, atlas.height, depth);
+	});
+	traced(wire::PUT_IMAGE + wire::pad4(static_cast<long>(image->bytes_per_line) * atlas.height), 0, [&] {
+		XPutImage(display_, atlas_, DefaultGC(display_, screen_), image, 0, 0, 0, 0, atlas.width, atlas.height);
+	});
+	XDestroyImage(image);
+
+	// XCreateBitmapFromData also makes and frees a scratch GC.
+	traced(wire::CREATE_PIXMAP + wire::PUT_IMAGE + wire::pad4(4L * atlas.height * ((stride + 3) / 4)), 0, [&] {
+		atlas_mask_ = XCreateBitmapFromData(display_, window_, mask.data(), atlas.width, atlas.height);
+	});
+
+	XGCValues values;
+	values.graphics_exposures = False;
+	values.clip_mask = atlas_mask_;
+	sprite_gc_ = XCreateGC(display_, window_, GCGraphicsExposures | GCClipMask, &values);
+
+	for (int s = 0; s < SPRITE_COUNT; ++s)
+		sprite_opaque_[s] = atlas.opaque(s);
+}
+
+// One CopyArea per instance.  The mask is in atlas coordinates, so masked
+// sprites also move the clip origin each time; Xlib sends that as a
+// ChangeGC just ahead of the copy.
+void XlibDisplay::drawSprites(int sprite, const Point *positions, std::size_t n)
+{
+	if (atlas_ == None)
+		return;
+
+	const int S = SpriteAtlas::SPRITE_SIZE;
+	const int sx = SpriteAtlas::originX(sprite);
+	GC gc = sprite_opaque_[sprite] ? DefaultGC(display_, screen_) : sprite_gc_;
+
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		const Point &p = positions[i];
+		if (gc == sprite_gc_)
+		{
+			XSetClipOrigin(display_, sprite_gc_, p.x - sx, p.y);
+			totals_.bytes += wire::CHANGE_GC_TWO_VALUES;
+		}
+		traced(wire::COPY_AREA, 0, [&] { XCopyArea(display_, atlas_, target_, gc, sx, 0, S, S, p.x, p.y); });
+	}
+}
+
+#ifdef HAVE_XCB
+// The same window driven through libxcb.  Nothing here waits on the server
+// unless it has to: the geometry request for the next call is sent as soon
+// as the previous reply is taken, fills are batched into one
+// xcb_poly_fill_rectangle per run of same-coloured rects, and the connection
+// is flushed once per frame.
+class XcbDisplay : public GameDisplay {
+public:
+	XcbDisplay();
+	~XcbDisplay() override;
+
+	const char *name() const override { return "xcb"; }
+
+	bool waitEvent(XEvent &ev, long timeout_ns) override;
+	bool queuedEvent(XEvent &ev) override;
+	bool peekQueuedEvent(XEvent &ev) override;
+	int connectionFd() const override { return xcb_get_file_descriptor(conn_); }
+
+	unsigned keycodeFor(KeySym sym) override;
+	bool hasDetectableAutoRepeat() const override { return false; }
+	void takeFocus() override;
+	bool fakeKey(unsigned, bool) override { return false; }
+
+	void drawRect(unsigned long col, int x, int y, int width, int height) override;
+	void clear() override;
+	void flush() override;
+	void sync() override;
+	Rect getGeometry() override;
+
+	void beginStaticLayer(bool clear_layer) override;
+	void endStaticLayer() override;
+	void drawStaticLayer() override;
+
+	void loadSprites(const SpriteAtlas &atlas) override;
+	void drawSprites(int sprite, const Point *positions, std::size_t n) override;
+
+private:
+	xcb_connection_t *conn_;
+	xcb_screen_t *screen_;
+	xcb_window_t window_;
+	xcb_drawable_t target_;
+	xcb_pixmap_t layer_ = XCB_NONE;
+	Size layer_size_ {0, 0};
+	xcb_gcontext_t gc_;
+	xcb_get_geometry_cookie_t geometry_cookie_;
+	Rect geometry_ {0, 0, DEFAULT_WIDTH, DEFAULT_HEIGHT};
+	unsigned long run_color_ = 0;
+	std::vector<xcb_rectangle_t> run_;
+	xcb_generic_event_t *lookahead_ = nullptr;
+	std::vector<xcb_keysym_t> keysyms_;
+	int min_keycode_ = 0;
+	int keysyms_per_keycode_ = 0;
+	unsigned last_sequence_ = 0;
+	xcb_pixmap_t atlas_ = XCB_NONE;
+	xcb_pixmap_t atlas_mask_ = XCB_NONE;
+	xcb_gcontext_t sprite_gc_ = XCB_NONE;
+	std::array<bool, SPRITE_COUNT> sprite_opaque_ {};
+
+	void flushRun();
+	void count(unsigned sequence, long bytes);
+	bool translate(xcb_generic_event_t *e, XEvent &ev);
+	xcb_generic_event_t *nextQueued();
+};
+
+XcbDisplay::XcbDisplay()
+{
+	int screen_num = 0;
+	conn_ = xcb_connect(NULL, &screen_num);
+	if (xcb_connection_has_error(conn_))
+	{
+		xcb_disconnect(conn_);
+		throw std::runtime_error("Unable to open the display");
+	}
+
+	xcb_screen_iterator_t it = xcb_setup_roots_iterator(xcb_get_setup(conn_));
+	for (int i = 0; i < screen_num; ++i)
+		xcb_screen_next(&it);
+	screen_ = it.data;
+
+	window_ = xcb_generate_id(conn_);
+	std::uint32_t values[] = {
+		static_cast<std::uint32_t>(BACKGROUND),
+		screen_->black_pixel,
+		XCB_EVENT_MASK_KEY_PRESS | XCB_EVENT_MASK_KEY_RELEASE | XCB_EVENT_MASK_EXPOSURE
+			| XCB_EVENT_MASK_FOCUS_CHANGE | XCB_EVENT_MASK_VISIBILITY_CHANGE
+			| XCB_EVENT_MASK_STRUCTURE_NOTIFY
+	};
+	xcb_create_window(conn_, XCB_COPY_FROM_PARENT, window_, screen_->root, 0, 0,
+	                  DEFAULT_WIDTH, DEFAULT_HEIGHT, 1, XCB_WINDOW_CLASS_INPUT_OUTPUT,
+	                  screen_->root_visual, XCB_CW_BACK_PIXEL | XCB_CW_BORDER_PIXEL | XCB_CW_EVENT_MASK,
+	                  values);
+
+	gc_ = xcb_generate_id(conn_);
+	std::uint32_t gc_values[] = {screen_->black_pixel, 0};
+	xcb_create_gc(conn_, gc_, window_, XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES, gc_values);
+
+	// Ask for the keyboard map and the first geometry up front; both replies
+	// are collected later.
+	const xcb_setup_t *setup = xcb_get_setup(conn_);
+	min_keycode_ = setup->min_keycode;
+	xcb_get_keyboard_mapping_cookie_t map_cookie =
+		xcb_get_keyboard_mapping(conn_, setup->min_keycode, setup->max_keycode - setup->min_keycode + 1);
+
+	xcb_map_window(conn_, window_);
+	target_ = window_;
+	geometry_cookie_ = xcb_get_geometry(conn_, window_);
+	xcb_flush(conn_);
+
+	last_sequence_ = geometry_cookie_.sequence;
+	xcb_get_keyboard_mapping_reply_t *map = xcb_get_keyboard_mapping_reply(conn_, map_cookie, nullptr);
+	++totals_.round_trips;
+	if (map)
+	{
+		keysyms_per_keycode_ = map->keysyms_per_keycode;
+		xcb_keysym_t *syms = xcb_get_keyboard_mapping_keysyms(map);
+		keysyms_.assign(syms, syms + xcb_get_keyboard_mapping_keysyms_length(map));
+		std::free(map);
+	}
+}
+
+XcbDisplay::~XcbDisplay()
+{
+	std::free(lookahead_);
+	if (sprite_gc_ != XCB_NONE)
+		xcb_free_gc(conn_, sprite_gc_);
+	if (atlas_mask_ != XCB_NONE)
+		xcb_free_pixmap(conn_, atlas_mask_);
+	if (atlas_ != XCB_NONE)
+		xcb_free_pixmap(conn_, atlas_);
+	if (layer_ != XCB_NONE)
+		xcb_free_pixmap(conn_, layer_);
+	xcb_discard_reply(conn_, geometry_cookie_.sequence);
+	xcb_disconnect(conn_);
+}
+
+// Every request returns a cookie carrying its sequence number, so the
+// request count is the sequence delta.
+void XcbDisplay::count(unsigned sequence, long bytes)
+{
+	totals_.requests += sequence - last_sequence_;
+	totals_.bytes += bytes;
+	last_sequence_ = sequence;
+}
+
+xcb_generic_event_t *XcbDisplay::nextQueued()
+{
+	if (lookahead_)
+	{
+		xcb_generic_event_t *e = lookahead_;
+		lookahead_ = nullptr;
+		return e;
+	}
+	return xcb_poll_for_queued_event(conn_);
+}
+
+bool XcbDisplay::waitEvent(XEvent &ev, long timeout_ns)
+{
+	for (;;)
+	{
+		xcb_generic_event_t *e = lookahead_ ? nextQueued() : xcb_poll_for_event(conn_);
+		if (!e)
+		{
+			if (xcb_connection_has_error(conn_))
+				throw std::runtime_error("Lost the connection to the display");
+			if (timeout_ns == 0)
+				return false;
+
+			pollfd pfd {xcb_get_file_descriptor(conn_), POLLIN, 0};
+			int timeout_ms = timeout_ns < 0 ? -1 : static_cast<int>((timeout_ns + 999'999) / 1'000'000);
+			poll(&pfd, 1, timeout_ms);
+			e = xcb_poll_for_event(conn_);
+			if (!e)
+			{
+				if (timeout_ns < 0)
+					continue;
+				return false;
+			}
+		}
+
+		bool known = translate(e, ev);
+		std::free(e);
+		if (known)
+			return true;
+	}
+}
+
+bool XcbDisplay::queuedEvent(XEvent &ev)
+{
+	while (xcb_generic_event_t *e = nextQueued())
+	{
+		bool known = translate(e, ev);
+		std::free(e);
+		if (known)
+			return true;
+	}
+	return false;
+}
+
+// Events the game doesn't read are dropped here, as the other readers
+// drop them, so they can't hide the one behind.
+bool XcbDisplay::peekQueuedEvent(XEvent &ev)
+{
+	for (;;)
+	{
+		if (!lookahead_)
+			lookahead_ = xcb_poll_for_event(conn_);
+		if (!lookahead_)
+			return false;
+		if (translate(lookahead_, ev))
+			return true;
+		std::free(lookahead_);
+		lookahead_ = nullptr;
+	}
+}
+
+// Fills in the fields of an XEvent the game looks at.  Event codes are the
+// same in both libraries.
+bool XcbDisplay::translate(xcb_generic_event_t *e, XEvent &ev)
+{
+	std::memset(&ev, 0, sizeof(ev));
+	ev.type = e->response_type & 0x7f;
+
+	switch (ev.type)
+	{
+		case XCB_EXPOSE:
+		{
+			auto *x = reinterpret_cast<xcb_expose_event_t *>(e);
+			ev.xexpose.x = x->x;
+			ev.xexpose.y = x->y;
+			ev.xexpose.width = x->width;
+			ev.xexpose.height = x->height;
+			ev.xexpose.count = x->count;
+			return true;
+		}
+		case XCB_KEY_PRESS:
+		case XCB_KEY_RELEASE:
+		{
+			auto *k = reinterpret_cast<xcb_key_press_event_t *>(e);
+			ev.xkey.keycode = k->detail;
+			ev.xkey.time = k->time;
+			ev.xkey.state = k->state;
+			return true;
+		}
+		case XCB_FOCUS_IN:
+		case XCB_FOCUS_OUT:
+			ev.xfocus.mode = reinterpret_cast<xcb_focus_in_event_t *>(e)->mode;
+			ev.xfocus.detail = reinterpret_cast<xcb_focus_in_event_t *>(e)->detail;
+			return true;
+		case XCB_VISIBILITY_NOTIFY:
+			ev.xvisibility.state = reinterpret_cast<xcb_visibility_notify_event_t *>(e)->state;
+			return true;
+		case XCB_MAP_NOTIFY:
+		case XCB_UNMAP_NOTIFY:
+		case XCB_CONFIGURE_NOTIFY:
+			return true;
+		default:
+			return false;
+	}
+}
+
+unsigned XcbDisplay::keycodeFor(KeySym sym)
+{
+	if (keysyms_per_keycode_ == 0)
+		return 0;
+
+	for (std::size_t i = 0; i < keysyms_.size(); ++i)
+		if (keysyms_[i] == sym)
+			return static_cast<unsigned>(min_keycode_ + i / keysyms_per_keycode_);
+	return 0;
+}
+
+void XcbDisplay::takeFocus()
+{
+	sync();
+	count(xcb_set_input_focus(conn_, XCB_INPUT_FOCUS_PARENT, window_, XCB_CURRENT_TIME).sequence,
+	      wire::SET_INPUT_FOCUS);
+	xcb_flush(conn_);
+}
+
+void XcbDisplay::drawRect(unsigned long col, int x, int y, int width, int height)
+{
+	if (col != run_color_ && !run_.empty())
+		flushRun();
+	run_color_ = col;
+	run_.push_back({static_cast<std::int16_t>(x), static_cast<std::int16_t>(y),
+	                static_cast<std::uint16_t>(width), static_cast<std::uint16_t>(height)});
+}
+
+void XcbDisplay::flushRun()
+{
+	if (run_.empty())
+		return;
+
+	std::uint32_t fg = static_cast<std::uint32_t>(run_color_);
+	count(xcb_change_gc(conn_, gc_, XCB_GC_FOREGROUND, &fg).sequence, wire::CHANGE_GC_ONE_VALUE);
+	count(xcb_poly_fill_rectangle(conn_, target_, gc_, run_.size(), run_.data()).sequence,
+	      wire::POLY_FILL_RECTANGLE + wire::RECTANGLE * static_cast<long>(run_.size()));
+	run_.clear();
+}
+
+void XcbDisplay::clear()
+{
+	run_.clear();
+	count(xcb_clear_area(conn_, 0, window_, 0, 0, 0, 0).sequence, wire::CLEAR_AREA);
+}
+
+// The glyph rects all join one run, so the text is a single request.
+void XcbDisplay::flush()
+{
+	flushText();
+	flushRun();
+	xcb_flush(conn_);
+}
+
+void XcbDisplay::sync()
+{
+	flushRun();
+	xcb_get_input_focus_cookie_t cookie = xcb_get_input_focus(conn_);
+	count(cookie.sequence, wire::GET_INPUT_FOCUS);
+	std::free(xcb_get_input_focus_reply(conn_, cookie, nullptr));
+	++totals_.round_trips;
+}
+
+// Takes the reply to the request sent last time (normally long since
+// arrived) and sends the next one, so the answer can be a frame stale but
+// the call never waits for a fresh round trip.
+Rect XcbDisplay::getGeometry()
+{
+	xcb_get_geometry_reply_t *reply = nullptr;
+	if (xcb_poll_for_reply(conn_, geometry_cookie_.sequence, reinterpret_cast<void **>(&reply), nullptr) == 0)
+	{
+		reply = xcb_get_geometry_reply(conn_, geometry_cookie_, nullptr);
+		++totals_.round_trips;
+	}
+
+	if (reply)
+	{
+		geometry_ = {reply->x, reply->y, reply->width, reply->height};
+		std::free(reply);
+	}
+
+	geometry_cookie_ = xcb_get_geometry(conn_, window_);
+	count(geometry_cookie_.sequence, wire::GET_GEOMETRY);
+	return geometry_;
+}
+
+void XcbDisplay::beginStaticLayer(bool clear_layer)
+{
+	flushRun();
+	if (layer_ == XCB_NONE || layer_size_.width != geometry_.width || layer_size_.height != geometry_.height)
+	{
+		if (layer_ != XCB_NONE)
+			count(xcb_free_pixmap(conn_, layer_).sequence, wire::FREE_PIXMAP);
+		layer_ = xcb_generate_id(conn_);
+		layer_size_ = {geometry_.width, geometry_.height};
+		count(xcb_create_pixmap(conn_, screen_->root_depth, layer_, window_,
+		                        layer_size_.width, layer_size_.height).sequence, wire::CREATE_PIXMAP);
+		clear_layer = true;
+	}
+
+	target_ = layer_;
+	if (clear_layer)
+		drawRect(BACKGROUND, 0, 0, layer_size_.width, layer_size_.height);
+}
+
+void XcbDisplay::endStaticLayer()
+{
+	flushRun();
+	target_ = window_;
+}
+
+void XcbDisplay::drawStaticLayer()
+{
+	if (layer_ == XCB_NONE)
+	{
+		clear();
+		return;
+	}
+
+	run_.clear();
+	count(xcb_copy_area(conn_, layer_, window_, gc_, 0, 0, 0, 0,
+	                    layer_size_.width, layer_size_.height).sequence, wire::COPY_AREA);
+}
+
+// Images are sent in the server's own format, so this only handles the
+// usual 32 bits per pixel for the root depth.  The mask is a 1-bit pixmap
+// laid out per the setup's bitmap bit order and scanline pad.
+void XcbDisplay::loadSprites(const SpriteAtlas &atlas)
+{
+	flushRun();
+	const xcb_setup_t *setup = xcb_get_setup(conn_);
+
+	int bpp = 0;
+	for (xcb_format_iterator_t it = xcb_setup_pixmap_formats_iterator(setup); it.rem; xcb_format_next(&it))
+		if (it.data->depth == screen_->root_depth)
+			bpp = it.data->bits_per_pixel;
+	if (bpp != 32)
+		throw std::runtime_error("The xcb backend only loads sprites on 32 bpp screens");
+
+	std::size_t bytes = static_cast<std::size_t>(atlas.width) * atlas.height * 4;
+	if (bytes + wire::PUT_IMAGE > xcb_get_maximum_request_length(conn_) * 4ul)
+		throw std::runtime_error("The sprite atlas is too large for one PutImage request");
+
+	bool msb_bytes = setup->image_byte_order == XCB_IMAGE_ORDER_MSB_FIRST;
+	std::vector<std::uint8_t> image(bytes);
+	for (int y = 0; y < atlas.height; ++y)
+		for (int x = 0; x < atlas.width; ++x)
+		{
+			std::uint32_t v = atlas.flattened(x, y, BACKGROUND);
+			std::uint8_t *d = &image[(static_cast<std::size_t>(y) * atlas.width + x) * 4];
+			for (int b = 0; b < 4; ++b)
+				d[b] = static_cast<std::uint8_t>(v >> (msb_bytes ? 24 - 8 * b : 8 * b));
+		}
+
+	int pad = setup->bitmap_format_scanline_pad;
+	std::size_t stride = static_cast<std::size_t>((atlas.width + pad - 1) / pad * pad / 8);
+	bool msb_bits = setup->bitmap_format_bit_order == XCB_IMAGE_ORDER_MSB_FIRST;
+	std::vector<std::uint8_t> mask(stride * atlas.height, 0);
+	for (int y = 0; y < atlas.height; ++y)
+		for (int x = 0; x < atlas.width; ++x)
+			if (atlas.at(x, y) >> 24)
+				mask[y * stride + x / 8] |= msb_bits ? 0x80 >> (x % 8) : 1 << (x % 8);
+
+	atlas_ = xcb_generate_id(conn_);
+	count(xcb_create_pixmap(conn_, screen_->root_depth, atlas_, window_, atlas.width, atlas.height).sequence,
+	      wire::CREATE_PIXMAP);
+	count(xcb_put_image(conn_, XCB_IMAGE_FORMAT_Z_PIXMAP, atlas_, gc_, atlas.width, atlas.height, 0, 0, 0,
+	                    screen_->root_depth, image.size(), image.data()).sequence,
+	      wire::PUT_IMAGE + wire::pad4(image.size()));
+
+	// A GC is tied to a depth, so the mask needs its own for the upload.
+	atlas_mask_ = xcb_generate_id(conn_);
+	count(xcb_create_pixmap(conn_, 1, atlas_mask_, window_, atlas.width, atlas.height).sequence,
+	      wire::CREATE_PIXMAP);
+	xcb_gcontext_t mask_gc = xcb_generate_id(conn_);
+	count(xcb_create_gc(conn_, mask_gc, atlas_mask_, 0, nullptr).sequence, 0);
+	count(xcb_put_image(conn_, XCB_IMAGE_FORMAT_XY_PIXMAP, atlas_mask_, mask_gc, atlas.width, atlas.height,
+	                    0, 0, 0, 1, mask.size(), mask.data()).sequence, wire::PUT_IMAGE + wire::pad4(mask.size()));
+	count(xcb_free_gc(conn_, mask_gc).sequence, 0);
+
+	sprite_gc_ = xcb_generate_id(conn_);
+	std::uint32_t values[] = {atlas_mask_, 0};
+	count(xcb_create_gc(conn_, sprite_gc_, window_, XCB_GC_GRAPHICS_EXPOSURES | XCB_GC_CLIP_MASK, values).sequence,
+	      0);
+
+	for (int s = 0; s < SPRITE_COUNT; ++s)
+		sprite_opaque_[s] = atlas.opaque(s);
+}
+
+void XcbDisplay::drawSprites(int sprite, const Point *positions, std::size_t n)
+{
+	if (atlas_ == XCB_NONE)
+		return;
+
+	flushRun();
+	const int S = SpriteAtlas::SPRITE_SIZE;
+	const int sx = SpriteAtlas::originX(sprite);
+	bool masked = !sprite_opaque_[sprite];
+
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		const Point &p = positions[i];
+		if (masked)
+		{
+			std::uint32_t origin[] = {static_cast<std::uint32_t>(p.x - sx), static_cast<std::uint32_t>(p.y)};
+			count(xcb_change_gc(conn_, sprite_gc_, XCB_GC_CLIP_ORIGIN_X | XCB_GC_CLIP_ORIGIN_Y, origin).sequence,
+			      wire::CHANGE_GC_TWO_VALUES);
+		}
+		count(xcb_copy_area(conn_, atlas_, target_, masked ? sprite_gc_ : gc_, sx, 0, p.x, p.y, S, S).sequence,
+		      wire::COPY_AREA);
+	}
+}
+#endif
+
+// Draws into memory instead of a window.  There is no window system behind
+// it and so no input; it is for headless runs and benchmarks.
+class SoftwareDisplay : public GameDisplay {
+public:
+	SoftwareDisplay(int width = DEFAULT_WIDTH, int height = DEFAULT_HEIGHT);
+
+	const char *name() const override { return "software"; }
+
+	bool waitEvent(XEvent &ev, long timeout_ns) override;
+	bool queuedEvent(XEvent &ev) override;
+	bool peekQueuedEvent(XEvent &ev) override;
+	int connectionFd() const override { return -1; }
+
+	// For scripted runs: ev is delivered once at_ns have passed since the
+	// display was made.
+	void postEvent(const XEvent &ev, long at_ns);
+
+	// There is no keymap, but the keysyms the game binds all differ in
+	// their low byte, so those stand in for keycodes.
+	unsigned keycodeFor(KeySym sym) override { return sym & 0xff; }
+	bool hasDetectableAutoRepeat() const override { return true; }
+	void takeFocus() override {}
+	bool fakeKey(unsigned keycode, bool press) override;
+
+	void drawRect(unsigned long col, int x, int y, int width, int height) override;
+	void clear() override;
+	void flush() override { flushText(); }
+	void sync() override {}
+	Rect getGeometry() override { return {0, 0, width_, height_}; }
+
+	void beginStaticLayer(bool clear_layer) override;
+	void endStaticLayer() override;
+	void drawStaticLayer() override;
+
+	void loadSprites(const SpriteAtlas &atlas) override { atlas_ = atlas; }
+	void drawSprites(int sprite, const Point *positions, std::size_t n) override;
+
+	const std::uint32_t *pixels() const { return pixels_.data(); }
+
+protected:
+	void drawGlyphs(const GlyphQuad *quads, std::size_t n, unsigned long col) override;
+
+private:
+	int width_;
+	int height_;
+	std::vector<std::uint32_t> pixels_;
+	std::vector<std::uint32_t> layer_;
+	std::vector<std::uint32_t> *target_;
+	SpriteAtlas atlas_;
+	std::deque<std::pair<long, XEvent>> posted_;
+	Time clock_;
+};
+
+SoftwareDisplay::SoftwareDisplay(int width, int height)
+: width_(width), height_(height),
+  pixels_(static_cast<std::size_t>(width) * height, BACKGROUND),
+  target_(&pixels_)
+{
+}
+
+// With nothing posted, waiting without a timeout sleeps for good, as a
+// window nobody touches would.
+bool SoftwareDisplay::waitEvent(XEvent &ev, long timeout_ns)
+{
+	long now = clock_.time();
+	if (!posted_.empty() && (timeout_ns < 0 || posted_.front().first <= now + timeout_ns))
+	{
+		if (posted_.front().first > now)
+			std::this_thread::sleep_for(std::chrono::nanoseconds(posted_.front().first - now));
+		return queuedEvent(ev);
+	}
+	if (timeout_ns < 0)
+		for (;;)
+			std::this_thread::sleep_for(std::chrono::hours(1));
+	if (timeout_ns > 0)
+		std::this_thread::sleep_for(std::chrono::nanoseconds(timeout_ns));
+	return false;
+}
+
+bool SoftwareDisplay::queuedEvent(XEvent &ev)
+{
+	if (!peekQueuedEvent(ev))
+		return false;
+	posted_.pop_front();
+	return true;
+}
+
+bool SoftwareDisplay::peekQueuedEvent(XEvent &ev)
+{
+	if (posted_.empty() || posted_.front().first > clock_.time())
+		return false;
+	ev = posted_.front().second;
+	return true;
+}
+
+// After any posted for the same time, so events keep the order they were
+// posted in.
+void SoftwareDisplay::postEvent(const XEvent &ev, long at_ns)
+{
+	auto at = std::upper_bound(posted_.begin(), posted_.end(), at_ns,
+	                           [](long t, const std::pair<long, XEvent> &p) { return t < p.first; });
+	posted_.emplace(at, at_ns, ev);
+}
+
+// What XTEST does for the X backends: the key arrives as an event, stamped
+// with the time in ms as the server would.
+bool SoftwareDisplay::fakeKey(unsigned keycode, bool press)
+{
+	XEvent ev = {};
+	ev.xkey.type = press ? KeyPress : KeyRelease;
+	ev.xkey.keycode = keycode;
+	long now = clock_.time();
+	ev.xkey.time = static_cast<::Time>(now / 1'000'000);
+	postEvent(ev, now);
+	return true;
+}
+
+void SoftwareDisplay::drawRect(unsigned long col, int x, int y, int width, int height)
+{
+	int x0 = std::max(x, 0);
+	int y0 = std::max(y, 0);
+	int x1 = std::min(x + width, width_);
+	int y1 = std::min(y + height, height_);
+	if (x0 >= x1 || y0 >= y1)
+		return;
+
+	std::uint32_t *row = target_->data() + static_cast<std::size_t>(y0) * width_ + x0;
+	for (int yy = y0; yy < y1; ++yy, row += width_)
+		std::fill_n(row, x1 - x0, static_cast<std::uint32_t>(col));
+}
+
+// Alpha-blends each sprite row by row, clipped to the frame buffer.
+void SoftwareDisplay::drawSprites(int sprite, const Point *positions, std::size_t n)
+{
+	if (atlas_.pixels.empty())
+		return;
+
+	const int S = SpriteAtlas::SPRITE_SIZE;
+	const int sx = SpriteAtlas::originX(sprite);
+
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		const Point &p = positions[i];
+		int x0 = std::max(p.x, 0);
+		int y0 = std::max(p.y, 0);
+		int x1 = std::min(p.x + S, width_);
+		int y1 = std::min(p.y + S, height_);
+		if (x0 >= x1 || y0 >= y1)
+			continue;
+
+		for (int y = y0; y < y1; ++y)
+			blendRow(target_->data() + static_cast<std::size_t>(y) * width_ + x0,
+			         &atlas_.pixels[static_cast<std::size_t>(y - p.y) * atlas_.width + sx + (x0 - p.x)], x1 - x0);
+	}
+}
+
+// Copies the colour through each glyph's coverage, clipped to the frame
+// buffer.
+void SoftwareDisplay::drawGlyphs(const GlyphQuad *quads, std::size_t n, unsigned long col)
+{
+	const GlyphAtlas &font = GlyphAtlas::get();
+	const int W = GlyphAtlas::GLYPH_WIDTH;
+	const int H = GlyphAtlas::GLYPH_HEIGHT;
+
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		const GlyphQuad &q = quads[i];
+		int x0 = std::max<int>(q.x, 0);
+		int y0 = std::max<int>(q.y, 0);
+		int x1 = std::min(q.x + W, width_);
+		int y1 = std::min(q.y + H, height_);
+
+		for (int y = y0; y < y1; ++y)
+		{
+			const std::uint8_t *cov = font.row(q.glyph, y - q.y);
+			std::uint32_t *dst = target_->data() + static_cast<std::size_t>(y) * width_;
+			for (int x = x0; x < x1; ++x)
+				if (cov[x - q.x])
+					dst[x] = static_cast<std::uint32_t>(col);
+		}
+	}
+}
+
+void SoftwareDisplay::clear()
+{
+	std::fill(pixels_.begin(), pixels_.end(), static_cast<std::uint32_t>(BACKGROUND));
+}
+
+void SoftwareDisplay::beginStaticLayer(bool clear_layer)
+{
+	if (layer_.size() != pixels_.size())
+	{
+		layer_.resize(pixels_.size());
+		clear_layer = true;
+	}
+	if (clear_layer)
+		std::fill(layer_.begin(), layer_.end(), static_cast<std::uint32_t>(BACKGROUND));
+	target_ = &layer_;
+}
+
+void SoftwareDisplay::endStaticLayer()
+{
+	target_ = &pixels_;
+}
+
+void SoftwareDisplay::drawStaticLayer()
+{
+	if (layer_.empty())
+		clear();
+	else
+		std::copy(layer_.begin(), layer_.end(), pixels_.begin());
+}
+
+std::unique_ptr<GameDisplay> createDisplay(const std::string &backend)
+{
+	if (backend == "xlib")
+		return std::make_unique<XlibDisplay>();
+	if (backend == "software")
+		return std::make_unique<SoftwareDisplay>();
+#ifdef HAVE_XCB
+	if (backend == "xcb")
+		return std::make_unique<XcbDisplay>();
+#endif
+	throw std::runtime_error("Unknown or unavailable display backend: " + backend);
+}
+
+
+struct Character {
+	unsigned long color = 0x6091ab;
+	Point position {10, 10};
+	Size size {10, 10};
+	Point previous {10, 10};   // position at the start of the last tick
+
+	Character(unsigned long new_col, Point new_pos, Size new_sz)
+	: color(new_col), position(new_pos), size(new_sz), previous(new_pos) {};
+	
+	Rect bounds() const
+	{
+		return {position.x, position.y, size.width, size.height};
+	}
+
+	// Moves without anything to interpolate from.
+	void place(Point p)
+	{
+		position = previous = p;
+	}
+};
+
+// The point alpha of the way from `from` to `to`, with alpha in 16.16 fixed
+// point (0 to 1 << 16).
+inline Point interpolate(const Point &from, const Point &to, int alpha)
+{
+	return {from.x + static_cast<int>((static_cast<std::int64_t>(to.x - from.x) * alpha + 0x8000) >> 16),
+	        from.y + static_cast<int>((static_cast<std::int64_t>(to.y - from.y) * alpha + 0x8000) >> 16)};
+}
+
+// How far through a tick (0 to 1) two boxes first touch when each moves in
+// a straight line between the given top-left corners; -1 if they don't.
+// Touching edges count, as in rectangleIntersect.  Only the relative motion
+// matters, so it is one box against a still one, an axis at a time.
+inline double sweptContact(Point a_from, Point a_to, Size a, Point b_from, Point b_to, Size b)
+{
+	double t0 = 0, t1 = 1;
+	auto slab = [&](int a0, int da, int a_len, int b0, int db, int b_len) {
+		// Touching while -a_len <= (a0 - b0) + (da - db) t <= b_len.
+		double r = a0 - b0;
+		double v = da - db;
+		if (v == 0)
+			return r >= -a_len && r <= b_len;
+		double enter = (-a_len - r) / v;
+		double leave = (b_len - r) / v;
+		if (enter > leave)
+			std::swap(enter, leave);
+		t0 = std::max(t0, enter);
+		t1 = std::min(t1, leave);
+		return t0 <= t1;
+	};
+
+	if (!slab(a_from.x, a_to.x - a_from.x, a.width, b_from.x, b_to.x - b_from.x, b.width)
+	    || !slab(a_from.y, a_to.y - a_from.y, a.height, b_from.y, b_to.y - b_from.y, b.height))
+		return -1;
+	return t0;
+}
+
+struct Player : public Character {
+	Player() : Character(0x6091ab, {10,10}, {10,10}) {};
+};
+
+struct Food : public Character {
+	Food() : Character(0xe0f731, {100, 100}, {10, 10}) {};
+};
+
+// For a big buffer about to be filled for the first time: asks for
+// transparent huge pages over the whole 2 MB pages inside it, so filling
+// it takes one page fault per 2 MB instead of per 4 KB.  Only a hint.
+inline void adviseHugePages(const void *p, std::size_t bytes)
+{
+	const std::uintptr_t HUGE_PAGE = std::uintptr_t(2) << 20;
+	std::uintptr_t from = (reinterpret_cast<std::uintptr_t>(p) + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+	std::uintptr_t to = (reinterpret_cast<std::uintptr_t>(p) + bytes) & ~(HUGE_PAGE - 1);
+	if (from < to)
+		madvise(reinterpret_cast<void *>(from), to - from, MADV_HUGEPAGE);
+}
+
+// How many entities stand on each cell, kept up to date one move at a time
+// so "is anything next to this cell" is a few lookups however many there
+// are.  There is a ring of one cell around the grid, since ghosts can step
+// off the edge; anything further out isn't counted.
+class OccupancyGrid {
+public:
+	void reset(int cols, int rows)
+	{
+		cols_ = cols + 2;
+		rows_ = rows + 2;
+		std::size_t n = static_cast<std::size_t>(cols_) * rows_;
+		if (n > counts_.capacity())
+		{
+			counts_ = std::vector<std::uint32_t>();
+			counts_.reserve(n);
+			adviseHugePages(counts_.data(), n * sizeof(std::uint32_t));
+		}
+		counts_.assign(n, 0);
+	}
+
+	void add(int cx, int cy)
+	{
+		if (inGrid(cx, cy))
+			++counts_[index(cx, cy)];
+	}
+
+	void remove(int cx, int cy)
+	{
+		if (inGrid(cx, cy))
+			--counts_[index(cx, cy)];
+	}
+
+	void move(Point from, Point to)
+	{
+		const int C = CellGrid::CELL_SIZE;
+		remove(from.x / C, from.y / C);
+		add(to.x / C, to.y / C);
+	}
+
+	int count(int cx, int cy) const
+	{
+		return inGrid(cx, cy) ? static_cast<int>(counts_[index(cx, cy)]) : 0;
+	}
+
+	// Anything on the 3x3 cells centred on cx, cy.
+	bool anyAround(int cx, int cy) const
+	{
+		for (int y = cy - 1; y <= cy + 1; ++y)
+			for (int x = cx - 1; x <= cx + 1; ++x)
+				if (inGrid(x, y) && counts_[index(x, y)])
+					return true;
+		return false;
+	}
+
+private:
+	int cols_ = 0;
+	int rows_ = 0;
+	std::vector<std::uint32_t> counts_;
+
+	bool inGrid(int cx, int cy) const { return cx >= -1 && cx < cols_ - 1 && cy >= -1 && cy < rows_ - 1; }
+	std::size_t index(int cx, int cy) const { return static_cast<std::size_t>(cy + 1) * cols_ + (cx + 1); }
+};
+
+// Indices of moving or listed entities, bucketed by the cell their top-left
+// corner is in so a rectangle query only visits the buckets it overlaps.
+// Built with a counting sort into arrays that are kept from one build to
+// the next.  Anything off the grid is filed under the nearest edge bucket.
+class BucketGrid {
+public:
+	static constexpr int BUCKET_CELLS = 16;
+
+	void reset(int cols, int rows)
+	{
+		bcols_ = (cols + BUCKET_CELLS - 1) / BUCKET_CELLS;
+		brows_ = (rows + BUCKET_CELLS - 1) / BUCKET_CELLS;
+		starts_.assign(static_cast<std::size_t>(bcols_) * brows_ + 1, 0);
+		items_.clear();
+	}
+
+	// pos(i) gives entity i's position in pixels.
+	template <typename Pos>
+	void build(std::size_t n, Pos pos)
+	{
+		bucket_of_.resize(n);
+		items_.resize(n);
+		std::fill(starts_.begin(), starts_.end(), 0);
+
+		for (std::size_t i = 0; i < n; ++i)
+		{
+			Point p = pos(i);
+			bucket_of_[i] = bucket(p.x / CellGrid::CELL_SIZE, p.y / CellGrid::CELL_SIZE);
+			++starts_[bucket_of_[i] + 1];
+		}
+		for (std::size_t b = 1; b < starts_.size(); ++b)
+			starts_[b] += starts_[b - 1];
+
+		// Placing advances each start to the next bucket's; shift them back.
+		for (std::size_t i = 0; i < n; ++i)
+			items_[starts_[bucket_of_[i]]++] = static_cast<std::uint32_t>(i);
+		for (std::size_t b = starts_.size() - 1; b > 0; --b)
+			starts_[b] = starts_[b - 1];
+		starts_[0] = 0;
+	}
+
+	// Calls f(i) for every entity whose bucket overlaps cells
+	// [cx0, cx1) x [cy0, cy1).  Callers still check the exact position.
+	template <typename F>
+	void query(int cx0, int cy0, int cx1, int cy1, F f) const
+	{
+		if (starts_.size() < 2 || cx0 >= cx1 || cy0 >= cy1)
+			return;
+
+		int b0 = bucket(cx0, cy0);
+		int b1 = bucket(cx1 - 1, cy1 - 1);
+		int bx0 = b0 % bcols_, by0 = b0 / bcols_;
+		int bx1 = b1 % bcols_, by1 = b1 / bcols_;
+		for (int by = by0; by <= by1; ++by)
+		{
+			std::size_t from = starts_[by * bcols_ + bx0];
+			std::size_t to = starts_[by * bcols_ + bx1 + 1];
+			for (std::size_t k = from; k < to; ++k)
+				f(items_[k]);
+		}
+	}
+
+private:
+	int bcols_ = 0;
+	int brows_ = 0;
+	std::vector<std::uint32_t> starts_;     // first item of each bucket, plus the end
+	std::vector<std::uint32_t> items_;
+	std::vector<std::uint32_t> bucket_of_;
+
+	int bucket(int cx, int cy) const
+	{
+		int bx = std::clamp(cx < 0 ? 0 : cx / BUCKET_CELLS, 0, bcols_ - 1);
+		int by = std::clamp(cy < 0 ? 0 : cy / BUCKET_CELLS, 0, brows_ - 1);
+		return by * bcols_ + bx;
+	}
+};
+
+struct Ghost : public Character {
+	static constexpr long MOVE_NS = 250'000'000;
+
+	Ghost() : Character(0xff0000, {100, 100}, {10, 10}) {}
+
+	// Picks a direction for the ghost's next move.  The caller walks the
+	// ghost that way a cell at a time so walls stop it.
+	static Point nextStep(Rng &rng)
+	{
+		const int MOVE_DIST = 10;
+		switch (rng.uniform(4))
+		{
+			case 0 : return {0, -MOVE_DIST};
+			case 1 : return {0, MOVE_DIST};
+			case 2 : return {-MOVE_DIST, 0};
+			default : return {MOVE_DIST, 0};
+		}
+	}
+
+	// Counted down by every tick; the ghost moves when it reaches zero.
+	// Ticks don't run while the game is idle, so nothing needs pausing.
+	long ticks_to_move = 0;
+};
+
+// Snapshots copy ghosts as bytes and compare them the same way.
+static_assert(std::has_unique_object_representations_v<Ghost>, "Ghost has padding");
+
+// Everything that makes up one playthrough apart from the player.  Levels are
+// built off the input thread and swapped in whole on restart.
+struct Level {
+	std::vector<Food> food;
+	CellGrid food_grid;
+	std::vector<Ghost> ghosts;
+	CellGrid walls;               // also sets the world size
+	BucketGrid food_index;        // the food vector, for drawing what is on screen
+	BucketGrid ghost_index;       // rebuilt when a snapshot needs it after ghosts moved
+	bool ghost_index_stale = false;
+	OccupancyGrid ghost_cells;    // for collision; updated as each ghost moves
+	Rng rng;
+
+	int width() const { return walls.cols() * CellGrid::CELL_SIZE; }
+	int height() const { return walls.rows() * CellGrid::CELL_SIZE; }
+
+	void indexFood()
+	{
+		food_index.build(food.size(), [&](std::size_t i) { return food[i].position; });
+	}
+	void indexGhosts()
+	{
+		ghost_index.build(ghosts.size(), [&](std::size_t i) { return ghosts[i].position; });
+		ghost_index_stale = false;
+	}
+};
+
+enum class Action : std::uint8_t {
+	NONE, UP, DOWN, LEFT, RIGHT, RESTART, QUIT, REWIND, COUNT
+};
+
+// Maps keycodes to actions.  Built once from keysyms so it follows the
+// server's keyboard layout instead of hard-coded keycodes.
+class KeyBindings {
+public:
+	void build(GameDisplay &d)
+	{
+		actions_.fill(Action::NONE);
+		keycodes_.fill(0);
+		bind(d, XK_Up, Action::UP);
+		bind(d, XK_Down, Action::DOWN);
+		bind(d, XK_Left, Action::LEFT);
+		bind(d, XK_Right, Action::RIGHT);
+		bind(d, XK_space, Action::RESTART);
+		bind(d, XK_Escape, Action::QUIT);
+		bind(d, XK_BackSpace, Action::REWIND);
+	}
+
+	Action action(unsigned keycode) const { return actions_[keycode & 0xff]; }
+	unsigned keycode(Action a) const { return keycodes_[static_cast<int>(a)]; }
+
+private:
+	std::array<Action, 256> actions_;
+	std::array<unsigned, static_cast<int>(Action::COUNT)> keycodes_;
+
+	void bind(GameDisplay &d, KeySym sym, Action a)
+	{
+		unsigned code = d.keycodeFor(sym) & 0xff;
+		if (code == 0)
+			return;
+		actions_[code] = a;
+		keycodes_[static_cast<int>(a)] = code;
+	}
+};
+
+// Which of the 256 possible keycodes are currently held down.
+class KeyState {
+public:
+	void press(unsigned code) { bits_[(code >> 6) & 3] |= bit(code); }
+	void release(unsigned code) { bits_[(code >> 6) & 3] &= ~bit(code); }
+	bool held(unsigned code) const { return code != 0 && (bits_[(code >> 6) & 3] & bit(code)); }
+	void clear() { bits_.fill(0); }
+
+private:
+	std::array<std::uint64_t, 4> bits_ {};
+
+	static std::uint64_t bit(unsigned code) { return std::uint64_t(1) << (code & 63); }
+};
+
+// Mean and standard deviation without keeping the samples (Welford).
+struct RunningStat {
+	long n = 0;
+	double mean = 0;
+	double m2 = 0;
+
+	void add(double x)
+	{
+		++n;
+		double d = x - mean;
+		mean += d / n;
+		m2 += d * (x - mean);
+	}
+
+	double stddev() const { return n > 1 ? std::sqrt(m2 / (n - 1)) : 0.0; }
+};
+
+// Fixed 0.1 ms buckets up to 100 ms plus one overflow bucket.  Cheap enough
+// to update on every presented frame.
+class LatencyHistogram {
+public:
+	static constexpr int BUCKETS = 1000;
+	static constexpr double BUCKET_MS = 0.1;
+
+	void add(double ms)
+	{
+		int b = static_cast<int>(ms / BUCKET_MS);
+		++counts_[std::min(std::max(b, 0), BUCKETS)];
+		++n_;
+		max_ms_ = std::max(max_ms_, ms);
+	}
+
+	long count() const { return n_; }
+
+	void merge(const LatencyHistogram &o)
+	{
+		for (int b = 0; b <= BUCKETS; ++b)
+			counts_[b] += o.counts_[b];
+		n_ += o.n_;
+		max_ms_ = std::max(max_ms_, o.max_ms_);
+	}
+
+	// Upper edge of the bucket holding the p'th percentile (0 < p <= 100).
+	double percentile(double p) const
+	{
+		long target = static_cast<long>(std::ceil(p / 100.0 * n_));
+		long seen = 0;
+		for (int b = 0; b <= BUCKETS; ++b)
+		{
+			seen += counts_[b];
+			if (seen >= target && seen > 0)
+				return b == BUCKETS ? max_ms_ : (b + 1) * BUCKET_MS;
+		}
+		return 0;
+	}
+
+	void print(const char *name) const
+	{
+		printf("%s: n %ld, p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+		       name, n_, percentile(50), percentile(90), percentile(99), max_ms_);
+		if (n_ == 0)
+			return;
+
+		// Coarse power-of-two view of the same buckets.
+		int lo = 0;
+		for (double edge_ms = 1; lo <= BUCKETS; edge_ms *= 2)
+		{
+			int hi = std::min(static_cast<int>(edge_ms / BUCKET_MS), BUCKETS + 1);
+			long c = 0;
+			for (int b = lo; b < hi; ++b)
+				c += counts_[b];
+			if (c)
+				printf("  %6.1f - %6.1f ms: %ld\n", lo * BUCKET_MS, hi > BUCKETS ? max_ms_ : edge_ms, c);
+			lo = hi;
+		}
+	}
+
+private:
+	std::array<long, BUCKETS + 1> counts_ {};
+	long n_ = 0;
+	double max_ms_ = 0;
+};
+
+// When an input event was sent by the server (server clock, ms) and when we
+// read it (local clock, ns).  Carried until the frame showing it is presented.
+struct InputStamp {
+	long server_ms = -1;
+	long receive_ns = -1;
+	long server_ns = -1;    // server_ms on our clock, by the best offset known when stamped
+
+	bool valid() const { return receive_ns >= 0; }
+};
+
+// Everything the event queue asked for during one frame.  Legacy moves are
+// summed into one net delta and any number of Expose events become one
+// redraw.  Held keys are tracked separately in the KeyState.
+struct InputBatch {
+	int dx = 0;
+	int dy = 0;
+	bool expose = false;
+	bool restart = false;
+	bool quit = false;
+	bool rewind = false;
+};
+
+struct FrameStats {
+	Time since_start;
+	long frames = 0;
+	long renders = 0;
+	long events = 0;
+	long key_presses = 0;
+	long exposes_coalesced = 0;
+	double idle_wall_s = 0;
+	double idle_cpu_s = 0;
+	long ticks = 0;
+	RunningStat input_latency_ms;   // key press received -> player moved
+	RunningStat step_interval_ms;   // between moves while a key is held
+	LatencyHistogram receive_to_present;
+	LatencyHistogram server_to_present;
+	LatencyHistogram tick_lateness;     // how long after it was due each tick ran
+	LatencyHistogram level_swap;        // restart to the next level being in place
+	long level_swaps_waited = 0;        // swaps that had to wait for the generator
+	LatencyHistogram restart_to_frame;  // restart to the first frame showing the new level
+	long rendered_frames = 0;
+	ProtocolStats protocol_total;
+	ProtocolStats protocol_max;
+
+	void addFrameProtocol(const ProtocolStats &p)
+	{
+		++rendered_frames;
+		protocol_total = {protocol_total.requests + p.requests, protocol_total.bytes + p.bytes,
+		                  protocol_total.round_trips + p.round_trips};
+		protocol_max = {std::max(protocol_max.requests, p.requests), std::max(protocol_max.bytes, p.bytes),
+		                std::max(protocol_max.round_trips, p.round_trips)};
+	}
+
+	void dump()
+	{
+		double secs = since_start.time() / 1e9;
+		printf("Frames: %ld, renders: %ld (%.1f/s), events: %ld, key presses: %ld, exposes coalesced: %ld\n",
+		       frames, renders, renders / secs, events, key_presses, exposes_coalesced);
+		printf("Idle: %.3f s wall, %.3f ms CPU (%.4f%%)\n", idle_wall_s, idle_cpu_s * 1e3,
+		       idle_wall_s > 0 ? 100.0 * idle_cpu_s / idle_wall_s : 0.0);
+		printf("Ticks: %ld, input-to-move: %.3f ms (sd %.3f, n %ld), held step interval: %.3f ms (sd %.3f, n %ld)\n",
+		       ticks, input_latency_ms.mean, input_latency_ms.stddev(), input_latency_ms.n,
+		       step_interval_ms.mean, step_interval_ms.stddev(), step_interval_ms.n);
+		receive_to_present.print("Input receive-to-present");
+		server_to_present.print("Input server-to-present");
+		tick_lateness.print("Tick lateness");
+		if (level_swap.count())
+		{
+			level_swap.print("Level swap");
+			printf("Level swaps that waited for the generator: %ld\n", level_swaps_waited);
+		}
+		if (restart_to_frame.count())
+			restart_to_frame.print("Restart to first frame");
+		if (rendered_frames)
+			printf("X protocol per rendered frame: %.1f requests (max %ld), %.0f bytes (max %ld), "
+			       "%.2f round trips (max %ld)\n",
+			       static_cast<double>(protocol_total.requests) / rendered_frames, protocol_max.requests,
+			       static_cast<double>(protocol_total.bytes) / rendered_frames, protocol_max.bytes,
+			       static_cast<double>(protocol_total.round_trips) / rendered_frames, protocol_max.round_trips);
+	}
+};
+
+// Plays the game, for soak and performance runs that shouldn't need anyone
+// at the keyboard.  Each tick it looks at the level as it stands and picks
+// the direction to hold; the Game presses the keys for it.
+//
+// It searches breadth first from the player's cell to the nearest food,
+// within a window SEARCH cells each way so the cost doesn't grow with the
+// world.  The avoiding strategy also treats every cell a ghost could reach
+// before the player gets past it as a wall, and if that leaves no way to
+// any food, or the player is already in reach, it steps to whichever
+// neighbouring cell is farthest from the ghosts nearby.
+class Bot {
+public:
+	enum Strategy { GREEDY, AVOID };
+
+	struct Stats {
+		long games = 0;
+		long wins = 0;
+		RunningStat game_ticks;
+		RunningStat plan_us;
+		double max_plan_us = 0;
+	};
+
+	static constexpr int SEARCH = 64;
+
+	Bot(Strategy strategy, int danger_radius) : strategy_(strategy), danger_radius_(danger_radius) {}
+
+	static Strategy parse(const std::string &name)
+	{
+		if (name == "greedy")
+			return GREEDY;
+		if (name == "avoid")
+			return AVOID;
+		throw std::runtime_error("Unknown bot strategy " + name + " (greedy or avoid)");
+	}
+
+	const char *name() const { return strategy_ == GREEDY ? "greedy" : "avoid"; }
+	const Stats &stats() const { return stats_; }
+
+	// The direction to hold for the next tick, or NONE to stand still.
+	// Food is read from the grid or the vector, whichever the game keeps.
+	Action decide(Level &level, Point cell, bool food_grid);
+
+	void gameOver(bool won, long ticks)
+	{
+		++stats_.games;
+		stats_.wins += won;
+		stats_.game_ticks.add(static_cast<double>(ticks));
+	}
+
+private:
+	enum : std::uint8_t { FOOD = 1, DANGER = 2, SEEN = 4 };
+
+	Strategy strategy_;
+	int danger_radius_;
+	Action last_ = Action::NONE;
+	Stats stats_;
+	// The search window, kept from one plan to the next.
+	int x0_ = 0, y0_ = 0, x1_ = 0, y1_ = 0;
+	std::vector<std::uint8_t> mask_;
+	std::vector<Action> first_;          // first move on the way to each cell
+	std::vector<std::int32_t> queue_;
+	std::vector<Point> ghosts_;          // cells of the ghosts near the window
+
+	int at(int x, int y) const { return (y - y0_) * (x1_ - x0_) + (x - x0_); }
+	bool open(const Level &level, Point p) const { return level.walls.inGrid(p.x, p.y) && !level.walls.test(p.x, p.y); }
+	Action search(const Level &level, Point cell);
+	Action flee(const Level &level, Point cell) const;
+	Action wander(const Level &level, Point cell) const;
+};
+
+namespace {
+const Action BOT_MOVES[4] = {Action::UP, Action::DOWN, Action::LEFT, Action::RIGHT};
+const Point BOT_STEPS[4] = {{0, -1}, {0, 1}, {-1, 0}, {1, 0}};
+
+int botMoveIndex(Action a)
+{
+	for (int d = 0; d < 4; ++d)
+		if (BOT_MOVES[d] == a)
+			return d;
+	return -1;
+}
+}
+
+Action Bot::decide(Level &level, Point cell, bool food_grid)
+{
+	Time t;
+	const int C = CellGrid::CELL_SIZE;
+	x0_ = std::max(cell.x - SEARCH, 0);
+	y0_ = std::max(cell.y - SEARCH, 0);
+	x1_ = std::min(cell.x + SEARCH + 1, level.walls.cols());
+	y1_ = std::min(cell.y + SEARCH + 1, level.walls.rows());
+	if (x0_ >= x1_ || y0_ >= y1_ || cell.x < x0_ || cell.y < y0_)
+		return last_ = Action::NONE;
+	mask_.assign(static_cast<std::size_t>(x1_ - x0_) * (y1_ - y0_), 0);
+	first_.resize(mask_.size());
+
+	if (food_grid)
+	{
+		level.food_grid.forEachIn(x0_, y0_, x1_, y1_, [&](int x, int y) { mask_[at(x, y)] |= FOOD; });
+	}
+	else
+	{
+		level.food_index.query(x0_, y0_, x1_, y1_, [&](std::size_t i) {
+			int x = level.food[i].position.x / C, y = level.food[i].position.y / C;
+			if (x >= x0_ && x < x1_ && y >= y0_ && y < y1_)
+				mask_[at(x, y)] |= FOOD;
+		});
+	}
+
+	ghosts_.clear();
+	Action choice = Action::NONE;
+	if (strategy_ == AVOID)
+	{
+		const int r = danger_radius_;
+		if (level.ghost_index_stale)
+			level.indexGhosts();
+		level.ghost_index.query(x0_ - r, y0_ - r, x1_ + r, y1_ + r, [&](std::size_t i) {
+			Point g {level.ghosts[i].position.x / C, level.ghosts[i].position.y / C};
+			if (g.x >= x0_ - r && g.x < x1_ + r && g.y >= y0_ - r && g.y < y1_ + r)
+				ghosts_.push_back(g);
+		});
+		for (const Point &g: ghosts_)
+			for (int y = std::max(g.y - r, y0_); y <= std::min(g.y + r, y1_ - 1); ++y)
+				for (int x = std::max(g.x - r, x0_); x <= std::min(g.x + r, x1_ - 1); ++x)
+					mask_[at(x, y)] |= DANGER;
+		if (!(mask_[at(cell.x, cell.y)] & DANGER))
+			choice = search(level, cell);
+		if (choice == Action::NONE && !ghosts_.empty())
+			choice = flee(level, cell);
+	}
+	else
+	{
+		choice = search(level, cell);
+	}
+	if (choice == Action::NONE)
+		choice = wander(level, cell);
+
+	double us = t.time() / 1e3;
+	stats_.plan_us.add(us);
+	stats_.max_plan_us = std::max(stats_.max_plan_us, us);
+	return last_ = choice;
+}
+
+// The first move on a shortest path to the nearest food, or NONE.
+Action Bot::search(const Level &level, Point cell)
+{
+	queue_.clear();
+	int start = at(cell.x, cell.y);
+	mask_[start] |= SEEN;
+	queue_.push_back(start);
+	const int w = x1_ - x0_;
+	for (std::size_t head = 0; head < queue_.size(); ++head)
+	{
+		int i = queue_[head];
+		int x = x0_ + i % w, y = y0_ + i / w;
+		for (int d = 0; d < 4; ++d)
+		{
+			int nx = x + BOT_STEPS[d].x, ny = y + BOT_STEPS[d].y;
+			if (nx < x0_ || nx >= x1_ || ny < y0_ || ny >= y1_)
+				continue;
+			int j = at(nx, ny);
+			if ((mask_[j] & (SEEN | DANGER)) || level.walls.test(nx, ny))
+				continue;
+			mask_[j] |= SEEN;
+			first_[j] = i == start ? BOT_MOVES[d] : first_[i];
+			if (mask_[j] & FOOD)
+				return first_[j];
+			queue_.push_back(j);
+		}
+	}
+	return Action::NONE;
+}
+
+// Standing still is one of the choices.  Ties keep the current direction.
+Action Bot::flee(const Level &level, Point cell) const
+{
+	auto clearance = [&](Point p) {
+		int nearest = 4 * SEARCH;            // farther than any ghost it knows of
+		for (const Point &g: ghosts_)
+			nearest = std::min(nearest, std::max(std::abs(g.x - p.x), std::abs(g.y - p.y)));
+		return nearest;
+	};
+
+	Action best = Action::NONE;
+	int best_clearance = clearance(cell);
+	for (int d = 0; d < 4; ++d)
+	{
+		Point p {cell.x + BOT_STEPS[d].x, cell.y + BOT_STEPS[d].y};
+		if (!open(level, p))
+			continue;
+		int c = clearance(p);
+		if (c > best_clearance || (c == best_clearance && BOT_MOVES[d] == last_))
+		{
+			best = BOT_MOVES[d];
+			best_clearance = c;
+		}
+	}
+	return best;
+}
+
+// Nothing to head for: keep going, turning when blocked.
+Action Bot::wander(const Level &level, Point cell) const
+{
+	int from = std::max(botMoveIndex(last_), 0);
+	for (int k = 0; k < 4; ++k)
+	{
+		int d = (from + k) % 4;
+		if (open(level, {cell.x + BOT_STEPS[d].x, cell.y + BOT_STEPS[d].y}))
+			return BOT_MOVES[d];
+	}
+	return Action::NONE;
+}
+
+struct GameOptions {
+	bool use_food_grid = false;
+	bool walls = false;
+	int food_count = 10;
+	int ghost_count = 10;
+	std::string display_backend = "xlib";
+	bool legacy_input = false;     // one step per KeyPress, as before fixed ticks
+	int synthetic_inputs = 0;      // drive the game with this many XTEST taps
+	int round_trip_budget = -1;    // fail if a frame blocks on the server more often
+	bool sprites = false;          // draw from the sprite atlas instead of flat rects
+	std::string atlas_path;        // PPM/PAM atlas; built-in sprites if empty
+	int render_hz = 0;             // if set, draw this often with motion interpolated between ticks
+	int world_scale = 1;           // world area as a multiple of the default window's
+	bool threaded = false;         // simulate and render on separate threads
+	int render_delay_ms = 0;       // sleep this long after every frame, to test a slow display
+	double run_seconds = 0;        // quit after this long if set
+	bool print_stats = true;       // dump FrameStats on exit
+	int jobs = 0;                  // threads for the per-frame task graphs; 0 runs them serially
+	int sim_hz = 60;               // fixed simulation rate, up to 1000
+	double player_speed = 15;      // cells per second
+	int ghost_step = 1;            // cells per ghost move
+	int rewind_ticks = 0;          // keep this many ticks of snapshots for Backspace to rewind through
+	std::string load_path;         // start from this save file
+	std::string save_path;         // save the game here on exit
+	std::string server_address;    // run a match server here instead of the game: unix:PATH or udp:PORT
+	std::string connect_address;   // play the match served here
+	int players = 8;               // player slots in a served match
+	std::string bot;               // let a bot play: greedy or avoid
+	int bot_games = 0;             // with a bot, quit after this many games
+	std::string task_dot_path;     // write the task graphs here on exit, as Graphviz
+};
+
+// A thing that moves, as the renderer needs it: where it was at the start of
+// the last tick and where it is now.
+struct Mover {
+	Point previous;
+	Point position;
+};
+
+// Everything one frame draws, copied out of the live game by the simulation
+// so drawing never reads state that is being changed under it.  Only what
+// lies near the camera is included.  The vectors keep their capacity from
+// one snapshot to the next.
+struct RenderSnapshot {
+	long tick_ns = 0;                 // when the last tick before it was due
+	long tick_length_ns = 0;
+	bool interpolate = false;         // draw between previous and current positions
+	long moving_until_ns = 0;         // when the latest move has been fully drawn
+	std::uint64_t level_id = 0;       // changes when a new level starts or a snapshot is restored
+	std::uint64_t food_version = 0;   // counts snapshots in which food was eaten
+	Size world {0, 0};
+	unsigned long player_color = 0;
+	unsigned long ghost_color = 0;
+	unsigned long food_color = 0;
+	unsigned long wall_color = 0;
+	Mover player {};
+	std::vector<Mover> ghosts;
+	std::vector<Point> walls;         // world pixels
+	std::vector<Point> food;
+	std::vector<Point> eaten;         // food eaten since the previous snapshot
+	std::size_t food_left = 0;
+	bool game_over = false;
+	bool game_won = false;
+	std::vector<Mover> others;        // other players, in client mode
+	unsigned long other_color = 0;
+	InputStamp input;                 // first input this frame shows
+	long restart_ns = -1;             // when a restart this frame is the first to show began
+};
+
+// Hands the newest value from one thread to another without either waiting.
+// Of the three slots one is being written, one is being read, and the third
+// holds the latest published value; publish and acquire swap a slot with
+// that one atomically.  Values the reader never got to are simply replaced.
+template <typename T>
+class TripleBuffer {
+public:
+	T &writeBuffer() { return slots_[write_]; }
+	const T &readBuffer() const { return slots_[read_]; }
+
+	void publish()
+	{
+		write_ = middle_.exchange(write_ | FRESH, std::memory_order_acq_rel) & INDEX;
+	}
+
+	// Returns true if something newer has been published since last time.
+	bool acquire()
+	{
+		if (!(middle_.load(std::memory_order_relaxed) & FRESH))
+			return false;
+		read_ = middle_.exchange(read_, std::memory_order_acq_rel) & INDEX;
+		return true;
+	}
+
+private:
+	static constexpr unsigned INDEX = 3;
+	static constexpr unsigned FRESH = 4;
+
+	std::array<T, 3> slots_;
+	std::atomic<unsigned> middle_ {1};
+	unsigned write_ = 0;
+	unsigned read_ = 2;
+};
+
+// Events read off the display by the render thread, on their way to the
+// simulation thread.
+class EventInbox {
+public:
+	void push(const XEvent &ev)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			events_.push_back(ev);
+		}
+		ready_.notify_one();
+	}
+
+	// Waits up to timeout_ns (forever if negative).  Returns false on timeout
+	// or once closed.
+	bool wait(XEvent &ev, long timeout_ns)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		auto ready = [&] { return closed_ || !events_.empty(); };
+		if (timeout_ns < 0)
+			ready_.wait(lock, ready);
+		else
+			ready_.wait_for(lock, std::chrono::nanoseconds(timeout_ns), ready);
+		return take(ev);
+	}
+
+	bool pop(XEvent &ev)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return take(ev);
+	}
+
+	bool peek(XEvent &ev)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (events_.empty())
+			return false;
+		ev = events_.front();
+		return true;
+	}
+
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			closed_ = true;
+		}
+		ready_.notify_all();
+	}
+
+private:
+	std::mutex mutex_;
+	std::condition_variable ready_;
+	std::deque<XEvent> events_;
+	bool closed_ = false;
+
+	bool take(XEvent &ev)
+	{
+		if (events_.empty())
+			return false;
+		ev = events_.front();
+		events_.pop_front();
+		return true;
+	}
+};
+
+// Everything the simulation needs to carry on from a tick, as one flat
+// block: a fixed header, then the level's wall and food bit words, the food
+// list and the ghosts.  Every part is trivially copyable, so taking or
+// restoring a snapshot is a few memcpys into storage kept from one
+// snapshot to the next.  Indexes built from these (food and ghost buckets,
+// ghost occupancy) are rebuilt on restore rather than stored.
+class SimState {
+public:
+	struct Header {
+		std::uint64_t tick;
+		std::uint64_t rng;              // the level's generator: ghost moves
+		std::uint64_t level_rng;        // seeds the levels after the next
+		std::uint64_t next_level_seed;  // the level being generated ahead
+		double move_progress;
+		Point player;
+		Point player_previous;
+		Point tap;
+		std::int32_t cols;
+		std::int32_t rows;
+		std::uint32_t food;             // Food entries; 0 when food is on the grid
+		std::uint32_t ghosts;
+		std::uint32_t flags;
+		std::uint32_t reserved;
+	};
+	static constexpr std::uint32_t GAME_OVER = 1, GAME_WON = 2, FOOD_GRID = 4;
+
+	const Header &header() const { return *reinterpret_cast<const Header *>(arena_.data()); }
+	std::size_t bytes() const { return arena_.size() * sizeof(std::uint64_t); }
+	bool empty() const { return arena_.empty(); }
+
+	bool operator==(const SimState &other) const { return arena_ == other.arena_; }
+	bool operator!=(const SimState &other) const { return !(*this == other); }
+
+private:
+	friend class Game;
+	friend class SaveFile;
+	std::vector<std::uint64_t> arena_;
+
+	enum Section { HEADER, WALLS, FOOD_GRID_WORDS, FOOD_LIST, GHOSTS, END };
+
+	static std::size_t layout(const Header &h, Section section);
+	std::uint64_t *at(Section section) { return arena_.data() + layout(header(), section); }
+	const std::uint64_t *at(Section section) const { return arena_.data() + layout(header(), section); }
+	std::size_t gridWords() const { return layout(header(), FOOD_GRID_WORDS) - layout(header(), WALLS); }
+};
+
+static_assert(std::is_trivially_copyable_v<SimState::Header> && std::is_trivially_copyable_v<Food>
+              && sizeof(SimState::Header) % 8 == 0 && sizeof(Food) % 8 == 0 && sizeof(Ghost) % 8 == 0,
+              "SimState sections must be trivially copyable whole words");
+
+// Where a section starts, in words; END is the total.
+std::size_t SimState::layout(const Header &h, Section section)
+{
+	const std::size_t grid = static_cast<std::size_t>((h.cols + 63) / 64) * h.rows;
+	const std::size_t sizes[END] = {
+		sizeof(Header) / 8,
+		grid,
+		(h.flags & FOOD_GRID) ? grid : 0,
+		h.food * sizeof(Food) / 8,
+		h.ghosts * sizeof(Ghost) / 8,
+	};
+	std::size_t words = 0;
+	for (int i = 0; i < section; ++i)
+		words += sizes[i];
+	return words;
+}
+
+// The last N snapshots, the oldest overwritten first.  Slots keep their
+// storage, so once the ring is full taking a snapshot allocates nothing.
+class SnapshotRing {
+public:
+	explicit SnapshotRing(std::size_t slots) : slots_(std::max<std::size_t>(slots, 1)) {}
+
+	// The slot for the next snapshot.
+	SimState &push() { return slots_[next_++ % slots_.size()]; }
+
+	std::size_t size() const { return std::min(next_, slots_.size()); }
+
+	// k = 0 is the newest.
+	const SimState &newest(std::size_t k = 0) const { return slots_[(next_ - 1 - k) % slots_.size()]; }
+
+	// Forgets the k newest, as after rewinding past them.
+	void drop(std::size_t k) { next_ -= std::min(k, size()); }
+
+	void clear() { next_ = 0; }
+
+private:
+	std::vector<SimState> slots_;
+	std::size_t next_ = 0;
+};
+
+// Appends to a byte vector.  Fixed-size values go in as they are in
+// memory, which is the file's byte order on the only hosts built for.
+class ByteWriter {
+public:
+	explicit ByteWriter(std::vector<std::uint8_t> &out) : out_(out) {}
+
+	void raw(const void *data, std::size_t n)
+	{
+		std::size_t at = out_.size();
+		out_.resize(at + n);
+		std::memcpy(out_.data() + at, data, n);
+	}
+
+	template <typename T>
+	void fixed(T value) { raw(&value, sizeof(value)); }
+
+	// LEB128: seven bits a byte, low bits first.
+	void varint(std::uint64_t v)
+	{
+		while (v >= 0x80)
+		{
+			out_.push_back(static_cast<std::uint8_t>(v | 0x80));
+			v >>= 7;
+		}
+		out_.push_back(static_cast<std::uint8_t>(v));
+	}
+
+	// Zigzag, so small negative numbers stay short too.
+	void svarint(std::int64_t v) { varint((static_cast<std::uint64_t>(v) << 1) ^ static_cast<std::uint64_t>(v >> 63)); }
+
+	std::size_t size() const { return out_.size(); }
+	std::uint8_t *at(std::size_t offset) { return out_.data() + offset; }
+
+private:
+	std::vector<std::uint8_t> &out_;
+};
+
+// Reads what ByteWriter wrote, throwing if it runs off the end.
+class ByteReader {
+public:
+	ByteReader(const std::uint8_t *data, std::size_t n) : p_(data), end_(data + n) {}
+
+	std::size_t left() const { return static_cast<std::size_t>(end_ - p_); }
+
+	void raw(void *out, std::size_t n)
+	{
+		need(n);
+		std::memcpy(out, p_, n);
+		p_ += n;
+	}
+
+	template <typename T>
+	T fixed()
+	{
+		T value;
+		raw(&value, sizeof(value));
+		return value;
+	}
+
+	// The next n bytes as a reader of their own.
+	ByteReader take(std::size_t n)
+	{
+		need(n);
+		p_ += n;
+		return ByteReader(p_ - n, n);
+	}
+
+	std::uint64_t varint()
+	{
+		// Most numbers are a byte or two, and a full ten bytes left means
+		// no bounds checks are needed on the way.
+		if (left() >= 10)
+		{
+			std::uint64_t v = *p_++;
+			if (v < 0x80)
+				return v;
+			v &= 0x7f;
+			for (int shift = 7; shift < 70; shift += 7)
+			{
+				std::uint64_t b = *p_++;
+				v |= (b & 0x7f) << shift;
+				if (b < 0x80)
+					return v;
+			}
+			throw std::runtime_error("Data has a malformed number");
+		}
+
+		std::uint64_t v = 0;
+		for (int shift = 0; shift < 64; shift += 7)
+		{
+			need(1);
+			std::uint8_t b = *p_++;
+			v |= static_cast<std::uint64_t>(b & 0x7f) << shift;
+			if (!(b & 0x80))
+				return v;
+		}
+		throw std::runtime_error("Data has a malformed number");
+	}
+
+	std::int64_t svarint()
+	{
+		std::uint64_t z = varint();
+		return static_cast<std::int64_t>(z >> 1) ^ -static_cast<std::int64_t>(z & 1);
+	}
+
+private:
+	const std::uint8_t *p_;
+	const std::uint8_t *end_;
+
+	void need(std::size_t n) const
+	{
+		if (left() < n)
+			throw std::runtime_error("Data is truncated");
+	}
+};
+
+// A saved SimState.  The file is an 8-byte magic, a version and a list of
+// tagged, length-prefixed sections, little-endian throughout.  The header
+// and the wall and food bits are written straight from memory.  Food and
+// ghosts are written one at a time, field by field, as the difference from
+// the same field of the entity before (previous positions from the entity's
+// own position).  A leading byte marks which differences aren't zero, and
+// only those follow, as zigzag varints, so the colours, sizes and timers
+// that rarely change cost nothing.  Readers skip sections they don't know.
+class SaveFile {
+public:
+	static constexpr std::uint32_t VERSION = 1;
+
+	static void write(const SimState &state, const std::string &path);
+	static void read(const std::string &path, SimState &state);
+
+	static void encode(const SimState &state, std::vector<std::uint8_t> &out);
+	static void decode(const std::uint8_t *data, std::size_t size, SimState &state);
+
+	// Decodes into whatever the sink keeps the state in, so a game being
+	// loaded needn't build a SimState first.  The sink is given the header
+	// before anything else, and has
+	//   void header(const SimState::Header &h);
+	//   std::uint64_t *grid(bool food);      // the wall or food bits, to fill
+	//   void food(const Food &f);            // each in order
+	//   void ghost(const Ghost &g);
+	template <typename Sink>
+	static void read(const std::string &path, Sink &sink);
+	template <typename Sink>
+	static void decode(const std::uint8_t *data, std::size_t size, Sink &sink);
+
+private:
+	static constexpr char MAGIC[8] = {'X', '1', '1', 'G', 'S', 'A', 'V', 'E'};
+	enum Tag : std::uint32_t {
+		TAG_HEADER = 0x44414548,        // "HEAD"
+		TAG_WALLS = 0x4c4c4157,         // "WALL"
+		TAG_FOOD_GRID = 0x44524746,     // "FGRD"
+		TAG_FOOD_LIST = 0x54534c46,     // "FLST"
+		TAG_GHOSTS = 0x54534847,        // "GHST"
+	};
+
+	// The fields of a Food or Ghost, the ghost's move timer last.
+	static constexpr int FIELDS = 8;
+	using Fields = std::array<std::int64_t, FIELDS>;
+
+	static Fields fieldsOf(const Character &c, long timer);
+	static void toCharacter(const Fields &f, Character &c);
+	static void putEntity(ByteWriter &w, const Fields &f, Fields &last);
+	static void getEntity(ByteReader &r, Fields &f);
+};
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "SaveFile writes fixed-size sections straight from memory");
+
+SaveFile::Fields SaveFile::fieldsOf(const Character &c, long timer)
+{
+	return {static_cast<std::int64_t>(c.color), c.position.x, c.position.y, c.size.width, c.size.height,
+	        c.previous.x - c.position.x, c.previous.y - c.position.y, timer};
+}
+
+void SaveFile::toCharacter(const Fields &f, Character &c)
+{
+	c.color = static_cast<unsigned long>(f[0]);
+	c.position = {static_cast<int>(f[1]), static_cast<int>(f[2])};
+	c.size = {static_cast<int>(f[3]), static_cast<int>(f[4])};
+	c.previous = {c.position.x + static_cast<int>(f[5]), c.position.y + static_cast<int>(f[6])};
+}
+
+void SaveFile::putEntity(ByteWriter &w, const Fields &f, Fields &last)
+{
+	std::uint8_t changed = 0;
+	for (int i = 0; i < FIELDS; ++i)
+		changed |= (f[i] != last[i]) << i;
+	w.fixed(changed);
+	for (int i = 0; i < FIELDS; ++i)
+		if (changed & (1 << i))
+			w.svarint(static_cast<std::int64_t>(static_cast<std::uint64_t>(f[i]) - static_cast<std::uint64_t>(last[i])));
+	last = f;
+}
+
+// f holds the entity before on the way in.
+void SaveFile::getEntity(ByteReader &r, Fields &f)
+{
+	unsigned changed = r.fixed<std::uint8_t>();
+	for (; changed; changed &= changed - 1)
+	{
+		int i = __builtin_ctz(changed);
+		f[i] = static_cast<std::int64_t>(static_cast<std::uint64_t>(f[i]) + static_cast<std::uint64_t>(r.svarint()));
+	}
+}
+
+void SaveFile::encode(const SimState &state, std::vector<std::uint8_t> &out)
+{
+	const SimState::Header &h = state.header();
+	out.clear();
+	ByteWriter w(out);
+	w.raw(MAGIC, sizeof(MAGIC));
+	w.fixed(VERSION);
+
+	// The length is filled in once the section is written.
+	std::size_t length_at = 0;
+	auto begin = [&](Tag tag) {
+		w.fixed(static_cast<std::uint32_t>(tag));
+		length_at = w.size();
+		w.fixed(std::uint64_t(0));
+	};
+	auto end = [&] {
+		std::uint64_t length = w.size() - length_at - sizeof(std::uint64_t);
+		std::memcpy(w.at(length_at), &length, sizeof(length));
+	};
+
+	begin(TAG_HEADER);
+	w.raw(&h, sizeof(h));
+	end();
+
+	begin(TAG_WALLS);
+	w.raw(state.at(SimState::WALLS), state.gridWords() * sizeof(std::uint64_t));
+	end();
+
+	if (h.flags & SimState::FOOD_GRID)
+	{
+		begin(TAG_FOOD_GRID);
+		w.raw(state.at(SimState::FOOD_GRID_WORDS), state.gridWords() * sizeof(std::uint64_t));
+		end();
+	}
+
+	begin(TAG_FOOD_LIST);
+	Food food;
+	Fields last {};
+	for (std::uint32_t i = 0; i < h.food; ++i)
+	{
+		std::memcpy(static_cast<void *>(&food), state.at(SimState::FOOD_LIST) + i * sizeof(Food) / 8, sizeof(Food));
+		putEntity(w, fieldsOf(food, 0), last);
+	}
+	end();
+
+	begin(TAG_GHOSTS);
+	Ghost ghost;
+	last = {};
+	for (std::uint32_t i = 0; i < h.ghosts; ++i)
+	{
+		std::memcpy(static_cast<void *>(&ghost), state.at(SimState::GHOSTS) + i * sizeof(Ghost) / 8, sizeof(Ghost));
+		putEntity(w, fieldsOf(ghost, ghost.ticks_to_move), last);
+	}
+	end();
+}
+
+template <typename Sink>
+void SaveFile::decode(const std::uint8_t *data, std::size_t size, Sink &sink)
+{
+	ByteReader r(data, size);
+	char magic[sizeof(MAGIC)];
+	r.raw(magic, sizeof(magic));
+	if (std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+		throw std::runtime_error("Not a save file");
+	std::uint32_t version = r.fixed<std::uint32_t>();
+	if (version > VERSION)
+		throw std::runtime_error("Save file is version " + std::to_string(version) + ", newer than this build reads");
+
+	SimState::Header h;
+	std::size_t grid_words = 0;
+	bool have_header = false;
+	bool have_walls = false;
+	bool have_food = false;
+	bool have_food_list = false;
+	bool have_ghosts = false;
+	while (r.left() > 0)
+	{
+		std::uint32_t tag = r.fixed<std::uint32_t>();
+		ByteReader section = r.take(r.fixed<std::uint64_t>());
+		// Sinks are handed each entity once, so a list can't come twice.
+		if ((tag == TAG_HEADER && have_header) || (tag == TAG_FOOD_LIST && have_food_list)
+		    || (tag == TAG_GHOSTS && have_ghosts))
+			throw std::runtime_error("Save file has a section twice");
+
+		if (tag == TAG_HEADER)
+		{
+			if (section.left() != sizeof(h))
+				throw std::runtime_error("Save file header is the wrong size");
+			section.raw(&h, sizeof(h));
+			// Every entity takes at least a byte, so the counts can be
+			// checked before anything is allocated for them.
+			if (h.cols < 1 || h.rows < 1 || h.cols > 1 << 20 || h.rows > 1 << 20
+			    || SimState::layout(h, SimState::FOOD_GRID_WORDS) > size / 8 + sizeof(h) / 8
+			    || static_cast<std::uint64_t>(h.food) + h.ghosts > size)
+				throw std::runtime_error("Save file has a bad header");
+			grid_words = SimState::layout(h, SimState::FOOD_GRID_WORDS) - SimState::layout(h, SimState::WALLS);
+			sink.header(h);
+			have_header = true;
+		}
+		else if (!have_header)
+		{
+			throw std::runtime_error("Save file doesn't start with its header");
+		}
+		else if (tag == TAG_WALLS || tag == TAG_FOOD_GRID)
+		{
+			if (section.left() != grid_words * sizeof(std::uint64_t)
+			    || (tag == TAG_FOOD_GRID && !(h.flags & SimState::FOOD_GRID)))
+				throw std::runtime_error("Save file has a grid of the wrong size");
+			section.raw(sink.grid(tag == TAG_FOOD_GRID), section.left());
+			(tag == TAG_WALLS ? have_walls : have_food) = true;
+		}
+		else if (tag == TAG_FOOD_LIST)
+		{
+			Food food;
+			Fields f {};
+			for (std::uint32_t i = 0; i < h.food; ++i)
+			{
+				getEntity(section, f);
+				toCharacter(f, food);
+				sink.food(food);
+			}
+			have_food_list = true;
+			have_food = have_food || !(h.flags & SimState::FOOD_GRID);
+		}
+		else if (tag == TAG_GHOSTS)
+		{
+			Ghost ghost;
+			Fields f {};
+			for (std::uint32_t i = 0; i < h.ghosts; ++i)
+			{
+				getEntity(section, f);
+				toCharacter(f, ghost);
+				ghost.ticks_to_move = static_cast<long>(f[7]);
+				sink.ghost(ghost);
+			}
+			have_ghosts = true;
+		}
+	}
+
+	if (!have_header || !have_walls || !have_food || !have_ghosts)
+		throw std::runtime_error("Save file is missing a section");
+}
+
+void SaveFile::decode(const std::uint8_t *data, std::size_t size, SimState &state)
+{
+	struct ToState {
+		SimState &state;
+		std::uint64_t *food_at = nullptr;
+		std::uint64_t *ghost_at = nullptr;
+
+		void header(const SimState::Header &h)
+		{
+			state.arena_.assign(SimState::layout(h, SimState::END), 0);
+			std::memcpy(state.arena_.data(), &h, sizeof(h));
+			food_at = state.at(SimState::FOOD_LIST);
+			ghost_at = state.at(SimState::GHOSTS);
+		}
+		std::uint64_t *grid(bool food) { return state.at(food ? SimState::FOOD_GRID_WORDS : SimState::WALLS); }
+		void food(const Food &f)
+		{
+			std::memcpy(food_at, &f, sizeof(f));
+			food_at += sizeof(f) / 8;
+		}
+		void ghost(const Ghost &g)
+		{
+			std::memcpy(ghost_at, &g, sizeof(g));
+			ghost_at += sizeof(g) / 8;
+		}
+	};
+	ToState sink {state};
+	decode(data, size, sink);
+}
+
+void SaveFile::write(const SimState &state, const std::string &path)
+{
+	std::vector<std::uint8_t> bytes;
+	encode(state, bytes);
+
+	FILE *f = std::fopen(path.c_str(), "wb");
+	if (!f)
+		throw std::runtime_error("Unable to write " + path);
+	bool ok = std::fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size();
+	ok = std::fclose(f) == 0 && ok;
+	if (!ok)
+		throw std::runtime_error("Unable to write " + path);
+}
+
+void SaveFile::read(const std::string &path, SimState &state)
+{
+	read<SimState>(path, state);
+}
+
+template <typename Sink>
+void SaveFile::read(const std::string &path, Sink &sink)
+{
+	FILE *f = std::fopen(path.c_str(), "rb");
+	if (!f)
+		throw std::runtime_error("Unable to open " + path);
+	std::vector<std::uint8_t> bytes;
+	long size = std::fseek(f, 0, SEEK_END) == 0 ? std::ftell(f) : -1;
+	if (size >= 0)
+	{
+		bytes.resize(static_cast<std::size_t>(size));
+		std::rewind(f);
+		bytes.resize(std::fread(bytes.data(), 1, bytes.size(), f));
+	}
+	std::fclose(f);
+	if (size < 0)
+		throw std::runtime_error("Unable to read " + path);
+
+	decode(bytes.data(), bytes.size(), sink);
+}
+
+// Rules for a Match.  Sizes are in cells and times in ticks; the defaults
+// are the game's at 60 Hz.
+struct MatchConfig {
+	int cols = GameDisplay::DEFAULT_WIDTH / CellGrid::CELL_SIZE;
+	int rows = GameDisplay::DEFAULT_HEIGHT / CellGrid::CELL_SIZE;
+	int food = 10;
+	int ghosts = 10;
+	bool walls = false;
+	int players = 8;              // player slots; clients beyond these watch
+	int sim_hz = 60;
+	int player_period = 4;        // ticks per cell while a direction is held: 15 cells/s
+	int ghost_period = 15;        // ticks between ghost moves: 250 ms
+	int respawn_ticks = 120;      // how long a caught player sits out
+	std::uint64_t seed = 1;
+};
+
+// One multiplayer match: the game's rules at whole cells, as VecEnv plays
+// them, with several players sharing a level.  A player a ghost touches sits
+// out for a while and comes back at the spawn; once the food is gone
+// everyone moves on to a new level.
+//
+// The whole state lives in one block of words the caller provides, so it
+// can be copied, pooled and diffed word by word.  Everything before
+// Layout::hidden is what clients are sent; the ghost timers, input
+// sequence numbers and generator after it stay on the server.  Nothing
+// that is sent changes on a tick unless something moved, so the deltas
+// between states stay small however many players sit still.
+class Match {
+public:
+	struct Header {
+		std::uint64_t tick;
+		std::uint32_t level;
+		std::uint32_t food_left;
+	};
+	enum PlayerState : std::uint8_t { EMPTY, PLAYING, CAUGHT };
+	struct Player {
+		std::int16_t x;
+		std::int16_t y;
+		std::uint8_t state;
+		std::uint8_t input;           // VecAction held
+		std::uint16_t reserved;
+		std::uint32_t score;
+		std::uint32_t move_at;        // tick it may next move on, or come back into play on
+	};
+	struct Cell {
+		std::int16_t x;
+		std::int16_t y;
+	};
+	// Where each section starts, in words.
+	struct Layout {
+		std::size_t players, ghosts, walls, food, hidden, timers, seqs, rng, end;
+		int words_per_row;
+	};
+
+	static Layout layout(const MatchConfig &config);
+
+	// config and layout must outlive the Match; block holds layout.end words.
+	Match(const MatchConfig &config, const Layout &layout, std::uint64_t *block)
+	: config_(&config), layout_(&layout), block_(block) {}
+
+	// Empties every slot and starts the first level.
+	void reset(std::uint64_t seed, CellGrid &scratch);
+	// Takes a free player slot and returns it, or -1 if there is none.
+	int join();
+	void leave(int slot);
+	void setInput(int slot, std::uint8_t action, std::uint32_t seq);
+	void step(CellGrid &scratch);
+
+	// A player's movement on the given tick.  Clients run it too, to
+	// predict their own player.
+	static void movePlayer(Player &p, std::uint32_t tick, int player_period, const std::uint64_t *walls,
+	                       int words_per_row, int cols, int rows);
+
+	Header &header() const { return *reinterpret_cast<Header *>(block_); }
+	Player &player(int i) const { return reinterpret_cast<Player *>(block_ + layout_->players)[i]; }
+	Cell &ghost(int i) const { return reinterpret_cast<Cell *>(block_ + layout_->ghosts)[i]; }
+	const std::uint64_t *walls() const { return block_ + layout_->walls; }
+	const std::uint64_t *food() const { return block_ + layout_->food; }
+	// The sequence number of the input a slot's player last had applied.
+	std::uint32_t &inputSeq(int slot) const { return reinterpret_cast<std::uint32_t *>(block_ + layout_->seqs)[slot]; }
+
+private:
+	const MatchConfig *config_;
+	const Layout *layout_;
+	std::uint64_t *block_;
+
+	std::uint16_t &timer(int g) const { return reinterpret_cast<std::uint16_t *>(block_ + layout_->timers)[g]; }
+	std::uint64_t &rng() const { return block_[layout_->rng]; }
+
+	void newLevel(CellGrid &scratch);
+	void spawn(Player &p) const;
+};
+
+static_assert(sizeof(Match::Header) == 16 && sizeof(Match::Player) == 16 && sizeof(Match::Cell) == 4,
+              "Match sections are packed");
+
+namespace {
+
+const int MOVE_DX[ACTION_COUNT] = {0, 0, 0, -1, 1};
+const int MOVE_DY[ACTION_COUNT] = {0, -1, 1, 0, 0};
+
+bool cellBlocked(const std::uint64_t *walls, int words_per_row, int cols, int rows, int x, int y)
+{
+	return x < 0 || y < 0 || x >= cols || y >= rows
+	       || (walls[static_cast<std::size_t>(y) * words_per_row + (x >> 6)] >> (x & 63) & 1);
+}
+
+}
+
+Match::Layout Match::layout(const MatchConfig &config)
+{
+	auto words = [](std::size_t bytes) { return (bytes + 7) / 8; };
+	Layout l;
+	l.words_per_row = (config.cols + 63) / 64;
+	std::size_t grid = static_cast<std::size_t>(l.words_per_row) * config.rows;
+	l.players = words(sizeof(Header));
+	l.ghosts = l.players + words(sizeof(Player) * config.players);
+	l.walls = l.ghosts + words(sizeof(Cell) * config.ghosts);
+	l.food = l.walls + grid;
+	l.hidden = l.food + grid;
+	l.timers = l.hidden;
+	l.seqs = l.timers + words(sizeof(std::uint16_t) * config.ghosts);
+	l.rng = l.seqs + words(sizeof(std::uint32_t) * config.players);
+	l.end = l.rng + 1;
+	return l;
+}
+
+void Match::reset(std::uint64_t seed, CellGrid &scratch)
+{
+	std::fill_n(block_, layout_->end, 0);
+	rng() = seed;
+	newLevel(scratch);
+}
+
+// Walls, food and ghosts from the match's own generator, and everyone back
+// to the spawn.
+void Match::newLevel(CellGrid &scratch)
+{
+	const MatchConfig &c = *config_;
+	Rng r(rng());
+	std::vector<Point> spawns = generateCells(c.cols, c.rows, c.walls, c.food + c.ghosts, r, scratch);
+	rng() = r.state;
+
+	std::uint64_t *walls = block_ + layout_->walls;
+	std::uint64_t *food = block_ + layout_->food;
+	std::size_t grid = layout_->food - layout_->walls;
+	std::copy_n(scratch.words(), grid, walls);
+	std::fill_n(food, grid, 0);
+
+	std::size_t n_food = std::min<std::size_t>(c.food, spawns.size());
+	for (std::size_t k = 0; k < n_food; ++k)
+		food[static_cast<std::size_t>(spawns[k].y) * layout_->words_per_row + (spawns[k].x >> 6)]
+			|= std::uint64_t(1) << (spawns[k].x & 63);
+	for (int g = 0; g < c.ghosts; ++g)
+	{
+		std::size_t k = n_food + g;
+		if (k < spawns.size())
+			ghost(g) = {static_cast<std::int16_t>(spawns[k].x), static_cast<std::int16_t>(spawns[k].y)};
+		else
+			ghost(g) = {-1, -1};      // no room: parked off the level
+		timer(g) = static_cast<std::uint16_t>(c.ghost_period);
+	}
+
+	Header &h = header();
+	++h.level;
+	h.food_left = static_cast<std::uint32_t>(n_food);
+	for (int i = 0; i < c.players; ++i)
+		if (player(i).state != EMPTY)
+			spawn(player(i));
+}
+
+void Match::spawn(Player &p) const
+{
+	p.x = static_cast<std::int16_t>(PLAYER_SPAWN.x / CellGrid::CELL_SIZE);
+	p.y = static_cast<std::int16_t>(PLAYER_SPAWN.y / CellGrid::CELL_SIZE);
+	p.state = PLAYING;
+	p.move_at = static_cast<std::uint32_t>(header().tick);
+}
+
+int Match::join()
+{
+	for (int i = 0; i < config_->players; ++i)
+	{
+		Player &p = player(i);
+		if (p.state == EMPTY)
+		{
+			p = Player {};
+			spawn(p);
+			inputSeq(i) = 0;
+			return i;
+		}
+	}
+	return -1;
+}
+
+void Match::leave(int slot)
+{
+	player(slot) = Player {};
+	inputSeq(slot) = 0;
+}
+
+void Match::setInput(int slot, std::uint8_t action, std::uint32_t seq)
+{
+	Player &p = player(slot);
+	p.input = action < ACTION_COUNT ? action : std::uint8_t(ACTION_NONE);
+	inputSeq(slot) = seq;
+}
+
+// Holding a direction moves a cell at once and then one every
+// player_period ticks; letting go means the next press moves at once.
+// Ticks are compared as differences so they can wrap.
+void Match::movePlayer(Player &p, std::uint32_t tick, int player_period, const std::uint64_t *walls,
+                       int words_per_row, int cols, int rows)
+{
+	if (p.state != PLAYING)
+		return;
+	bool waiting = static_cast<std::int32_t>(tick - p.move_at) < 0;
+	if (p.input == ACTION_NONE || p.input >= ACTION_COUNT)
+	{
+		if (waiting)
+			p.move_at = tick;
+		return;
+	}
+	if (waiting)
+		return;
+
+	int x = p.x + MOVE_DX[p.input];
+	int y = p.y + MOVE_DY[p.input];
+	if (!cellBlocked(walls, words_per_row, cols, rows, x, y))
+	{
+		p.x = static_cast<std::int16_t>(x);
+		p.y = static_cast<std::int16_t>(y);
+	}
+	p.move_at = tick + static_cast<std::uint32_t>(player_period);
+}
+
+void Match::step(CellGrid &scratch)
+{
+	const MatchConfig &c = *config_;
+	const int wpr = layout_->words_per_row;
+	const std::uint64_t *walls = block_ + layout_->walls;
+	std::uint64_t *food = block_ + layout_->food;
+	Header &h = header();
+	const std::uint32_t tick = static_cast<std::uint32_t>(h.tick);
+
+	for (int i = 0; i < c.players; ++i)
+	{
+		Player &p = player(i);
+		if (p.state == CAUGHT && static_cast<std::int32_t>(tick - p.move_at) >= 0)
+			spawn(p);
+		movePlayer(p, tick, c.player_period, walls, wpr, c.cols, c.rows);
+		if (p.state != PLAYING)
+			continue;
+
+		std::uint64_t &w = food[static_cast<std::size_t>(p.y) * wpr + (p.x >> 6)];
+		std::uint64_t bit = std::uint64_t(1) << (p.x & 63);
+		if (w & bit)
+		{
+			w &= ~bit;
+			--h.food_left;
+			++p.score;
+		}
+	}
+
+	Rng r(rng());
+	for (int g = 0; g < c.ghosts; ++g)
+	{
+		if (--timer(g) > 0)
+			continue;
+		timer(g) = static_cast<std::uint16_t>(c.ghost_period);
+		int d = 1 + r.uniform(4);
+		Cell &gh = ghost(g);
+		int x = gh.x + MOVE_DX[d];
+		int y = gh.y + MOVE_DY[d];
+		if (gh.x >= 0 && !cellBlocked(walls, wpr, c.cols, c.rows, x, y))
+			gh = {static_cast<std::int16_t>(x), static_cast<std::int16_t>(y)};
+	}
+	rng() = r.state;
+
+	// Touching, as the game's rectangles do, is being within a cell.
+	// Parked ghosts aren't on the level to touch anyone.
+	for (int i = 0; i < c.players; ++i)
+	{
+		Player &p = player(i);
+		if (p.state != PLAYING)
+			continue;
+		for (int g = 0; g < c.ghosts; ++g)
+		{
+			const Cell &gh = ghost(g);
+			if (gh.x >= 0 && std::abs(gh.x - p.x) <= 1 && std::abs(gh.y - p.y) <= 1)
+			{
+				p.state = CAUGHT;
+				p.move_at = tick + static_cast<std::uint32_t>(std::max(c.respawn_ticks, 1));
+				break;
+			}
+		}
+	}
+
+	++h.tick;
+	if (h.food_left == 0 && c.food > 0)
+		newLevel(scratch);
+}
+
+// The words of cur that differ from base, as a count and then a (words
+// skipped, xor) pair of varints for each.  A quiet tick costs a few bytes
+// and a player moving a cell about three more.
+void encodeDelta(const std::uint64_t *base, const std::uint64_t *cur, std::size_t words, ByteWriter &w)
+{
+	std::size_t changed = 0;
+	for (std::size_t i = 0; i < words; ++i)
+		changed += base[i] != cur[i];
+	w.varint(changed);
+
+	std::size_t next = 0;
+	for (std::size_t i = 0; i < words; ++i)
+	{
+		if (base[i] != cur[i])
+		{
+			w.varint(i - next);
+			w.varint(base[i] ^ cur[i]);
+			next = i + 1;
+		}
+	}
+}
+
+void decodeDelta(ByteReader &r, const std::uint64_t *base, std::uint64_t *out, std::size_t words)
+{
+	std::copy_n(base, words, out);
+	std::uint64_t changed = r.varint();
+	std::size_t at = 0;
+	for (std::uint64_t k = 0; k < changed; ++k)
+	{
+		at += r.varint();
+		if (at >= words)
+			throw std::runtime_error("State delta runs off the end");
+		out[at++] ^= r.varint();
+	}
+}
+
+// The datagram protocol between MatchServer and MatchClient.  Every
+// message starts with its type byte.
+//   HELLO    magic
+//   WELCOME  slot (svarint, -1 to watch), then the MatchConfig as varints
+//   INPUT    seq, action byte, newest state tick received
+//   STATE    tick, how many ticks back its baseline is (0: none), slot,
+//            the seq of the last of the client's inputs applied, delta
+//   BYE
+namespace net {
+
+enum Message : std::uint8_t { HELLO = 1, WELCOME, INPUT, STATE, BYE };
+
+constexpr std::uint32_t MAGIC = 0x47313158;      // "X11G"
+constexpr int HISTORY = 64;                      // ticks of state kept as delta baselines
+constexpr std::size_t MAX_INPUTS = 8;            // queued per client; older ones are dropped
+constexpr long CLIENT_TIMEOUT_NS = 5'000'000'000;
+constexpr std::size_t MAX_DATAGRAM = 65507;
+
+// The most a STATE packet can take for a state of this many words: every
+// word changed, ten bytes for each XOR and at most two for each skip,
+// after a header of a few varints.
+constexpr std::size_t maxStateBytes(std::size_t words) { return 64 + words * 12; }
+
+// "unix:PATH" for a Unix datagram socket, "udp:PORT" for UDP on loopback.
+struct Address {
+	sockaddr_storage addr {};
+	socklen_t len = 0;
+	std::string unix_path;
+
+	static Address parse(const std::string &spec)
+	{
+		Address a;
+		if (spec.compare(0, 5, "unix:") == 0)
+		{
+			sockaddr_un &un = reinterpret_cast<sockaddr_un &>(a.addr);
+			a.unix_path = spec.substr(5);
+			if (a.unix_path.empty() || a.unix_path.size() >= sizeof(un.sun_path))
+				throw std::runtime_error("Bad socket path in " + spec);
+			un.sun_family = AF_UNIX;
+			std::memcpy(un.sun_path, a.unix_path.c_str(), a.unix_path.size() + 1);
+			a.len = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + a.unix_path.size() + 1);
+		}
+		else if (spec.compare(0, 4, "udp:") == 0)
+		{
+			sockaddr_in &in = reinterpret_cast<sockaddr_in &>(a.addr);
+			int port = std::atoi(spec.c_str() + 4);
+			if (port <= 0 || port > 65535)
+				throw std::runtime_error("Bad port in " + spec);
+			in.sin_family = AF_INET;
+			in.sin_port = htons(static_cast<std::uint16_t>(port));
+			in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			a.len = sizeof(in);
+		}
+		else
+			throw std::runtime_error("Addresses are unix:PATH or udp:PORT, not " + spec);
+		return a;
+	}
+};
+
+// A nonblocking datagram socket, bound to the address to serve on it, or
+// else connected to it.
+int openSocket(const Address &address, bool serve)
+{
+	int fd = socket(address.addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw std::runtime_error("Unable to create socket");
+
+	const sockaddr *to = reinterpret_cast<const sockaddr *>(&address.addr);
+	bool ok;
+	if (serve)
+	{
+		if (!address.unix_path.empty())
+			unlink(address.unix_path.c_str());
+		ok = bind(fd, to, address.len) == 0;
+		int buffer = 4 << 20;
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+	}
+	else
+	{
+		// A Unix client needs a name of its own for replies; binding just
+		// the family gets an abstract one picked by the kernel.
+		ok = true;
+		if (address.addr.ss_family == AF_UNIX)
+		{
+			sockaddr_un un {};
+			un.sun_family = AF_UNIX;
+			ok = bind(fd, reinterpret_cast<const sockaddr *>(&un), sizeof(sa_family_t)) == 0;
+		}
+		ok = ok && connect(fd, to, address.len) == 0;
+	}
+	if (!ok)
+	{
+		int err = errno;
+		close(fd);
+		throw std::runtime_error(std::string("Unable to ") + (serve ? "bind" : "connect") + " socket: " + std::strerror(err));
+	}
+	return fd;
+}
+
+void putConfig(ByteWriter &w, const MatchConfig &c)
+{
+	for (int v: {c.cols, c.rows, c.food, c.ghosts, int(c.walls), c.players, c.sim_hz, c.player_period,
+	             c.ghost_period, c.respawn_ticks})
+		w.varint(static_cast<std::uint64_t>(v));
+}
+
+MatchConfig getConfig(ByteReader &r)
+{
+	MatchConfig c;
+	for (int *v: {&c.cols, &c.rows, &c.food, &c.ghosts})
+		*v = static_cast<int>(std::min<std::uint64_t>(r.varint(), 4096));
+	c.walls = r.varint() != 0;
+	for (int *v: {&c.players, &c.sim_hz, &c.player_period, &c.ghost_period, &c.respawn_ticks})
+		*v = static_cast<int>(std::min<std::uint64_t>(r.varint(), 65535));
+	if (c.cols <= 0 || c.rows <= 0 || c.sim_hz <= 0 || c.player_period <= 0 || c.ghost_period <= 0)
+		throw std::runtime_error("Bad match config");
+	return c;
+}
+
+}
+
+// Runs one Match at its tick rate for whoever sends it a HELLO, on an epoll
+// loop with a timerfd for the ticks.  Every tick each client gets the state
+// as a delta from the newest one it has acknowledged, or whole if that has
+// dropped out of the history; clients on the same baseline share one
+// encoding.  Inputs are queued per client and one applied a tick, the rate
+// the client sends them at, so its prediction stays in step.
+class MatchServer {
+public:
+	struct Stats {
+		long ticks = 0;
+		long missed_ticks = 0;        // timer expirations beyond the one handled
+		long packets_in = 0;
+		long bad_packets = 0;
+		long states_sent = 0;
+		long full_states = 0;         // sent without a baseline
+		long send_drops = 0;          // the client's queue was full, or the state didn't fit
+		long bytes_out = 0;
+		std::size_t peak_clients = 0;
+		LatencyHistogram tick_ms;     // simulating and sending one tick
+
+		void print() const;
+	};
+
+	MatchServer(const MatchConfig &config, const std::string &address);
+	~MatchServer();
+	MatchServer(const MatchServer &) = delete;
+	MatchServer &operator=(const MatchServer &) = delete;
+
+	// Serves until running goes false, or seconds pass if that is positive.
+	void run(const std::atomic<bool> &running, double seconds);
+	const Stats &stats() const { return stats_; }
+	std::size_t clients() const { return clients_.size(); }
+
+private:
+	struct Client {
+		sockaddr_storage addr;
+		socklen_t len;
+		int slot;                     // -1 watches
+		std::uint64_t acked = 0;      // newest state tick it has said it holds
+		std::uint32_t last_seq = 0;
+		long heard_ns = 0;
+		std::deque<std::pair<std::uint32_t, std::uint8_t>> inputs;   // seq, action
+	};
+
+	MatchConfig config_;
+	Match::Layout layout_;
+	std::vector<std::uint64_t> block_;
+	Match match_;
+	CellGrid scratch_;
+	std::vector<std::uint64_t> history_;          // HISTORY wire states, by tick
+	std::vector<std::uint64_t> empty_;            // the baseline for full states
+	std::vector<std::vector<std::uint8_t>> deltas_;   // this tick's encodings, by baseline distance
+	std::vector<std::uint64_t> delta_tick_;
+	std::unordered_map<std::string, Client> clients_;
+	std::string unix_path_;
+	int fd_ = -1;
+	int epoll_ = -1;
+	int timer_ = -1;
+	Time clock_;
+	Stats stats_;
+	std::vector<std::uint8_t> packet_;
+
+	void receive();
+	void handle(const sockaddr_storage &from, socklen_t len, ByteReader r);
+	void tick();
+	void send(const Client &c);
+};
+
+MatchServer::MatchServer(const MatchConfig &config, const std::string &address)
+: config_(config), layout_(Match::layout(config_)), block_(layout_.end),
+  match_(config_, layout_, block_.data()), history_(net::HISTORY * layout_.hidden),
+  empty_(layout_.hidden), deltas_(net::HISTORY), delta_tick_(net::HISTORY, 0)
+{
+	// Full states go out whole, so the worst of them has to fit.
+	std::size_t worst = net::maxStateBytes(layout_.hidden);
+	if (worst > net::MAX_DATAGRAM)
+		throw std::runtime_error("A " + std::to_string(config_.cols) + "x" + std::to_string(config_.rows)
+		                         + " match is too big to serve: a full state can take " + std::to_string(worst)
+		                         + " bytes, and a datagram holds " + std::to_string(net::MAX_DATAGRAM));
+	match_.reset(config_.seed, scratch_);
+
+	net::Address a = net::Address::parse(address);
+	fd_ = net::openSocket(a, true);
+	unix_path_ = a.unix_path;
+	epoll_ = epoll_create1(EPOLL_CLOEXEC);
+	timer_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (epoll_ < 0 || timer_ < 0)
+		throw std::runtime_error("Unable to set up the server's event loop");
+
+	epoll_event ev {};
+	ev.events = EPOLLIN;
+	ev.data.fd = fd_;
+	epoll_ctl(epoll_, EPOLL_CTL_ADD, fd_, &ev);
+	ev.data.fd = timer_;
+	epoll_ctl(epoll_, EPOLL_CTL_ADD, timer_, &ev);
+}
+
+MatchServer::~MatchServer()
+{
+	for (int fd: {timer_, epoll_, fd_})
+		if (fd >= 0)
+			close(fd);
+	if (!unix_path_.empty())
+		unlink(unix_path_.c_str());
+}
+
+void MatchServer::run(const std::atomic<bool> &running, double seconds)
+{
+	long period_ns = 1'000'000'000L / config_.sim_hz;
+	itimerspec spec {};
+	spec.it_interval.tv_sec = period_ns / 1'000'000'000L;
+	spec.it_interval.tv_nsec = period_ns % 1'000'000'000L;
+	spec.it_value = spec.it_interval;
+	timerfd_settime(timer_, 0, &spec, nullptr);
+
+	Time t;
+	epoll_event events[2];
+	while (running.load(std::memory_order_relaxed) && (seconds <= 0 || t.time() < seconds * 1e9))
+	{
+		// Wake at least every 100 ms to notice running going false.
+		int n = epoll_wait(epoll_, events, 2, 100);
+		for (int i = 0; i < n; ++i)
+		{
+			if (events[i].data.fd == fd_)
+				receive();
+			else
+			{
+				std::uint64_t expirations = 0;
+				if (read(timer_, &expirations, sizeof(expirations)) == sizeof(expirations) && expirations)
+				{
+					// Late ticks are not made up: the match runs at wall-clock rate
+					// and the count of skipped ones says how far behind it fell.
+					stats_.missed_ticks += static_cast<long>(expirations - 1);
+					receive();
+					tick();
+				}
+			}
+		}
+	}
+
+	spec = {};
+	timerfd_settime(timer_, 0, &spec, nullptr);
+}
+
+void MatchServer::receive()
+{
+	std::uint8_t buffer[2048];
+	for (;;)
+	{
+		sockaddr_storage from;
+		socklen_t len = sizeof(from);
+		ssize_t n = recvfrom(fd_, buffer, sizeof(buffer), 0, reinterpret_cast<sockaddr *>(&from), &len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		++stats_.packets_in;
+		try
+		{
+			handle(from, len, ByteReader(buffer, static_cast<std::size_t>(n)));
+		}
+		catch (const std::runtime_error &)
+		{
+			++stats_.bad_packets;
+		}
+	}
+}
+
+void MatchServer::handle(const sockaddr_storage &from, socklen_t len, ByteReader r)
+{
+	std::string key(reinterpret_cast<const char *>(&from), len);
+	auto it = clients_.find(key);
+	std::uint8_t type = r.fixed<std::uint8_t>();
+
+	if (type == net::HELLO)
+	{
+		if (r.fixed<std::uint32_t>() != net::MAGIC)
+			throw std::runtime_error("Not a client");
+		if (it == clients_.end())
+		{
+			Client c {};
+			c.addr = from;
+			c.len = len;
+			c.slot = match_.join();
+			it = clients_.emplace(key, std::move(c)).first;
+			stats_.peak_clients = std::max(stats_.peak_clients, clients_.size());
+		}
+		it->second.heard_ns = clock_.time();
+
+		// A repeated HELLO means the WELCOME was lost; send it again.
+		packet_.clear();
+		ByteWriter w(packet_);
+		w.fixed(std::uint8_t(net::WELCOME));
+		w.svarint(it->second.slot);
+		net::putConfig(w, config_);
+		sendto(fd_, packet_.data(), packet_.size(), 0, reinterpret_cast<const sockaddr *>(&from), len);
+		return;
+	}
+	if (it == clients_.end())
+		return;
+
+	Client &c = it->second;
+	c.heard_ns = clock_.time();
+	if (type == net::INPUT)
+	{
+		std::uint32_t seq = static_cast<std::uint32_t>(r.varint());
+		std::uint8_t action = r.fixed<std::uint8_t>();
+		std::uint64_t acked = r.varint();
+		if (acked > c.acked && acked <= match_.header().tick)
+			c.acked = acked;
+		if (c.slot >= 0 && seq > c.last_seq)
+		{
+			c.last_seq = seq;
+			c.inputs.emplace_back(seq, action);
+			if (c.inputs.size() > net::MAX_INPUTS)
+				c.inputs.pop_front();
+		}
+	}
+	else if (type == net::BYE)
+	{
+		if (c.slot >= 0)
+			match_.leave(c.slot);
+		clients_.erase(it);
+	}
+}
+
+void MatchServer::tick()
+{
+	Time t;
+	long now = clock_.time();
+	for (auto it = clients_.begin(); it != clients_.end();)
+	{
+		Client &c = it->second;
+		if (now - c.heard_ns > net::CLIENT_TIMEOUT_NS)
+		{
+			if (c.slot >= 0)
+				match_.leave(c.slot);
+			it = clients_.erase(it);
+			continue;
+		}
+		if (c.slot >= 0 && !c.inputs.empty())
+		{
+			match_.setInput(c.slot, c.inputs.front().second, c.inputs.front().first);
+			c.inputs.pop_front();
+		}
+		++it;
+	}
+
+	match_.step(scratch_);
+	++stats_.ticks;
+	std::uint64_t tick = match_.header().tick;
+	std::copy_n(block_.data(), layout_.hidden, &history_[(tick % net::HISTORY) * layout_.hidden]);
+
+	for (const auto &entry: clients_)
+		send(entry.second);
+	stats_.tick_ms.add(t.time() / 1e6);
+}
+
+void MatchServer::send(const Client &c)
+{
+	std::uint64_t tick = match_.header().tick;
+	const std::uint64_t *current = &history_[(tick % net::HISTORY) * layout_.hidden];
+
+	// The word at the start of each history slot is its tick, so a slot
+	// since reused for a later tick is not mistaken for the baseline.
+	std::uint64_t distance = 0;
+	const std::uint64_t *base = empty_.data();
+	if (c.acked && tick - c.acked < net::HISTORY)
+	{
+		const std::uint64_t *slot = &history_[(c.acked % net::HISTORY) * layout_.hidden];
+		if (slot[0] == c.acked)
+		{
+			distance = tick - c.acked;
+			base = slot;
+		}
+	}
+
+	std::vector<std::uint8_t> &delta = deltas_[distance];
+	if (delta_tick_[distance] != tick)
+	{
+		delta.clear();
+		ByteWriter d(delta);
+		encodeDelta(base, current, layout_.hidden, d);
+		delta_tick_[distance] = tick;
+	}
+
+	packet_.clear();
+	ByteWriter w(packet_);
+	w.fixed(std::uint8_t(net::STATE));
+	w.varint(tick);
+	w.varint(distance);
+	w.svarint(c.slot);
+	w.varint(c.slot >= 0 ? match_.inputSeq(c.slot) : 0);
+	w.raw(delta.data(), delta.size());
+	// Can't happen for a config the constructor took, but a lost state
+	// must never stop the tick loop.
+	if (packet_.size() > net::MAX_DATAGRAM)
+	{
+		++stats_.send_drops;
+		return;
+	}
+
+	if (sendto(fd_, packet_.data(), packet_.size(), 0, reinterpret_cast<const sockaddr *>(&c.addr), c.len) < 0)
+	{
+		++stats_.send_drops;
+		return;
+	}
+	++stats_.states_sent;
+	stats_.full_states += distance == 0;
+	stats_.bytes_out += static_cast<long>(packet_.size());
+}
+
+void MatchServer::Stats::print() const
+{
+	printf("Ticks: %ld, missed: %ld, peak clients: %zu, packets in: %ld (%ld bad)\n",
+	       ticks, missed_ticks, peak_clients, packets_in, bad_packets);
+	printf("States sent: %ld (%ld full, %ld dropped), %.1f bytes each\n", states_sent, full_states, send_drops,
+	       states_sent ? static_cast<double>(bytes_out) / states_sent : 0.0);
+	tick_ms.print("Server tick");
+}
+
+// The other end: joins a MatchServer, sends an input every tick, and
+// rebuilds each state sent from its delta.  The HISTORY newest states are
+// kept by tick, as baselines for the ones to come.
+class MatchClient {
+public:
+	explicit MatchClient(const std::string &address);
+	~MatchClient();
+	MatchClient(const MatchClient &) = delete;
+	MatchClient &operator=(const MatchClient &) = delete;
+
+	// Says HELLO until welcomed, giving up after timeout_ms.
+	void join(int timeout_ms);
+	// Without waiting: sends HELLO, or returns true once a WELCOME is in.
+	bool tryJoin();
+
+	int fd() const { return fd_; }
+	int slot() const { return slot_; }
+	const MatchConfig &config() const { return config_; }
+	const Match::Layout &layout() const { return layout_; }
+
+	// Sends this tick's action and acknowledges the newest state held.
+	void sendInput(std::uint8_t action);
+	std::uint32_t lastSeq() const { return seq_; }
+
+	// Reads all that has arrived.  Returns true if there is a newer state.
+	bool receive();
+	// The newest state; only its first layout().hidden words are there.
+	// Before the first state arrives tick() is 0 and this is all zeros.
+	Match latest() { return Match(config_, layout_, &history_[(tick_ % net::HISTORY) * layout_.hidden]); }
+	std::uint64_t tick() const { return tick_; }
+	// The seq of the last of our inputs the newest state had applied.
+	std::uint32_t appliedSeq() const { return applied_seq_; }
+
+	long states() const { return states_; }
+	long bytesIn() const { return bytes_in_; }
+
+private:
+	int fd_ = -1;
+	int slot_ = -1;
+	bool welcomed_ = false;
+	MatchConfig config_;
+	Match::Layout layout_ {};
+	std::vector<std::uint64_t> history_;
+	std::uint64_t tick_ = 0;
+	std::uint32_t seq_ = 0;
+	std::uint32_t applied_seq_ = 0;
+	long states_ = 0;
+	long bytes_in_ = 0;
+	std::vector<std::uint8_t> packet_;
+	std::vector<std::uint8_t> buffer_;
+	std::vector<std::uint64_t> decoded_;
+
+	void handle(ByteReader r);
+};
+
+MatchClient::MatchClient(const std::string &address)
+: fd_(net::openSocket(net::Address::parse(address), false)), buffer_(net::MAX_DATAGRAM)
+{
+}
+
+MatchClient::~MatchClient()
+{
+	if (welcomed_)
+	{
+		std::uint8_t bye = net::BYE;
+		::send(fd_, &bye, 1, 0);
+	}
+	close(fd_);
+}
+
+bool MatchClient::tryJoin()
+{
+	receive();
+	if (welcomed_)
+		return true;
+
+	packet_.clear();
+	ByteWriter w(packet_);
+	w.fixed(std::uint8_t(net::HELLO));
+	w.fixed(net::MAGIC);
+	::send(fd_, packet_.data(), packet_.size(), 0);
+	return false;
+}
+
+void MatchClient::join(int timeout_ms)
+{
+	Time t;
+	while (!tryJoin())
+	{
+		if (t.time() > timeout_ms * 1'000'000L)
+			throw std::runtime_error("No answer from the server");
+		pollfd p {fd_, POLLIN, 0};
+		poll(&p, 1, 100);
+	}
+}
+
+void MatchClient::sendInput(std::uint8_t action)
+{
+	packet_.clear();
+	ByteWriter w(packet_);
+	w.fixed(std::uint8_t(net::INPUT));
+	w.varint(++seq_);
+	w.fixed(action);
+	w.varint(tick_);
+	::send(fd_, packet_.data(), packet_.size(), 0);
+}
+
+bool MatchClient::receive()
+{
+	std::uint64_t before = tick_;
+	for (;;)
+	{
+		ssize_t n = recv(fd_, buffer_.data(), buffer_.size(), 0);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		bytes_in_ += n;
+		try
+		{
+			handle(ByteReader(buffer_.data(), static_cast<std::size_t>(n)));
+		}
+		catch (const std::runtime_error &)
+		{
+			// A damaged datagram is as good as a lost one.
+		}
+	}
+	return tick_ != before;
+}
+
+void MatchClient::handle(ByteReader r)
+{
+	std::uint8_t type = r.fixed<std::uint8_t>();
+	if (type == net::WELCOME && !welcomed_)
+	{
+		std::int64_t slot = r.svarint();
+		config_ = net::getConfig(r);
+		// The slot indexes the state's players, so it is checked like them.
+		if (slot < -1 || slot >= config_.players)
+			throw std::runtime_error("Bad match config");
+		slot_ = static_cast<int>(slot);
+		layout_ = Match::layout(config_);
+		history_.assign(net::HISTORY * layout_.hidden, 0);
+		decoded_.assign(layout_.hidden, 0);
+		welcomed_ = true;
+	}
+	else if (type == net::STATE && welcomed_)
+	{
+		std::uint64_t tick = r.varint();
+		std::uint64_t distance = r.varint();
+		r.svarint();
+		std::uint32_t applied = static_cast<std::uint32_t>(r.varint());
+		// Late arrivals are no use once something newer is in.
+		if (tick <= tick_ || distance > tick || distance >= net::HISTORY)
+			return;
+
+		if (distance)
+		{
+			const std::uint64_t *base = &history_[((tick - distance) % net::HISTORY) * layout_.hidden];
+			if (base[0] != tick - distance)
+				return;
+			decodeDelta(r, base, decoded_.data(), layout_.hidden);
+		}
+		else
+		{
+			std::fill(decoded_.begin(), decoded_.end(), 0);
+			decodeDelta(r, decoded_.data(), decoded_.data(), layout_.hidden);
+		}
+		if (decoded_[0] != tick)
+			throw std::runtime_error("State does not match its tick");
+		std::copy(decoded_.begin(), decoded_.end(), &history_[(tick % net::HISTORY) * layout_.hidden]);
+		tick_ = tick;
+		applied_seq_ = applied;
+		++states_;
+	}
+}
+
+std::unique_ptr<MatchClient> joinMatch(const std::string &address)
+{
+	auto client = std::make_unique<MatchClient>(address);
+	client->join(2000);
+	return client;
+}
+
+namespace {
+
+std::atomic<bool> serving {true};
+
+void stopServing(int)
+{
+	serving = false;
+}
+
+}
+
+// The match --server runs, from the options the game itself takes.
+MatchConfig matchConfig(const GameOptions &options)
+{
+	const double side = std::sqrt(static_cast<double>(std::max(options.world_scale, 1)));
+	MatchConfig c;
+	c.cols = static_cast<int>(GameDisplay::DEFAULT_WIDTH * side) / CellGrid::CELL_SIZE;
+	c.rows = static_cast<int>(GameDisplay::DEFAULT_HEIGHT * side) / CellGrid::CELL_SIZE;
+	c.food = options.food_count;
+	c.ghosts = options.ghost_count;
+	c.walls = options.walls;
+	c.players = std::max(options.players, 1);
+	c.sim_hz = options.sim_hz;
+	c.player_period = std::max(1, static_cast<int>(std::lround(options.sim_hz / options.player_speed)));
+	c.ghost_period = static_cast<int>(std::max((Ghost::MOVE_NS * options.sim_hz + 500'000'000) / 1'000'000'000, 1L));
+	c.respawn_ticks = 2 * options.sim_hz;
+	c.seed = static_cast<std::uint64_t>(std::time(nullptr));
+	return c;
+}
+
+// Serves one match until interrupted, or until --run-seconds is up.
+int runServer(const GameOptions &options)
+{
+	std::unique_ptr<MatchServer> owned;
+	try
+	{
+		owned = std::make_unique<MatchServer>(matchConfig(options), options.server_address);
+	}
+	catch (const std::runtime_error &e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	MatchServer &server = *owned;
+	std::signal(SIGINT, stopServing);
+	std::signal(SIGTERM, stopServing);
+	printf("Serving on %s\n", options.server_address.c_str());
+	std::fflush(stdout);
+	server.run(serving, options.run_seconds);
+	if (options.print_stats)
+		server.stats().print();
+	return 0;
+}
+
+// Rules for a MatchHost.  Every match has the same shape, so one block size
+// fits them all and each shard's blocks come out of one slab.
+struct MatchHostConfig {
+	MatchConfig match;
+	int matches = 1000;
+	unsigned shards = 0;          // worker threads; 0 = one per hardware thread
+	int match_ticks = 3600;       // how long a match lasts before its block goes to a new one
+	int chunk = 32;               // matches claimed at a time, by the owner or a thief
+	bool pin = true;              // pin shard i's thread to CPU i modulo the CPU count
+	std::uint64_t seed = 1;
+};
+
+// Hosts many small matches in one process, split into shards of one
+// worker thread each.  A shard's matches live in a slab of fixed-size
+// blocks with a free list: a finished match gives its block back and the
+// next one to start takes it, so nothing is allocated once running.
+//
+// Every shard ticks on the same clock.  A tick's matches are claimed a
+// chunk at a time off one atomic word holding the tick and the next chunk,
+// so a worker with nothing left of its own takes chunks from any shard
+// that is still on a tick that is due, and a shard that falls behind gets
+// help instead of missing more deadlines.  Players are driven by a bot
+// that holds a random direction and changes it every half second, as the
+// synthetic load.
+class MatchHost {
+public:
+	struct Stats {
+		long ticks = 0;               // shard ticks
+		long late_ticks = 0;          // finished after the next one was due
+		long match_steps = 0;
+		long matches_started = 0;
+		long chunks = 0;
+		long stolen_chunks = 0;       // run by a worker other than the owner
+		double busy_s = 0;            // stepping matches, across all workers
+		LatencyHistogram finish_ms;   // from each shard tick being due to its last match stepped
+
+		void add(const Stats &o);
+	};
+
+	explicit MatchHost(const MatchHostConfig &config);
+	~MatchHost();
+	MatchHost(const MatchHost &) = delete;
+	MatchHost &operator=(const MatchHost &) = delete;
+
+	// Runs every shard for seconds of ticks, then stops the workers.
+	void run(double seconds);
+	// Summed across shards; only meaningful once run() has returned.
+	Stats stats() const;
+	unsigned shards() const { return static_cast<unsigned>(shards_.size()); }
+	std::size_t blockBytes() const { return layout_.end * sizeof(std::uint64_t); }
+
+private:
+	struct Slot {
+		std::uint32_t block;          // index into the shard's slab
+		std::uint32_t id;
+		std::int64_t started;         // tick it began on
+	};
+	struct Shard {
+		std::vector<std::uint64_t> slab;
+		std::vector<std::uint32_t> free;
+		std::vector<Slot> live;
+		std::atomic<std::uint64_t> work {0};   // tick << 32 | next chunk
+		std::atomic<std::uint32_t> chunks {0};
+		std::atomic<std::uint32_t> done {0};
+		Stats stats;                  // ticks and lateness, written by the owner
+	};
+
+	MatchHostConfig config_;
+	Match::Layout layout_;
+	std::vector<std::unique_ptr<Shard>> shards_;
+	std::vector<Stats> worker_stats_;          // steps and chunks, per worker
+	std::uint32_t next_id_ = 0;
+	long start_ns_ = 0;
+	long period_ns_ = 0;
+	Time clock_;
+
+	void work(unsigned w, long end_ns);
+	void startMatch(Shard &shard, std::int64_t tick, CellGrid &scratch);
+	void churn(Shard &shard, std::int64_t tick, CellGrid &scratch);
+	bool claim(Shard &shard, std::uint64_t tick, std::uint32_t &chunk);
+	bool steal(unsigned w, CellGrid &scratch);
+	void runChunk(Shard &shard, std::uint64_t tick, std::uint32_t chunk, unsigned w, CellGrid &scratch);
+};
+
+void MatchHost::Stats::add(const Stats &o)
+{
+	ticks += o.ticks;
+	late_ticks += o.late_ticks;
+	match_steps += o.match_steps;
+	matches_started += o.matches_started;
+	chunks += o.chunks;
+	stolen_chunks += o.stolen_chunks;
+	busy_s += o.busy_s;
+}
+
+MatchHost::MatchHost(const MatchHostConfig &config)
+: config_(config), layout_(Match::layout(config_.match))
+{
+	config_.chunk = std::max(config_.chunk, 1);
+	config_.match_ticks = std::max(config_.match_ticks, 1);
+	unsigned n = config_.shards ? config_.shards : std::max(1u, std::thread::hardware_concurrency());
+	worker_stats_.resize(n);
+
+	// Matches are dealt round robin, and start at staggered ages so that
+	// about as many finish on every tick.
+	std::size_t per_shard = (static_cast<std::size_t>(std::max(config_.matches, 0)) + n - 1) / n;
+	CellGrid scratch;
+	for (unsigned s = 0; s < n; ++s)
+	{
+		auto shard = std::make_unique<Shard>();
+		shard->slab.assign(per_shard * layout_.end, 0);
+		for (std::size_t b = per_shard; b-- > 0;)
+			shard->free.push_back(static_cast<std::uint32_t>(b));
+		shards_.push_back(std::move(shard));
+	}
+	for (int i = 0; i < config_.matches; ++i)
+		startMatch(*shards_[i % n], -(i % config_.match_ticks), scratch);
+}
+
+MatchHost::~MatchHost() = default;
+
+void MatchHost::startMatch(Shard &shard, std::int64_t tick, CellGrid &scratch)
+{
+	std::uint32_t block = shard.free.back();
+	shard.free.pop_back();
+	std::uint32_t id = next_id_++;
+	Match m(config_.match, layout_, &shard.slab[block * layout_.end]);
+	m.reset(config_.seed ^ (0x9e3779b97f4a7c15ull * (id + 1)), scratch);
+	for (int p = 0; p < config_.match.players; ++p)
+		m.join();
+	shard.live.push_back({block, id, tick});
+	++shard.stats.matches_started;
+}
+
+// Between ticks, on the owner: finished matches give their blocks back and
+// new ones take them, keeping the count steady.
+void MatchHost::churn(Shard &shard, std::int64_t tick, CellGrid &scratch)
+{
+	for (std::size_t i = 0; i < shard.live.size();)
+	{
+		if (tick - shard.live[i].started < config_.match_ticks)
+		{
+			++i;
+			continue;
+		}
+		shard.free.push_back(shard.live[i].block);
+		shard.live[i] = shard.live.back();
+		shard.live.pop_back();
+		startMatch(shard, tick, scratch);
+	}
+}
+
+bool MatchHost::claim(Shard &shard, std::uint64_t tick, std::uint32_t &chunk)
+{
+	std::uint64_t w = shard.work.load();
+	for (;;)
+	{
+		if ((w >> 32) != tick || static_cast<std::uint32_t>(w) >= shard.chunks.load())
+			return false;
+		if (shard.work.compare_exchange_weak(w, w + 1))
+		{
+			chunk = static_cast<std::uint32_t>(w);
+			return true;
+		}
+	}
+}
+
+// Takes one chunk from whichever other shard has most left.  The owner
+// doesn't move on until every chunk it handed out is done, so the matches
+// a thief steps stay where they are meanwhile.
+bool MatchHost::steal(unsigned w, CellGrid &scratch)
+{
+	Shard *victim = nullptr;
+	std::uint64_t victim_tick = 0;
+	std::uint32_t most = 0;
+	for (unsigned s = 0; s < shards_.size(); ++s)
+	{
+		if (s == w)
+			continue;
+		std::uint64_t word = shards_[s]->work.load();
+		std::uint32_t chunks = shards_[s]->chunks.load();
+		std::uint32_t next = static_cast<std::uint32_t>(word);
+		if ((word >> 32) != 0 && next < chunks && chunks - next > most)
+		{
+			victim = shards_[s].get();
+			victim_tick = word >> 32;
+			most = chunks - next;
+		}
+	}
+
+	std::uint32_t chunk;
+	if (!victim || !claim(*victim, victim_tick, chunk))
+		return false;
+	runChunk(*victim, victim_tick, chunk, w, scratch);
+	++worker_stats_[w].stolen_chunks;
+	return true;
+}
+
+void MatchHost::runChunk(Shard &shard, std::uint64_t tick, std::uint32_t chunk, unsigned w, CellGrid &scratch)
+{
+	Time t;
+	const int players = config_.match.players;
+	std::size_t from = static_cast<std::size_t>(chunk) * config_.chunk;
+	std::size_t to = std::min(from + config_.chunk, shard.live.size());
+	for (std::size_t i = from; i < to; ++i)
+	{
+		const Slot &slot = shard.live[i];
+		Match m(config_.match, layout_, &shard.slab[slot.block * layout_.end]);
+		for (int p = 0; p < players; ++p)
+		{
+			Rng bot(config_.seed ^ (std::uint64_t(slot.id) << 20) ^ (std::uint64_t(p) << 52) ^ (tick / 30));
+			m.setInput(p, static_cast<std::uint8_t>(bot.uniform(ACTION_COUNT)), static_cast<std::uint32_t>(tick));
+		}
+		m.step(scratch);
+	}
+
+	Stats &s = worker_stats_[w];
+	s.match_steps += static_cast<long>(to - from);
+	++s.chunks;
+	s.busy_s += t.time() / 1e9;
+	shard.done.fetch_add(1, std::memory_order_release);
+}
+
+// Shard w's worker.  Tick k is due at k - 1 periods after the start; a
+// shard that is behind runs its ticks back to back until it catches up.
+// While waiting for its next tick a worker helps the others.
+void MatchHost::work(unsigned w, long end_ns)
+{
+	if (config_.pin)
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(w % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+
+	Shard &me = *shards_[w];
+	CellGrid scratch;
+	for (std::uint64_t tick = 1;; ++tick)
+	{
+		long due_ns = start_ns_ + static_cast<long>(tick - 1) * period_ns_;
+		if (due_ns >= end_ns)
+			break;
+		// Ticks still owed when time is up count as missed.
+		if (clock_.time() >= end_ns)
+		{
+			long owed = (end_ns - due_ns + period_ns_ - 1) / period_ns_;
+			me.stats.ticks += owed;
+			me.stats.late_ticks += owed;
+			break;
+		}
+		while (clock_.time() < due_ns)
+		{
+			if (!steal(w, scratch))
+				std::this_thread::sleep_for(std::chrono::microseconds(
+					std::min(200L, std::max(1L, (due_ns - clock_.time()) / 1000))));
+		}
+
+		churn(me, static_cast<std::int64_t>(tick), scratch);
+		// Closed while the count changes: a thief still holding last tick's
+		// word must not be able to claim against this tick's count.  These
+		// two are sequentially consistent for that.
+		std::uint32_t chunks = static_cast<std::uint32_t>((me.live.size() + config_.chunk - 1) / config_.chunk);
+		me.work.store(0);
+		me.done.store(0, std::memory_order_relaxed);
+		me.chunks.store(chunks);
+		me.work.store(tick << 32);
+
+		std::uint32_t chunk;
+		while (claim(me, tick, chunk))
+			runChunk(me, tick, chunk, w, scratch);
+		while (me.done.load(std::memory_order_acquire) < chunks)
+		{
+			if (!steal(w, scratch))
+				std::this_thread::yield();
+		}
+
+		long finish_ns = clock_.time();
+		++me.stats.ticks;
+		me.stats.late_ticks += finish_ns > due_ns + period_ns_;
+		me.stats.finish_ms.add((finish_ns - due_ns) / 1e6);
+	}
+	// Nothing left to steal here.
+	me.work.store(0);
+}
+
+void MatchHost::run(double seconds)
+{
+	period_ns_ = 1'000'000'000L / std::max(config_.match.sim_hz, 1);
+	start_ns_ = clock_.time();
+	long end_ns = start_ns_ + static_cast<long>(seconds * 1e9);
+
+	std::vector<std::thread> workers;
+	for (unsigned w = 0; w < shards_.size(); ++w)
+		workers.emplace_back([this, w, end_ns] { work(w, end_ns); });
+	for (std::thread &t: workers)
+		t.join();
+}
+
+MatchHost::Stats MatchHost::stats() const
+{
+	Stats total;
+	for (const auto &shard: shards_)
+	{
+		total.add(shard->stats);
+		total.finish_ms.merge(shard->stats.finish_ms);
+	}
+	for (const Stats &w: worker_stats_)
+		total.add(w);
+	return total;
+}
+
+class Game {
+public:
+	Game(const GameOptions &options);
+	// Plays on a display made by the caller, such as a scripted SoftwareDisplay.
+	Game(const GameOptions &options, std::unique_ptr<GameDisplay> display);
+
+	// Returns the process exit status.
+	int run();
+
+	const FrameStats &stats() const { return stats_; }
+	const TaskGraph &tickGraph() const { return tick_graph_; }
+
+	// Copies the simulation state out, or puts a copy back.  A restored
+	// game carries on exactly as the one it was taken from did, given the
+	// same input, through restarts too: the next level is regenerated if
+	// it came from a different seed.
+	void snapshot(SimState &out) const;
+	void restore(const SimState &in);
+
+	// Runs up to n ticks now, with no input and nothing drawn, stopping
+	// early if the game ends.  Returns the number run.
+	int advance(int n);
+
+private:
+	std::unique_ptr<GameDisplay> gamedisplay_;
+	XEvent event_;
+	std::atomic<bool> is_running_ {true};
+    bool game_over = false;
+    bool game_won = false;
+	Player player_;
+	bool use_food_grid_;
+	GameOptions options_;
+	std::unique_ptr<MatchClient> net_;   // with --connect, where the game is really played
+	const long tick_ns_;             // one simulation step
+	const long ghost_period_ticks_;  // ticks between ghost moves
+	std::uint64_t tick_ = 0;         // ticks run so far
+	std::unique_ptr<SnapshotRing> rewind_;
+	Rng level_rng_;
+	std::unique_ptr<Level> level_;
+	std::future<std::unique_ptr<Level>> next_level_;
+	std::uint64_t next_level_seed_ = 0;
+	long restart_ns_ = -1;           // when the restart not yet shown began
+	bool focused_ = true;
+	bool visible_ = true;
+	bool idle_ = false;
+	FrameStats stats_;
+	Time clock_;
+	KeyBindings bindings_;
+	KeyState keys_;
+	double move_progress_ = 0;     // fraction of a cell the player has built up
+	Point tap_ {0, 0};             // direction pressed and released within a tick
+	InputStamp pending_press_;     // direction press not yet reflected in a move
+	InputStamp frame_input_;       // first input shown by the frame being built
+	long min_server_offset_ns_ = -1;
+	long last_step_ns_ = -1;
+	long next_synthetic_ns_ = 0;
+	int synthetic_sent_ = 0;
+	ProtocolStats frame_start_;
+	int exit_status_ = 0;
+	long last_tick_ns_ = 0;          // when the latest tick was due
+	long moving_until_ns_ = 0;       // when the latest move has been fully interpolated
+	std::vector<Point> eaten_cells_; // food eaten since the last snapshot, world pixels
+	std::uint64_t level_id_ = 0;
+	std::uint64_t food_version_ = 0;
+	TripleBuffer<RenderSnapshot> snapshots_;
+	EventInbox inbox_;               // display events, when the render thread reads them
+	int wake_pipe_[2] = {-1, -1};    // wakes the render thread
+	std::atomic<int> view_width_ {GameDisplay::DEFAULT_WIDTH};
+	std::atomic<int> view_height_ {GameDisplay::DEFAULT_HEIGHT};
+	std::unique_ptr<JobPool> jobs_;  // with --jobs; the graphs run serially without it
+	TaskGraph tick_graph_ {"tick"};
+	bool ghosts_moved_ = false;      // results passed between tick tasks
+	bool player_moved_ = false;
+	std::vector<std::uint32_t> moved_ghosts_;   // ghosts whose position changed this tick
+	bool moved_outside_tick_ = false;           // a legacy input move not yet collision-tested
+	double ate_all_at_ = -1;         // how far into the tick the last food / a ghost was touched
+	double hit_at_ = -1;
+	std::vector<std::uint32_t> nearby_moved_;
+	std::vector<std::pair<std::size_t, double>> food_touched_;
+	bool render_pending_ = false;    // a published snapshot waiting to be drawn alongside the next tick
+	long render_at_ns_ = 0;          // the time that snapshot is drawn for
+	Match::Player predicted_ {};     // client mode: our player, with the inputs the server hasn't applied
+	std::deque<std::pair<std::uint32_t, std::uint8_t>> unacked_;   // those inputs: seq, action
+	std::uint32_t predicted_tick_ = 0;   // the server tick the next input should land on
+	std::uint32_t net_level_ = 0;
+	std::vector<Mover> others_;      // the other players, by slot; off the level when not playing
+	std::unique_ptr<Bot> bot_;       // with --bot, pressing the keys
+	Action bot_key_ = Action::NONE;  // the direction it holds
+	long bot_tick_ = -1;             // the tick it last planned for, counted as in stats_
+	long game_start_tick_ = 0;
+
+	// Only touched by whichever thread renders.
+	TaskGraph render_graph_ {"render"};
+	const RenderSnapshot *render_snap_ = nullptr;
+	bool render_fresh_ = false;
+	long render_start_ns_ = 0;
+	bool layer_rebuild_ = false;
+	std::vector<Point> wall_list_;   // screen positions, culled to the window
+	std::vector<Point> food_list_;
+	std::vector<Point> ghost_list_;
+	std::vector<Point> other_list_;
+	TextBatch text_;
+	double last_render_ms_ = 0;      // draw and flush time of the last frame, for the HUD
+	int alpha_ = 1 << 16;            // how far between ticks this frame is drawn, 16.16
+	Point camera_ {0, 0};            // world position of the window's top-left corner
+	Point layer_camera_ {-1, -1};    // camera the static layer was drawn for
+	std::uint64_t layer_level_ = ~0ull;
+	std::uint64_t layer_food_version_ = 0;
+	Size view_ {0, 0};
+
+
+	void simulate();
+	void runThreaded();
+	void renderLoop();
+	void waitForRenderWork(long timeout_ns);
+	void wakeRenderer();
+	bool nextEvent(XEvent &ev, long timeout_ns);
+	bool queuedEvent(XEvent &ev);
+	bool peekQueuedEvent(XEvent &ev);
+	void present();
+	void presentPending();
+	void publishSnapshot();
+	void buildTickGraph();
+	void buildRenderGraph();
+	void writeTaskGraphs() const;
+	void collectEvents(InputBatch &batch, long timeout_ns);
+	bool tick();
+	bool netTick();
+	bool applyServerState();
+	void joinLevel();
+	bool stepPlayer();
+	void recordStep();
+	void stampInput(InputStamp &stamp);
+	void recordPresent(const InputStamp &input);
+	void checkFrameProtocol();
+	void driveSyntheticInput();
+	void driveBot(InputBatch &batch);
+	bool waitEvent(long timeout_ns);
+	void updateIdleState();
+    bool moveGhosts();
+	void handleEvent(InputBatch &batch);
+	bool applyInput(const InputBatch &batch);
+	void render();
+	void renderSnapshot(const RenderSnapshot &snap, bool fresh, long at_ns);
+	void prepareFrame();
+	void submitFrame();
+    void resetGame();
+	bool isPlayerWithinBounds();
+	void drawStaticLayer(const RenderSnapshot &snap);
+	void createLevel(Level &level) const;
+	void createWalls(Level &level, int cols, int rows) const;
+	void createFood(Level &level, const std::vector<Point> &spawns) const;
+	void createGhosts(Level &level, const std::vector<Point> &spawns) const;
+	void pregenerateLevel();
+	void generateLevel(std::uint64_t seed);
+	void load(const std::string &path);
+	void resume(const SimState::Header &h);
+	bool isWall(const Point &p) const;
+	bool movePlayer(int dx, int dy);
+	void layoutText(const RenderSnapshot &snap);
+	double playerContact(Point from, Point to) const;
+	double eatFood();
+	double hitGhost();
+	void resolveTick();
+	void cullCells(const std::vector<Point> &cells, std::vector<Point> &out) const;
+	void listGhosts(const RenderSnapshot &snap);
+	void drawCells(int sprite, unsigned long color, const std::vector<Point> &cells);
+	Point drawPosition(const Mover &m) const;
+	void updateCamera(const RenderSnapshot &snap);
+	bool onScreen(const Point &at) const;
+	void snapshotPositions();
+};
+
+Game::Game(const GameOptions &options)
+: Game(options, createDisplay(options.display_backend))
+{
+}
+
+Game::Game(const GameOptions &options, std::unique_ptr<GameDisplay> display)
+: gamedisplay_(std::move(display)),
+  use_food_grid_(options.use_food_grid), options_(options),
+  net_(options.connect_address.empty() ? nullptr : joinMatch(options.connect_address)),
+  tick_ns_(1'000'000'000L / std::clamp(net_ ? net_->config().sim_hz : options.sim_hz, 1, 1000)),
+  ghost_period_ticks_(std::max((Ghost::MOVE_NS + tick_ns_ / 2) / tick_ns_, 1L)), level_rng_(std::time(nullptr))
+{
+	if (net_)
+		options_.sim_hz = net_->config().sim_hz;
+	// Above 60 Hz, drawing on every tick that moves something would be
+	// wasted, so frames are paced and interpolated instead.
+	if (options_.sim_hz > 60 && options_.render_hz == 0)
+		options_.render_hz = 60;
+
+	bindings_.build(*gamedisplay_);
+	if (options.sprites)
+		gamedisplay_->loadSprites(options.atlas_path.empty() ? SpriteAtlas::makeDefault()
+		                                                     : SpriteAtlas::load(options.atlas_path));
+	level_ = std::make_unique<Level>();
+	level_->rng = Rng(level_rng_.next());
+	if (net_)
+	{
+		joinLevel();
+	}
+	else if (!options.load_path.empty())
+	{
+		// The saved game brings its own level and next level's seed, so
+		// there is nothing to generate first.
+		load(options.load_path);
+	}
+	else
+	{
+		createLevel(*level_);
+		pregenerateLevel();
+	}
+
+	if (options.jobs > 0)
+		jobs_ = std::make_unique<JobPool>(options.jobs);
+	if (options.rewind_ticks > 0 && !net_)
+		rewind_ = std::make_unique<SnapshotRing>(options.rewind_ticks);
+	if (!options.bot.empty())
+		bot_ = std::make_unique<Bot>(Bot::parse(options.bot), options_.ghost_step + 1);
+	buildTickGraph();
+	buildRenderGraph();
+}
+
+// Every tick is the same graph.  Ghost AI and the player's step don't touch
+// each other's state, and neither do the food and ghost collision checks
+// that follow them; only the last task writes the game-over flags.  Only
+// what moved this tick is collision-tested.
+void Game::buildTickGraph()
+{
+	using Id = TaskGraph::TaskId;
+
+	Id snapshot = tick_graph_.add("snapshot", [this] { snapshotPositions(); });
+	Id ai = tick_graph_.add("ghost ai", [this] { ghosts_moved_ = moveGhosts(); }, {snapshot});
+	Id player = tick_graph_.add("player", [this] {
+		player_moved_ = !game_over && ((!options_.legacy_input && stepPlayer()) || moved_outside_tick_);
+		moved_outside_tick_ = false;
+	}, {snapshot});
+	Id food = tick_graph_.add("food collision", [this] {
+		ate_all_at_ = player_moved_ && !game_over ? eatFood() : -1;
+	}, {player});
+	Id ghosts = tick_graph_.add("ghost collision", [this] { hit_at_ = !game_over ? hitGhost() : -1; }, {ai, player});
+	tick_graph_.add("resolve", [this] { resolveTick(); }, {food, ghosts});
+}
+
+// Culling and text layout for one frame are independent of each other;
+// only the last task talks to the display.
+void Game::buildRenderGraph()
+{
+	using Id = TaskGraph::TaskId;
+
+	Id camera = render_graph_.add("camera", [this] { prepareFrame(); });
+	Id walls = render_graph_.add("wall list", [this] {
+		if (layer_rebuild_)
+			cullCells(render_snap_->walls, wall_list_);
+	}, {camera});
+	Id food = render_graph_.add("food list", [this] {
+		if (layer_rebuild_)
+			cullCells(render_snap_->food, food_list_);
+	}, {camera});
+	Id ghosts = render_graph_.add("ghost list", [this] { listGhosts(*render_snap_); }, {camera});
+	Id text = render_graph_.add("hud layout", [this] { layoutText(*render_snap_); });
+	render_graph_.add("submit", [this] { submitFrame(); }, {walls, food, ghosts, text});
+}
+
+// Both graphs as one Graphviz file, with the mean times of this run.
+void Game::writeTaskGraphs() const
+{
+	FILE *f = std::fopen(options_.task_dot_path.c_str(), "w");
+	if (!f)
+		throw std::runtime_error("Unable to write " + options_.task_dot_path);
+	std::fprintf(f, "digraph frame {\n  node [shape=box];\n");
+	tick_graph_.writeDot(f);
+	render_graph_.writeDot(f);
+	std::fprintf(f, "}\n");
+	std::fclose(f);
+}
+
+// Starts building the next level on a worker thread while this one is played.
+void Game::pregenerateLevel()
+{
+	generateLevel(level_rng_.next());
+}
+
+void Game::generateLevel(std::uint64_t seed)
+{
+	next_level_seed_ = seed;
+	next_level_ = std::async(std::launch::async, [this, seed]() {
+		auto level = std::make_unique<Level>();
+		level->rng = Rng(seed);
+		createLevel(*level);
+		return level;
+	});
+}
+
+// Simulates on this thread, and renders here too unless --threaded moved
+// rendering to the main thread.
+int Game::run()
+{
+	if (options_.threaded)
+		runThreaded();
+	else
+		simulate();
+
+	if (options_.print_stats)
+	{
+		stats_.dump();
+		if (jobs_)
+		{
+			tick_graph_.printStats();
+			render_graph_.printStats();
+		}
+	}
+	if (!options_.task_dot_path.empty())
+		writeTaskGraphs();
+	if (bot_ && options_.print_stats)
+	{
+		const Bot::Stats &b = bot_->stats();
+		printf("Bot (%s): %ld games, %ld won, %.0f ticks a game, plan %.1f us (sd %.1f, max %.1f)\n",
+		       bot_->name(), b.games, b.wins, b.game_ticks.mean, b.plan_us.mean, b.plan_us.stddev(), b.max_plan_us);
+	}
+	if (net_ && options_.print_stats)
+		printf("Server states: %ld, %ld bytes, slot %d\n", net_->states(), net_->bytesIn(), net_->slot());
+	if (!options_.save_path.empty() && !net_)
+	{
+		SimState state;
+		snapshot(state);
+		SaveFile::write(state, options_.save_path);
+		printf("Saved tick %llu to %s\n", static_cast<unsigned long long>(state.header().tick), options_.save_path.c_str());
+	}
+	return exit_status_;
+}
+
+// One frame: drain the event queue, run however many fixed simulation ticks
+// are due, then present at most once.  Between frames the loop sleeps until
+// either an event arrives or the next tick is due.
+void Game::simulate()
+{
+	InputBatch batch;
+	long next_tick_ns = clock_.time();
+	const long end_ns = static_cast<long>(options_.run_seconds * 1e9);
+	// Interpolated frames are timed here only if this thread also draws.
+	const long frame_ns = options_.render_hz > 0 && !options_.threaded ? 1'000'000'000L / options_.render_hz : 0;
+	long next_frame_ns = next_tick_ns;
+	long shown_ns = 0;              // when the last interpolated frame was drawn
+
+	while (is_running_)
+	{
+        if (options_.synthetic_inputs > 0)
+            driveSyntheticInput();
+        if (end_ns > 0 && clock_.time() >= end_ns)
+            is_running_ = false;
+
+        updateIdleState();
+
+        if (!options_.threaded)
+            frame_start_ = gamedisplay_->protocolTotals();
+        batch = InputBatch();
+        if (bot_)
+            driveBot(batch);
+        // While anything is between cells, wake for frames as well as ticks.
+        bool animating = frame_ns > 0 && shown_ns < moving_until_ns_ && !idle_;
+        long wake_ns = animating ? std::min(next_tick_ns, next_frame_ns) : next_tick_ns;
+        if (end_ns > 0)
+            wake_ns = std::min(wake_ns, end_ns);
+        // Idle, only the end of a timed run is worth waking for.
+        if (idle_)
+            wake_ns = end_ns > 0 ? end_ns : -1;
+        collectEvents(batch, wake_ns < 0 ? -1 : std::max(0L, wake_ns - clock_.time()));
+
+        bool changed = applyInput(batch);
+
+        if (idle_)
+        {
+            // Don't try to catch up on the ticks missed while idle.
+            next_tick_ns = clock_.time();
+        }
+        else
+        {
+            while (clock_.time() >= next_tick_ns)
+            {
+                stats_.tick_lateness.add((clock_.time() - next_tick_ns) / 1e6);
+                bool moved = tick();
+                if (moved)
+                    moving_until_ns_ = next_tick_ns + tick_ns_;
+                // Interpolated frames pick up movement on their own clock.
+                if (frame_ns == 0 && moved)
+                    changed = true;
+                next_tick_ns += tick_ns_;
+            }
+        }
+        last_tick_ns_ = next_tick_ns - tick_ns_;
+        // Nothing was due to overlap the last frame with.
+        if (render_pending_)
+            presentPending();
+
+        // Keep drawing until a frame has been shown after the last move
+        // was complete.
+        if (animating && clock_.time() >= next_frame_ns)
+        {
+            changed = true;
+            shown_ns = clock_.time();
+            next_frame_ns = std::max(next_frame_ns + frame_ns, shown_ns);
+        }
+
+        ++stats_.frames;
+        if (changed || batch.expose)
+            present();
+        // An idle loop won't tick again soon.
+        if (render_pending_ && idle_)
+            presentPending();
+	}
+}
+
+// The main thread keeps the display: it reads events and passes them on,
+// and draws whatever snapshot is newest.  The simulation runs on its own
+// thread, so a slow flush or a stalled server never delays a tick.
+void Game::runThreaded()
+{
+	if (pipe2(wake_pipe_, O_NONBLOCK | O_CLOEXEC) != 0)
+		throw std::runtime_error("Unable to create the render wake-up pipe");
+
+	publishSnapshot();
+
+	std::exception_ptr failure;
+	std::thread sim([&] {
+		try
+		{
+			simulate();
+		}
+		catch (...)
+		{
+			failure = std::current_exception();
+			is_running_ = false;
+		}
+		wakeRenderer();
+	});
+
+	renderLoop();
+	inbox_.close();
+	sim.join();
+
+	close(wake_pipe_[0]);
+	close(wake_pipe_[1]);
+	if (failure)
+		std::rethrow_exception(failure);
+}
+
+void Game::renderLoop()
+{
+	const long frame_ns = options_.render_hz > 0 ? 1'000'000'000L / options_.render_hz : 0;
+	long next_frame_ns = 0;
+	long shown_ns = 0;
+
+	while (is_running_)
+	{
+		frame_start_ = gamedisplay_->protocolTotals();
+
+		bool expose = false;
+		XEvent ev;
+		while (gamedisplay_->waitEvent(ev, 0))
+		{
+			expose = expose || ev.type == Expose;
+			inbox_.push(ev);
+		}
+
+		bool fresh = snapshots_.acquire();
+		const RenderSnapshot &snap = snapshots_.readBuffer();
+		long now = clock_.time();
+		bool animating = frame_ns > 0 && shown_ns < snap.moving_until_ns;
+		bool animate = animating && now >= next_frame_ns;
+		if (fresh || expose || animate)
+		{
+			renderSnapshot(snap, fresh, now);
+			shown_ns = now;
+			if (animate)
+				next_frame_ns = std::max(next_frame_ns + frame_ns, now);
+		}
+
+		animating = frame_ns > 0 && shown_ns < snap.moving_until_ns;
+		waitForRenderWork(animating ? std::max(0L, next_frame_ns - clock_.time()) : -1);
+	}
+}
+
+// Sleeps until the display has input, the simulation has published
+// something, or timeout_ns passes (never, if negative).
+void Game::waitForRenderWork(long timeout_ns)
+{
+	XEvent ev;
+	if (gamedisplay_->peekQueuedEvent(ev))
+		return;
+
+	pollfd fds[2] = {{wake_pipe_[0], POLLIN, 0}, {gamedisplay_->connectionFd(), POLLIN, 0}};
+	int n = fds[1].fd >= 0 ? 2 : 1;
+	poll(fds, n, timeout_ns < 0 ? -1 : static_cast<int>((timeout_ns + 999'999) / 1'000'000));
+
+	char drain[64];
+	while (read(wake_pipe_[0], drain, sizeof(drain)) > 0)
+		;
+}
+
+void Game::wakeRenderer()
+{
+	if (wake_pipe_[1] >= 0)
+	{
+		char c = 0;
+		[[maybe_unused]] ssize_t n = write(wake_pipe_[1], &c, 1);
+	}
+}
+
+// Hands the current state to whichever thread draws.  With a job pool and
+// no render thread, drawing is put off to run alongside the next tick: the
+// frame shows up to one tick later, but its culling and submission overlap
+// the next tick's AI instead of adding to it.
+void Game::present()
+{
+	if (options_.threaded)
+	{
+		publishSnapshot();
+		wakeRenderer();
+	}
+	else if (jobs_)
+	{
+		publishSnapshot();
+		render_pending_ = true;
+		render_at_ns_ = clock_.time();
+	}
+	else
+	{
+		render();
+	}
+}
+
+void Game::presentPending()
+{
+	render_pending_ = false;
+	snapshots_.acquire();
+	renderSnapshot(snapshots_.readBuffer(), true, render_at_ns_);
+}
+
+// Event sources for the simulation: the display itself, or the queue the
+// render thread fills.
+bool Game::nextEvent(XEvent &ev, long timeout_ns)
+{
+	return options_.threaded ? inbox_.wait(ev, timeout_ns) : gamedisplay_->waitEvent(ev, timeout_ns);
+}
+
+bool Game::queuedEvent(XEvent &ev)
+{
+	return options_.threaded ? inbox_.pop(ev) : gamedisplay_->queuedEvent(ev);
+}
+
+bool Game::peekQueuedEvent(XEvent &ev)
+{
+	return options_.threaded ? inbox_.peek(ev) : gamedisplay_->peekQueuedEvent(ev);
+}
+
+// One fixed simulation step: ghosts, held-key movement, then collision.
+bool Game::tick()
+{
+	++stats_.ticks;
+	if (net_)
+		return netTick();
+	if (rewind_)
+		snapshot(rewind_->push());
+	++tick_;
+
+	if (render_pending_)
+	{
+		render_pending_ = false;
+		snapshots_.acquire();
+		render_snap_ = &snapshots_.readBuffer();
+		render_fresh_ = true;
+		jobs_->run({&render_graph_, &tick_graph_});
+	}
+	else
+	{
+		tick_graph_.run(jobs_.get());
+	}
+
+	return ghosts_moved_ || player_moved_;
+}
+
+// The last tick task: applies what the collision checks found.
+void Game::resolveTick()
+{
+	if (!(ghosts_moved_ || player_moved_) || game_over)
+		return;
+
+	// Whichever came first in the tick decides it; a tie goes to the ghost.
+	if (hit_at_ >= 0 && (ate_all_at_ < 0 || hit_at_ <= ate_all_at_))
+	{
+		game_over = true;
+		game_won = false;
+		std::cout << "YOU LOSE!!\n";
+	}
+	else if (ate_all_at_ >= 0)
+	{
+		game_over = true;
+		game_won = true;
+	}
+	if (!game_over && !isPlayerWithinBounds())
+	{
+		printf("PLAYER OUT OF BOUNDS -- GAME OVER!! -- YOU LOSE!!\n");
+		game_over = true;
+		game_won = false;
+	}
+}
+
+// Samples the held keys and moves the player at --player-speed.  A fresh press
+// moves one cell on the next tick, so a quick tap still counts.
+bool Game::stepPlayer()
+{
+	auto held = [&](Action a) { return keys_.held(bindings_.keycode(a)) ? 1 : 0; };
+	int dx = held(Action::RIGHT) - held(Action::LEFT);
+	int dy = held(Action::DOWN) - held(Action::UP);
+
+	if (dx == 0 && dy == 0)
+	{
+		dx = tap_.x;
+		dy = tap_.y;
+	}
+	tap_ = {0, 0};
+
+	if (dx == 0 && dy == 0)
+	{
+		move_progress_ = 0;
+		last_step_ns_ = -1;
+		return false;
+	}
+
+	move_progress_ += options_.player_speed * tick_ns_ / 1e9;
+	int steps = static_cast<int>(move_progress_);
+	if (steps == 0)
+		return false;
+	move_progress_ -= steps;
+
+	const int C = CellGrid::CELL_SIZE;
+	if (!movePlayer(dx * steps * C, dy * steps * C))
+		return false;
+
+	recordStep();
+	return true;
+}
+
+void Game::recordStep()
+{
+	long now = clock_.time();
+	if (pending_press_.valid())
+	{
+		stats_.input_latency_ms.add((now - pending_press_.receive_ns) / 1e6);
+		if (!frame_input_.valid())
+			frame_input_ = pending_press_;
+		pending_press_ = InputStamp();
+	}
+	else if (last_step_ns_ >= 0)
+	{
+		stats_.step_interval_ms.add((now - last_step_ns_) / 1e6);
+	}
+	last_step_ns_ = now;
+}
+
+// Client mode: the level is the server's.  It starts out empty and is
+// filled in by the first state to arrive.
+void Game::joinLevel()
+{
+	const int C = CellGrid::CELL_SIZE;
+	const MatchConfig &c = net_->config();
+	use_food_grid_ = true;
+	level_->walls.reset(c.cols, c.rows);
+	level_->food_grid.reset(c.cols, c.rows);
+	level_->ghosts.assign(c.ghosts, Ghost());
+	for (Ghost &g: level_->ghosts)
+		g.position = g.previous = {-C, -C};
+	level_->ghost_index.reset(c.cols, c.rows);
+	level_->ghost_index_stale = true;
+	others_.assign(c.players, Mover {{-C, -C}, {-C, -C}});
+	player_.position = player_.previous = PLAYER_SPAWN;
+}
+
+// Client mode's tick: sends the direction held as this tick's input and
+// moves our player by it straight away, then takes in whatever the server
+// has sent.  A new state puts our player where the server says, with the
+// inputs it hadn't applied yet played again on top, so a correction only
+// shows when the prediction was wrong.
+bool Game::netTick()
+{
+	const int C = CellGrid::CELL_SIZE;
+	const MatchConfig &c = net_->config();
+	snapshotPositions();
+	for (Mover &m: others_)
+		m.previous = m.position;
+
+	auto held = [&](Action a) { return keys_.held(bindings_.keycode(a)) ? 1 : 0; };
+	int dx = held(Action::RIGHT) - held(Action::LEFT);
+	int dy = held(Action::DOWN) - held(Action::UP);
+	if (dx == 0 && dy == 0)
+	{
+		dx = tap_.x;
+		dy = tap_.y;
+	}
+	tap_ = {0, 0};
+	// The match moves along one axis at a time; horizontal wins.
+	std::uint8_t action = dx < 0 ? ACTION_LEFT : dx > 0 ? ACTION_RIGHT
+	                      : dy < 0 ? ACTION_UP : dy > 0 ? ACTION_DOWN : ACTION_NONE;
+
+	net_->sendInput(action);
+	unacked_.emplace_back(net_->lastSeq(), action);
+	if (unacked_.size() > static_cast<std::size_t>(net::HISTORY))
+		unacked_.pop_front();
+
+	bool moved = false;
+	if (net_->receive())
+	{
+		moved = applyServerState();
+	}
+	else
+	{
+		predicted_.input = action;
+		Match::movePlayer(predicted_, predicted_tick_++, c.player_period, level_->walls.words(),
+		                  net_->layout().words_per_row, c.cols, c.rows);
+	}
+
+	if (predicted_.state == Match::PLAYING
+	    && (predicted_.x * C != player_.position.x || predicted_.y * C != player_.position.y))
+	{
+		player_.position = {predicted_.x * C, predicted_.y * C};
+		recordStep();
+		moved = true;
+	}
+	return moved;
+}
+
+// Brings the level up to the newest state.  Returns true if anything moved.
+bool Game::applyServerState()
+{
+	const int C = CellGrid::CELL_SIZE;
+	const MatchConfig &c = net_->config();
+	const Match::Layout &l = net_->layout();
+	Match m = net_->latest();
+	Level &level = *level_;
+	bool moved = false;
+
+	bool new_level = m.header().level != net_level_;
+	if (new_level)
+	{
+		net_level_ = m.header().level;
+		level.walls.assign(c.cols, c.rows, m.walls());
+		level.food_grid.assign(c.cols, c.rows, m.food());
+		eaten_cells_.clear();
+		++level_id_;
+		moved = true;
+	}
+	else
+	{
+		// Food gone since the last state, for the renderer to erase.
+		const std::uint64_t *now = m.food();
+		const std::uint64_t *had = level.food_grid.words();
+		std::size_t eaten = eaten_cells_.size();
+		for (std::size_t i = 0; i < l.hidden - l.food; ++i)
+		{
+			for (std::uint64_t gone = had[i] & ~now[i]; gone; gone &= gone - 1)
+			{
+				int cx = static_cast<int>(i % l.words_per_row) * 64 + __builtin_ctzll(gone);
+				int cy = static_cast<int>(i / l.words_per_row);
+				eaten_cells_.push_back({cx * C, cy * C});
+			}
+		}
+		if (eaten_cells_.size() != eaten)
+			level.food_grid.assign(c.cols, c.rows, now);
+	}
+
+	// Nothing slides across the level to where a new one put it.
+	auto place = [&](Point &previous, Point &position, Point at) {
+		if (at.x == position.x && at.y == position.y)
+			return;
+		if (new_level || position.x < 0 || at.x < 0)
+			previous = at;
+		position = at;
+		moved = true;
+	};
+	for (int g = 0; g < c.ghosts; ++g)
+	{
+		Ghost &ghost = level.ghosts[g];
+		place(ghost.previous, ghost.position, {m.ghost(g).x * C, m.ghost(g).y * C});
+	}
+	level.ghost_index_stale = true;
+	for (int i = 0; i < c.players; ++i)
+	{
+		const Match::Player &p = m.player(i);
+		bool shown = i != net_->slot() && p.state == Match::PLAYING;
+		place(others_[i].previous, others_[i].position, shown ? Point {p.x * C, p.y * C} : Point {-C, -C});
+	}
+
+	if (net_->slot() >= 0)
+	{
+		// The server applies one queued input a tick, so the k'th still to
+		// come should land k ticks after the state's.
+		predicted_ = m.player(net_->slot());
+		predicted_tick_ = static_cast<std::uint32_t>(m.header().tick);
+		while (!unacked_.empty() && unacked_.front().first <= net_->appliedSeq())
+			unacked_.pop_front();
+		for (const auto &input: unacked_)
+		{
+			predicted_.input = input.second;
+			Match::movePlayer(predicted_, predicted_tick_++, c.player_period, m.walls(), l.words_per_row,
+			                  c.cols, c.rows);
+		}
+		if (new_level)
+			player_.previous = {predicted_.x * C, predicted_.y * C};
+	}
+	return moved;
+}
+
+// Nothing moves while the game is over, the window is hidden or it has lost
+// the keyboard.  Ghost timers count ticks, so they stop along with the ticks.
+void Game::updateIdleState()
+{
+	// A client keeps ticking regardless, or the server would stop hearing
+	// from it; and a bot plays on whether or not anyone is watching.
+	idle_ = !net_ && !bot_ && (game_over || !focused_ || !visible_);
+}
+
+// Blocks until the next event arrives, or timeout_ns pass if that is not
+// -1, keeping the process off the CPU.
+bool Game::waitEvent(long timeout_ns)
+{
+	Time wall;
+	std::clock_t cpu = std::clock();
+
+	bool got = nextEvent(event_, timeout_ns);
+
+	stats_.idle_wall_s += wall.time() / 1e9;
+	stats_.idle_cpu_s += static_cast<double>(std::clock() - cpu) / CLOCKS_PER_SEC;
+	return got;
+}
+
+// Takes every event that is already queued, not just one per frame.  When
+// idle the wait is counted in the idle stats; either way the loop waits at
+// most timeout_ns (-1 for no limit) for one to arrive.
+void Game::collectEvents(InputBatch &batch, long timeout_ns)
+{
+	if (idle_ ? !waitEvent(timeout_ns) : !nextEvent(event_, timeout_ns))
+		return;
+
+	handleEvent(batch);
+	while (queuedEvent(event_))
+		handleEvent(batch);
+}
+
+// Single-threaded: snapshot and draw straight away.
+void Game::render()
+{
+	publishSnapshot();
+	snapshots_.acquire();
+	renderSnapshot(snapshots_.readBuffer(), true, clock_.time());
+}
+
+// Draws snap as it should look at at_ns.  Only a separate render thread
+// gets here without the simulation waiting, so that one doesn't use the
+// pool: the render thread already overlaps the ticks.
+void Game::renderSnapshot(const RenderSnapshot &snap, bool fresh, long at_ns)
+{
+	render_snap_ = &snap;
+	render_fresh_ = fresh;
+	render_at_ns_ = at_ns;
+	render_graph_.run(options_.threaded ? nullptr : jobs_.get());
+}
+
+// First render task: where the camera is and whether the static layer has
+// to be redrawn.
+void Game::prepareFrame()
+{
+	const RenderSnapshot &snap = *render_snap_;
+	render_start_ns_ = clock_.time();
+
+	alpha_ = 1 << 16;
+	if (snap.interpolate)
+		alpha_ = static_cast<int>(std::clamp((render_at_ns_ - snap.tick_ns) * 65536 / snap.tick_length_ns, 0L, 65536L));
+	updateCamera(snap);
+
+	layer_rebuild_ = camera_.x != layer_camera_.x || camera_.y != layer_camera_.y
+	                 || snap.level_id != layer_level_ || snap.food_version > layer_food_version_ + 1;
+}
+
+// Last render task, and the only one that touches the display.  The static
+// layer copy repaints the whole window, so no clear is needed.  Input stamps
+// and restart times are only reported the first time a snapshot is drawn.
+void Game::submitFrame()
+{
+	const RenderSnapshot &snap = *render_snap_;
+	drawStaticLayer(snap);
+	drawCells(SPRITE_GHOST, snap.ghost_color, ghost_list_);
+	drawCells(SPRITE_PLAYER, snap.other_color, other_list_);
+	Point player = drawPosition(snap.player);
+	if (options_.sprites)
+		gamedisplay_->drawSprites(SPRITE_PLAYER, &player, 1);
+	else
+		gamedisplay_->drawRect(snap.player_color, player.x, player.y, CellGrid::CELL_SIZE, CellGrid::CELL_SIZE);
+	gamedisplay_->drawText(text_);
+	gamedisplay_->flush();
+
+	last_render_ms_ = (clock_.time() - render_start_ns_) / 1e6;
+	++stats_.renders;
+	checkFrameProtocol();
+
+	if (render_fresh_ && snap.restart_ns >= 0)
+		stats_.restart_to_frame.add((clock_.time() - snap.restart_ns) / 1e6);
+	if (render_fresh_ && snap.input.valid())
+		recordPresent(snap.input);
+	if (options_.render_delay_ms > 0)
+		std::this_thread::sleep_for(std::chrono::milliseconds(options_.render_delay_ms));
+}
+
+// Copies what is near the camera out of the live game.  The camera isn't
+// known exactly until the frame is drawn, so a couple of cells of margin
+// are included.
+void Game::publishSnapshot()
+{
+	const int C = CellGrid::CELL_SIZE;
+	const int MARGIN = 2;
+	RenderSnapshot &snap = snapshots_.writeBuffer();
+
+	snap.tick_ns = last_tick_ns_;
+	snap.interpolate = options_.render_hz > 0 && !idle_;
+	snap.tick_length_ns = tick_ns_;
+	snap.moving_until_ns = idle_ ? 0 : moving_until_ns_;
+	snap.level_id = level_id_;
+	snap.world = {level_->width(), level_->height()};
+	snap.player_color = player_.color;
+	snap.ghost_color = Ghost().color;
+	snap.food_color = Food().color;
+	snap.wall_color = 0x8a8f99;
+	snap.player = {player_.previous, player_.position};
+	snap.food_left = use_food_grid_ ? level_->food_grid.remaining() : level_->food.size();
+	snap.game_over = game_over;
+	snap.game_won = game_won;
+
+	snap.input = frame_input_;
+	frame_input_ = InputStamp();
+	snap.restart_ns = restart_ns_;
+	restart_ns_ = -1;
+
+	snap.eaten.assign(eaten_cells_.begin(), eaten_cells_.end());
+	if (!eaten_cells_.empty())
+		++food_version_;
+	eaten_cells_.clear();
+	snap.food_version = food_version_;
+
+	int view_w = view_width_;
+	int view_h = view_height_;
+	int cam_x = std::clamp(player_.position.x + C / 2 - view_w / 2, 0, std::max(snap.world.width - view_w, 0));
+	int cam_y = std::clamp(player_.position.y + C / 2 - view_h / 2, 0, std::max(snap.world.height - view_h, 0));
+	int cx0 = cam_x / C - MARGIN;
+	int cy0 = cam_y / C - MARGIN;
+	int cx1 = (cam_x + view_w + C - 1) / C + MARGIN;
+	int cy1 = (cam_y + view_h + C - 1) / C + MARGIN;
+	auto inRange = [&](const Point &p) {
+		return p.x >= cx0 * C && p.x < cx1 * C && p.y >= cy0 * C && p.y < cy1 * C;
+	};
+
+	snap.walls.clear();
+	level_->walls.forEachIn(cx0, cy0, cx1, cy1, [&](int cx, int cy) { snap.walls.push_back({cx * C, cy * C}); });
+
+	snap.food.clear();
+	if (use_food_grid_)
+	{
+		level_->food_grid.forEachIn(cx0, cy0, cx1, cy1, [&](int cx, int cy) { snap.food.push_back({cx * C, cy * C}); });
+	}
+	else
+	{
+		level_->food_index.query(cx0, cy0, cx1, cy1, [&](std::size_t i) {
+			if (inRange(level_->food[i].position))
+				snap.food.push_back(level_->food[i].position);
+		});
+	}
+
+	snap.ghosts.clear();
+	if (level_->ghost_index_stale)
+		level_->indexGhosts();
+	level_->ghost_index.query(cx0, cy0, cx1, cy1, [&](std::size_t i) {
+		const Ghost &g = level_->ghosts[i];
+		if (inRange(g.position) || inRange(g.previous))
+			snap.ghosts.push_back({g.previous, g.position});
+	});
+
+	snap.others.clear();
+	snap.other_color = 0x3fa7d6;
+	for (const Mover &m: others_)
+		if (inRange(m.position))
+			snap.others.push_back(m);
+
+	snapshots_.publish();
+}
+
+// Everything sent since the top of the loop belongs to this frame.  The
+// XSync used to time presents comes after this, so it isn't counted.
+void Game::checkFrameProtocol()
+{
+	ProtocolStats used = gamedisplay_->protocolTotals() - frame_start_;
+	stats_.addFrameProtocol(used);
+
+	if (options_.round_trip_budget >= 0 && used.round_trips > options_.round_trip_budget)
+	{
+		fprintf(stderr, "Frame %ld made %ld round trips, over the budget of %d\n",
+		        stats_.frames, used.round_trips, options_.round_trip_budget);
+		exit_status_ = 1;
+		is_running_ = false;
+	}
+}
+
+void Game::stampInput(InputStamp &stamp)
+{
+	stamp.server_ms = event_.xkey.time;
+	stamp.receive_ns = clock_.time();
+
+	// The smallest receive-minus-server offset seen so far is taken as the
+	// clock difference with zero transport delay.
+	long offset = stamp.receive_ns - stamp.server_ms * 1'000'000;
+	if (min_server_offset_ns_ < 0 || offset < min_server_offset_ns_)
+		min_server_offset_ns_ = offset;
+	stamp.server_ns = stamp.server_ms * 1'000'000 + min_server_offset_ns_;
+}
+
+// A frame carrying input waits for the server to finish drawing it, so the
+// present time is when the pixels are really there rather than when the
+// requests left our buffer.
+void Game::recordPresent(const InputStamp &input)
+{
+	gamedisplay_->sync();
+	long present_ns = clock_.time();
+
+	stats_.receive_to_present.add((present_ns - input.receive_ns) / 1e6);
+	stats_.server_to_present.add((present_ns - input.server_ns) / 1e6);
+}
+
+// Taps left and right alternately every 50 ms, through XTEST or straight
+// into the software display's queue, restarting whenever the game ends,
+// then prints the latency percentiles and quits.
+void Game::driveSyntheticInput()
+{
+	long now = clock_.time();
+	if (now < next_synthetic_ns_)
+		return;
+
+	if (synthetic_sent_ == 0)
+		gamedisplay_->takeFocus();
+
+	auto tap = [&](Action a) {
+		unsigned code = bindings_.keycode(a);
+		if (!gamedisplay_->fakeKey(code, true) || !gamedisplay_->fakeKey(code, false))
+			throw std::runtime_error(std::string("--synthetic-input is not supported by the ")
+			                         + gamedisplay_->name() + " backend");
+	};
+
+	if (stats_.receive_to_present.count() >= options_.synthetic_inputs)
+	{
+		printf("Synthetic input: p50 %.1f ms, p99 %.1f ms over %ld presses\n",
+		       stats_.receive_to_present.percentile(50), stats_.receive_to_present.percentile(99),
+		       stats_.receive_to_present.count());
+		tap(Action::QUIT);
+	}
+	else if (game_over)
+	{
+		tap(Action::RESTART);
+	}
+	else
+	{
+		tap(synthetic_sent_ % 2 ? Action::LEFT : Action::RIGHT);
+		++synthetic_sent_;
+	}
+
+	gamedisplay_->flush();
+	next_synthetic_ns_ = now + 50'000'000;
+}
+
+// Plays for the bot by sending key events through handleEvent, just as
+// the display would deliver them: one arrow held at a time and changed when
+// its plan does, and Space once a game is over.  Plans once per tick.
+void Game::driveBot(InputBatch &batch)
+{
+	auto key = [&](Action a, bool press) {
+		event_ = XEvent();
+		event_.type = press ? KeyPress : KeyRelease;
+		event_.xkey.keycode = bindings_.keycode(a);
+		event_.xkey.time = static_cast<::Time>(clock_.time() / 1'000'000);
+		handleEvent(batch);
+	};
+	auto hold = [&](Action a) {
+		if (a == bot_key_)
+			return;
+		if (bot_key_ != Action::NONE)
+			key(bot_key_, false);
+		if (a != Action::NONE)
+			key(a, true);
+		bot_key_ = a;
+	};
+
+	if (game_over && !net_)
+	{
+		hold(Action::NONE);
+		bot_->gameOver(game_won, stats_.ticks - game_start_tick_);
+		game_start_tick_ = stats_.ticks;
+		Action next = options_.bot_games > 0 && bot_->stats().games >= options_.bot_games ? Action::QUIT : Action::RESTART;
+		key(next, true);
+		key(next, false);
+		return;
+	}
+	if (stats_.ticks == bot_tick_)
+		return;
+	bot_tick_ = stats_.ticks;
+
+	const int C = CellGrid::CELL_SIZE;
+	hold(bot_->decide(*level_, {player_.position.x / C, player_.position.y / C}, use_food_grid_));
+}
+
+// Rebuilds the walls/food layer after a level change or a camera move, or
+// patches out the food eaten since the last snapshot it was drawn from,
+// then copies it to the window.  If snapshots were skipped in between the
+// eaten lists are incomplete, so it is rebuilt.
+void Game::drawStaticLayer(const RenderSnapshot &snap)
+{
+	if (layer_rebuild_)
+	{
+		gamedisplay_->beginStaticLayer(true);
+		drawCells(SPRITE_WALL, snap.wall_color, wall_list_);
+		drawCells(SPRITE_FOOD, snap.food_color, food_list_);
+		gamedisplay_->endStaticLayer();
+	}
+	else if (snap.food_version == layer_food_version_ + 1)
+	{
+		const int C = CellGrid::CELL_SIZE;
+		gamedisplay_->beginStaticLayer(false);
+		for (const Point &p: snap.eaten)
+			gamedisplay_->drawRect(GameDisplay::BACKGROUND, p.x - camera_.x, p.y - camera_.y, C, C);
+		gamedisplay_->endStaticLayer();
+	}
+
+	layer_camera_ = camera_;
+	layer_level_ = snap.level_id;
+	layer_food_version_ = snap.food_version;
+	gamedisplay_->drawStaticLayer();
+}
+
+// Builds a complete level without touching the display, so it is safe to run
+// on the pre-generation thread.  Food and ghosts are placed in a single pass so
+// they keep their distance from each other, the walls and the player's spawn.
+void Game::createLevel(Level &level) const
+{
+	const double side = std::sqrt(static_cast<double>(std::max(options_.world_scale, 1)));
+	const int MAXX = static_cast<int>(GameDisplay::DEFAULT_WIDTH * side);
+	const int MAXY = static_cast<int>(GameDisplay::DEFAULT_HEIGHT * side);
+	const int C = CellGrid::CELL_SIZE;
+	const int SPAWN_CLEAR = 4;
+
+	createWalls(level, MAXX / C, MAXY / C);
+
+	SpawnRules rules;
+	rules.cols = MAXX / C;
+	rules.rows = MAXY / C;
+	rules.min_separation = 2;
+	rules.walls = &level.walls;
+	rules.exclusions.push_back({PLAYER_SPAWN.x / C - SPAWN_CLEAR, PLAYER_SPAWN.y / C - SPAWN_CLEAR,
+	                            2 * SPAWN_CLEAR + 1, 2 * SPAWN_CLEAR + 1});
+
+	std::size_t wanted = options_.food_count + options_.ghost_count;
+	std::vector<Point> spawns = SpawnPlacer().place(rules, wanted, level.rng.next());
+	if (spawns.size() < wanted)
+		printf("Only room for %zu of %zu food/ghosts\n", spawns.size(), wanted);
+
+	createFood(level, spawns);
+	createGhosts(level, spawns);
+}
+
+void Game::createWalls(Level &level, int cols, int rows) const
+{
+	level.walls.reset(cols, rows);
+	if (!options_.walls)
+		return;
+
+	// A few straight one-cell-thick segments, kept clear of the player's spawn.
+	Point spawn {PLAYER_SPAWN.x / CellGrid::CELL_SIZE, PLAYER_SPAWN.y / CellGrid::CELL_SIZE};
+	int segments = cols * rows / 400;
+	for (int i = 0; i < segments; ++i)
+	{
+		int len = 4 + level.rng.uniform(9);
+		bool horizontal = level.rng.uniform(2) == 0;
+		int x = level.rng.uniform(cols);
+		int y = level.rng.uniform(rows);
+		for (int k = 0; k < len; ++k)
+		{
+			int cx = horizontal ? x + k : x;
+			int cy = horizontal ? y : y + k;
+			if (level.walls.inGrid(cx, cy) && (std::abs(cx - spawn.x) > 2 || std::abs(cy - spawn.y) > 2))
+				level.walls.set(cx, cy);
+		}
+	}
+}
+
+// Food takes the first food_count spawns.
+void Game::createFood(Level &level, const std::vector<Point> &spawns) const
+{
+	const int C = CellGrid::CELL_SIZE;
+	std::size_t n = std::min<std::size_t>(options_.food_count, spawns.size());
+
+	level.food.clear();
+	if (use_food_grid_)
+	{
+		level.food_grid.reset(level.walls.cols(), level.walls.rows());
+		for (std::size_t i = 0; i < n; ++i)
+			level.food_grid.set(spawns[i].x, spawns[i].y);
+		return;
+	}
+
+	level.food.resize(n);
+	for (std::size_t i = 0; i < n; ++i)
+		level.food[i].place({spawns[i].x * C, spawns[i].y * C});
+	level.food_index.reset(level.walls.cols(), level.walls.rows());
+	level.indexFood();
+}
+
+// Ghosts take whatever is left after the food.
+void Game::createGhosts(Level &level, const std::vector<Point> &spawns) const
+{
+	const int C = CellGrid::CELL_SIZE;
+	std::size_t first = std::min<std::size_t>(options_.food_count, spawns.size());
+
+	level.ghosts.clear();
+	level.ghosts.resize(spawns.size() - first);
+	for (std::size_t i = 0; i < level.ghosts.size(); ++i)
+	{
+		level.ghosts[i].place({spawns[first + i].x * C, spawns[first + i].y * C});
+		level.ghosts[i].ticks_to_move = ghost_period_ticks_;
+	}
+	level.ghost_index.reset(level.walls.cols(), level.walls.rows());
+	level.indexGhosts();
+	level.ghost_cells.reset(level.walls.cols(), level.walls.rows());
+	for (const Ghost &g: level.ghosts)
+		level.ghost_cells.add(g.position.x / C, g.position.y / C);
+}
+
+// World cells to the screen positions of those in the window.
+void Game::cullCells(const std::vector<Point> &cells, std::vector<Point> &out) const
+{
+	out.clear();
+	for (const Point &p: cells)
+	{
+		Point at {p.x - camera_.x, p.y - camera_.y};
+		if (onScreen(at))
+			out.push_back(at);
+	}
+}
+
+void Game::listGhosts(const RenderSnapshot &snap)
+{
+	ghost_list_.clear();
+	for (const Mover &g: snap.ghosts)
+	{
+		Point at = drawPosition(g);
+		if (onScreen(at))
+			ghost_list_.push_back(at);
+	}
+	other_list_.clear();
+	for (const Mover &m: snap.others)
+	{
+		Point at = drawPosition(m);
+		if (onScreen(at))
+			other_list_.push_back(at);
+	}
+}
+
+bool Game::isWall(const Point &p) const
+{
+	const int C = CellGrid::CELL_SIZE;
+	return level_->walls.test(p.x / C, p.y / C);
+}
+
+// The game-over message and the HUD.  Score and timing are formatted into a
+// stack buffer so the HUD costs the same every frame.
+void Game::layoutText(const RenderSnapshot &snap)
+{
+	static constexpr std::string_view WIN = "YOU WIN!!  PRESS SPACEBAR TO RESTART...";
+	static constexpr std::string_view LOSE = "YOU LOSE!! PRESS SPACEBAR TO RESTART...";
+
+	text_.clear();
+	if (snap.game_over)
+		text_.layout(100, 100, snap.game_won ? WIN : LOSE);
+
+	char line[64];
+	int len = std::snprintf(line, sizeof(line), "FOOD LEFT %zu   LAST FRAME %.2f MS", snap.food_left, last_render_ms_);
+	text_.layout(4, 12, std::string_view(line, std::min<std::size_t>(len, sizeof(line) - 1)));
+}
+
+// The player moves along x and then along y (see movePlayer), so its path
+// through a tick is two straight legs, each taking time in proportion to
+// its length.  Returns when it first touches a cell-sized box moving from
+// `from` to `to` over the same tick, or -1.
+double Game::playerContact(Point from, Point to) const
+{
+	const Size S = player_.size;
+	Point start = player_.previous;
+	Point corner {player_.position.x, player_.previous.y};
+	Point end = player_.position;
+	int first = std::abs(corner.x - start.x);
+	int second = std::abs(end.y - corner.y);
+	double split = first + second > 0 ? static_cast<double>(first) / (first + second) : 1.0;
+	Point mid = interpolate(from, to, static_cast<int>(split * 65536));
+
+	double t = sweptContact(start, corner, S, from, mid, S);
+	if (t >= 0)
+		return t * split;
+	t = sweptContact(corner, end, S, mid, to, S);
+	return t >= 0 ? split + t * (1 - split) : -1;
+}
+
+// Eats everything on the player's path this tick, so a fast player can't
+// skip over food.  Returns how far into the tick the last food went, or -1
+// if there is some left.
+double Game::eatFood()
+{
+	const int C = CellGrid::CELL_SIZE;
+	Point start = player_.previous;
+	Point end = player_.position;
+	double last = -1;
+
+	if (use_food_grid_)
+	{
+		// The player moves in whole cells and touching counts, as in the
+		// swept test below, so food is eaten from the cells around each one
+		// it stands on, as it gets there.
+		int length = std::abs(end.x - start.x) + std::abs(end.y - start.y);
+		int travelled = 0;
+		auto visit = [&](int x, int y) {
+			for (int cy = y / C - 1; cy <= y / C + 1; ++cy)
+				for (int cx = x / C - 1; cx <= x / C + 1; ++cx)
+					if (level_->food_grid.testAndClear(cx, cy))
+					{
+						eaten_cells_.push_back({cx * C, cy * C});
+						last = length ? static_cast<double>(travelled) / length : 1.0;
+					}
+		};
+		visit(start.x, start.y);
+		for (int x = start.x; x != end.x; travelled += C)
+		{
+			x += end.x > x ? C : -C;
+			visit(x, start.y);
+		}
+		for (int y = start.y; y != end.y; travelled += C)
+		{
+			y += end.y > y ? C : -C;
+			visit(end.x, y);
+		}
+	}
+	else
+	{
+		// Only food in the buckets along the path can touch it.
+		food_touched_.clear();
+		level_->food_index.query(std::min(start.x, end.x) / C - 1, std::min(start.y, end.y) / C - 1,
+		                         std::max(start.x, end.x) / C + 2, std::max(start.y, end.y) / C + 2,
+		                         [&](std::size_t i) {
+			Point p = level_->food[i].position;
+			double t = playerContact(p, p);
+			if (t >= 0)
+				food_touched_.push_back({i, t});
+		});
+
+		if (!food_touched_.empty())
+		{
+			// Highest index first, so erasing doesn't move the rest.
+			std::sort(food_touched_.begin(), food_touched_.end(),
+			          [](const auto &a, const auto &b) { return a.first > b.first; });
+			for (const auto &[i, t]: food_touched_)
+			{
+				eaten_cells_.push_back(level_->food[i].position);
+				level_->food.erase(level_->food.begin() + i);
+				last = std::max(last, t);
+			}
+			level_->indexFood();
+		}
+	}
+
+	bool all_eaten = use_food_grid_ ? level_->food_grid.remaining() == 0 : level_->food.empty();
+	return all_eaten ? last : -1;
+}
+
+// When in the tick the player first touched a ghost, or -1.  Ghosts that
+// moved are swept against the player's path.  If the player moved too, it
+// is swept against the cells around its path that hold ghosts which stood
+// still; the occupancy grid says which those are, less any that only got
+// there by moving this tick.
+double Game::hitGhost()
+{
+	const int C = CellGrid::CELL_SIZE;
+	const std::vector<Ghost> &ghosts = level_->ghosts;
+	double first = -1;
+	auto consider = [&](double t) {
+		if (t >= 0 && (first < 0 || t < first))
+			first = t;
+	};
+
+	for (std::uint32_t i: moved_ghosts_)
+		consider(playerContact(ghosts[i].previous, ghosts[i].position));
+
+	if (!player_moved_)
+		return first;
+
+	Point a = player_.previous;
+	Point b = player_.position;
+	int cx0 = std::min(a.x, b.x) / C - 1, cx1 = std::max(a.x, b.x) / C + 1;
+	int cy0 = std::min(a.y, b.y) / C - 1, cy1 = std::max(a.y, b.y) / C + 1;
+	auto cellOf = [&](std::uint32_t i) { return Point {ghosts[i].position.x / C, ghosts[i].position.y / C}; };
+
+	nearby_moved_.clear();
+	for (std::uint32_t i: moved_ghosts_)
+	{
+		Point c = cellOf(i);
+		if (c.x >= cx0 && c.x <= cx1 && c.y >= cy0 && c.y <= cy1)
+			nearby_moved_.push_back(i);
+	}
+
+	for (int cy = cy0; cy <= cy1; ++cy)
+		for (int cx = cx0; cx <= cx1; ++cx)
+		{
+			int still = level_->ghost_cells.count(cx, cy);
+			if (still == 0)
+				continue;
+			for (std::uint32_t i: nearby_moved_)
+				still -= cellOf(i).x == cx && cellOf(i).y == cy;
+			if (still > 0)
+				consider(playerContact({cx * C, cy * C}, {cx * C, cy * C}));
+		}
+	return first;
+}
+
+// Cells at screen positions, as one sprite batch or as flat rects.
+void Game::drawCells(int sprite, unsigned long color, const std::vector<Point> &cells)
+{
+	const int C = CellGrid::CELL_SIZE;
+	if (options_.sprites)
+	{
+		if (!cells.empty())
+			gamedisplay_->drawSprites(sprite, cells.data(), cells.size());
+		return;
+	}
+	for (const Point &at: cells)
+		gamedisplay_->drawRect(color, at.x, at.y, C, C);
+}
+
+// Interpolated, and relative to the camera.
+Point Game::drawPosition(const Mover &m) const
+{
+	Point p = interpolate(m.previous, m.position, alpha_);
+	return {p.x - camera_.x, p.y - camera_.y};
+}
+
+// Centres the view on the player, stopping at the edges of the world.  The
+// window size is passed back for the simulation to cut the next snapshot
+// to, so the cost of a frame follows the window size, not the world's.
+void Game::updateCamera(const RenderSnapshot &snap)
+{
+	const int C = CellGrid::CELL_SIZE;
+	Rect view = gamedisplay_->getGeometry();
+	view_ = {view.width, view.height};
+	view_width_ = view.width;
+	view_height_ = view.height;
+	Point focus = interpolate(snap.player.previous, snap.player.position, alpha_);
+
+	camera_.x = std::clamp(focus.x + C / 2 - view.width / 2, 0, std::max(snap.world.width - view.width, 0));
+	camera_.y = std::clamp(focus.y + C / 2 - view.height / 2, 0, std::max(snap.world.height - view.height, 0));
+}
+
+bool Game::onScreen(const Point &at) const
+{
+	const int C = CellGrid::CELL_SIZE;
+	return at.x > -C && at.y > -C && at.x < view_.width && at.y < view_.height;
+}
+
+// Start of a tick: whatever moves during it is drawn sliding from here.
+void Game::snapshotPositions()
+{
+	player_.previous = player_.position;
+	for (auto &g: level_->ghosts)
+		g.previous = g.position;
+}
+
+// Returns true if any ghost took a turn, even one that bumped into a wall.
+// Those that actually changed cell go in moved_ghosts_.
+bool Game::moveGhosts()
+{
+	bool ghost_moved = false;
+	moved_ghosts_.clear();
+	std::vector<Ghost> &ghosts = level_->ghosts;
+	for (std::size_t i = 0; i < ghosts.size(); ++i)
+	{
+		Ghost &g = ghosts[i];
+		if (--g.ticks_to_move <= 0) {
+			g.ticks_to_move = ghost_period_ticks_;
+			Point old_position = g.position;
+			Point step = Ghost::nextStep(level_->rng);
+			for (int n = 0; n < options_.ghost_step; ++n)
+			{
+				Point next {g.position.x + step.x, g.position.y + step.y};
+				if (isWall(next))
+					break;
+				g.position = next;
+			}
+			ghost_moved = true;
+			if (g.position.x != old_position.x || g.position.y != old_position.y)
+			{
+				level_->ghost_cells.move(old_position, g.position);
+				moved_ghosts_.push_back(static_cast<std::uint32_t>(i));
+			}
+		}
+	}
+
+	if (!moved_ghosts_.empty())
+		level_->ghost_index_stale = true;
+	return ghost_moved;
+}
+
+// Records what the event asks for; nothing is moved or drawn until the
+// whole queue has been read.
+void Game::handleEvent(InputBatch &batch)
+{
+	++stats_.events;
+
+	if (event_.type == Expose)
+	{
+		stats_.exposes_coalesced += batch.expose;
+		batch.expose = true;
+	}
+
+	// Focus moves caused by keyboard grabs are transient, so ignore them.
+	if ((event_.type == FocusIn || event_.type == FocusOut)
+	    && event_.xfocus.mode != NotifyGrab && event_.xfocus.mode != NotifyUngrab)
+	{
+		focused_ = (event_.type == FocusIn);
+		// Releases that happen while unfocused never reach us.
+		if (!focused_)
+			keys_.clear();
+	}
+
+	if (event_.type == VisibilityNotify)
+		visible_ = (event_.xvisibility.state != VisibilityFullyObscured);
+	if (event_.type == UnmapNotify)
+		visible_ = false;
+	if (event_.type == MapNotify)
+		visible_ = true;
+
+	// Without detectable auto-repeat, a held key shows up as a release
+	// immediately followed by a press with the same timestamp.  Drop both.
+	XEvent next;
+	if (event_.type == KeyRelease && !gamedisplay_->hasDetectableAutoRepeat()
+	    && peekQueuedEvent(next)
+	    && next.type == KeyPress && next.xkey.keycode == event_.xkey.keycode
+	    && next.xkey.time == event_.xkey.time)
+	{
+		queuedEvent(next);
+		return;
+	}
+
+	if (event_.type == KeyRelease)
+	{
+		keys_.release(event_.xkey.keycode);
+		if (options_.legacy_input)
+			last_step_ns_ = -1;
+	}
+
+	if (event_.type == KeyPress)
+	{
+		++stats_.key_presses;
+
+		Action action = bindings_.action(event_.xkey.keycode);
+		bool repeat = keys_.held(event_.xkey.keycode);
+		keys_.press(event_.xkey.keycode);
+
+		Point dir {0, 0};
+		switch (action)
+		{
+			case Action::UP       : dir.y = -1; break;
+			case Action::DOWN     : dir.y = 1; break;
+			case Action::LEFT     : dir.x = -1; break;
+			case Action::RIGHT    : dir.x = 1; break;
+
+			case Action::RESTART  : batch.restart = true; break;
+
+			case Action::QUIT     : batch.quit = true; break;
+
+			case Action::REWIND   : batch.rewind = true; break;
+
+			default: break;
+		}
+
+		if (dir.x != 0 || dir.y != 0)
+		{
+			const int C = CellGrid::CELL_SIZE;
+			if (options_.legacy_input)
+			{
+				batch.dx += dir.x * C;
+				batch.dy += dir.y * C;
+				if (!pending_press_.valid() && last_step_ns_ < 0)
+					stampInput(pending_press_);
+			}
+			else if (!repeat)
+			{
+				tap_ = dir;
+				move_progress_ = 1.0;
+				stampInput(pending_press_);
+			}
+		}
+	}
+}
+
+// Returns true if anything visible changed.
+bool Game::applyInput(const InputBatch &batch)
+{
+	if (batch.quit)
+	{
+		is_running_ = false;
+		return false;
+	}
+
+	if (batch.restart && game_over)
+	{
+		resetGame();
+		return true;
+	}
+
+	// Back a second, or as far as the ring goes; works after a loss too.
+	if (batch.rewind && rewind_ && rewind_->size() > 0)
+	{
+		std::size_t back = std::min<std::size_t>(options_.sim_hz, rewind_->size()) - 1;
+		restore(rewind_->newest(back));
+		rewind_->drop(back + 1);
+		return true;
+	}
+
+	if (game_over || net_ || (batch.dx == 0 && batch.dy == 0))
+		return false;
+
+	if (!movePlayer(batch.dx, batch.dy))
+		return false;
+
+	// Moves from input outside a tick are shown straight away, and
+	// collision-tested on the next tick.
+	player_.previous = player_.position;
+	moved_outside_tick_ = true;
+	recordStep();
+	return true;
+}
+
+// Walks the net delta one cell at a time, horizontal part first, so walls
+// still stop the player.  Collision is left to the single pass at the end of
+// the frame.
+bool Game::movePlayer(int dx, int dy)
+{
+	const int C = CellGrid::CELL_SIZE;
+	Point start = player_.position;
+
+	for (int step = (dx > 0 ? C : -C); dx != 0; dx -= step)
+	{
+		Point next {player_.position.x + step, player_.position.y};
+		if (isWall(next))
+			break;
+		player_.position = next;
+	}
+
+	for (int step = (dy > 0 ? C : -C); dy != 0; dy -= step)
+	{
+		Point next {player_.position.x, player_.position.y + step};
+		if (isWall(next))
+			break;
+		player_.position = next;
+	}
+
+	return player_.position.x != start.x || player_.position.y != start.y;
+}
+
+void Game::resetGame()
+{
+    restart_ns_ = clock_.time();
+
+    bool was_ready = next_level_.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    level_ = next_level_.get();
+    stats_.level_swap.add((clock_.time() - restart_ns_) / 1e6);
+    stats_.level_swaps_waited += !was_ready;
+    pregenerateLevel();
+
+    player_.place(PLAYER_SPAWN);
+    game_won = false;
+    game_over = false;
+    ++level_id_;
+    eaten_cells_.clear();
+}
+
+bool Game::isPlayerWithinBounds()
+{
+	if (   player_.position.x < 0 || player_.position.x >= level_->width()
+		|| player_.position.y < 0 || player_.position.y >= level_->height())
+	{
+		return false;
+	}
+	
+	return true;
+}
+
+void Game::snapshot(SimState &out) const
+{
+	const Level &level = *level_;
+	SimState::Header h;
+	std::memset(&h, 0, sizeof(h));
+	h.tick = tick_;
+	h.rng = level.rng.state;
+	h.level_rng = level_rng_.state;
+	h.next_level_seed = next_level_seed_;
+	h.move_progress = move_progress_;
+	h.player = player_.position;
+	h.player_previous = player_.previous;
+	h.tap = tap_;
+	h.cols = level.walls.cols();
+	h.rows = level.walls.rows();
+	h.food = use_food_grid_ ? 0 : static_cast<std::uint32_t>(level.food.size());
+	h.ghosts = static_cast<std::uint32_t>(level.ghosts.size());
+	h.flags = (game_over ? SimState::GAME_OVER : 0) | (game_won ? SimState::GAME_WON : 0)
+	          | (use_food_grid_ ? SimState::FOOD_GRID : 0);
+
+	out.arena_.resize(SimState::layout(h, SimState::END));
+	std::memcpy(out.arena_.data(), &h, sizeof(h));
+	std::copy_n(level.walls.words(), out.gridWords(), out.at(SimState::WALLS));
+	if (use_food_grid_)
+		std::copy_n(level.food_grid.words(), out.gridWords(), out.at(SimState::FOOD_GRID_WORDS));
+	std::memcpy(out.at(SimState::FOOD_LIST), level.food.data(), h.food * sizeof(Food));
+	std::memcpy(out.at(SimState::GHOSTS), level.ghosts.data(), h.ghosts * sizeof(Ghost));
+}
+
+// The indexes over food and ghosts are brought up to date, rebuilt from
+// scratch only if the level size changed, and the static layer is redrawn
+// as it would be for a new level.
+void Game::restore(const SimState &in)
+{
+	const SimState::Header &h = in.header();
+	if (((h.flags & SimState::FOOD_GRID) != 0) != use_food_grid_)
+		throw std::runtime_error("Snapshot was taken with the other food storage");
+
+	const int C = CellGrid::CELL_SIZE;
+	Level &level = *level_;
+	bool resized = level.walls.cols() != h.cols || level.walls.rows() != h.rows;
+	auto changed = [&](const CellGrid &grid, SimState::Section section) {
+		return resized || !std::equal(grid.words(), grid.words() + in.gridWords(), in.at(section));
+	};
+
+	level.rng.state = h.rng;
+	level_rng_.state = h.level_rng;
+	if (changed(level.walls, SimState::WALLS))
+		level.walls.assign(h.cols, h.rows, in.at(SimState::WALLS));
+	if (use_food_grid_)
+	{
+		if (changed(level.food_grid, SimState::FOOD_GRID_WORDS))
+			level.food_grid.assign(h.cols, h.rows, in.at(SimState::FOOD_GRID_WORDS));
+	}
+	else if (resized || level.food.size() != h.food
+	         || std::memcmp(level.food.data(), in.at(SimState::FOOD_LIST), h.food * sizeof(Food)) != 0)
+	{
+		level.food.resize(h.food);
+		std::memcpy(static_cast<void *>(level.food.data()), in.at(SimState::FOOD_LIST), h.food * sizeof(Food));
+		if (resized)
+			level.food_index.reset(h.cols, h.rows);
+		level.indexFood();
+	}
+
+	// Going back a little way, most ghosts are still on the same cell.
+	// Otherwise the cells are counted afresh as the ghosts are copied in,
+	// taking the old ghosts off first unless the grid changed size.
+	const std::uint64_t *ghosts = in.at(SimState::GHOSTS);
+	if (!resized && level.ghosts.size() == h.ghosts)
+	{
+		for (std::size_t i = 0; i < level.ghosts.size(); ++i)
+		{
+			Ghost &g = level.ghosts[i];
+			Point from = g.position;
+			std::memcpy(static_cast<void *>(&g), ghosts + i * sizeof(Ghost) / 8, sizeof(Ghost));
+			if (from.x / C != g.position.x / C || from.y / C != g.position.y / C)
+				level.ghost_cells.move(from, g.position);
+		}
+	}
+	else
+	{
+		if (resized)
+		{
+			level.ghost_index.reset(h.cols, h.rows);
+			level.ghost_cells.reset(h.cols, h.rows);
+		}
+		else
+		{
+			for (const Ghost &g: level.ghosts)
+				level.ghost_cells.remove(g.position.x / C, g.position.y / C);
+		}
+		level.ghosts.clear();
+		level.ghosts.reserve(h.ghosts);
+		Ghost g;
+		for (std::uint32_t i = 0; i < h.ghosts; ++i)
+		{
+			std::memcpy(static_cast<void *>(&g), ghosts + i * sizeof(Ghost) / 8, sizeof(Ghost));
+			level.ghosts.push_back(g);
+			level.ghost_cells.add(g.position.x / C, g.position.y / C);
+		}
+	}
+	level.ghost_index_stale = true;
+	resume(h);
+}
+
+// Reads a saved game straight into the level, which has to be empty, as
+// restore would leave it given the SimState the file was written from.
+void Game::load(const std::string &path)
+{
+	struct ToLevel {
+		Level &level;
+		bool food_grid;
+		SimState::Header h;
+
+		void header(const SimState::Header &header)
+		{
+			h = header;
+			if (((h.flags & SimState::FOOD_GRID) != 0) != food_grid)
+				throw std::runtime_error("Snapshot was taken with the other food storage");
+			level.walls.reset(h.cols, h.rows);
+			if (food_grid)
+				level.food_grid.reset(h.cols, h.rows);
+			level.food.reserve(h.food);
+			level.ghosts.reserve(h.ghosts);
+			adviseHugePages(level.food.data(), h.food * sizeof(Food));
+			adviseHugePages(level.ghosts.data(), h.ghosts * sizeof(Ghost));
+			level.food_index.reset(h.cols, h.rows);
+			level.ghost_index.reset(h.cols, h.rows);
+			level.ghost_cells.reset(h.cols, h.rows);
+		}
+		std::uint64_t *grid(bool food) { return (food ? level.food_grid : level.walls).words(); }
+		void food(const Food &f) { level.food.push_back(f); }
+		void ghost(const Ghost &g) { level.ghosts.push_back(g); }
+	};
+	Level &level = *level_;
+	ToLevel sink {level, use_food_grid_, {}};
+	SaveFile::read(path, sink);
+
+	level.rng.state = sink.h.rng;
+	level_rng_.state = sink.h.level_rng;
+	level.walls.recount();
+	level.food_grid.recount();
+	// A pass of its own: counted as each ghost is decoded, the scattered
+	// writes to the cells take three times as long.
+	for (const Ghost &g: level.ghosts)
+		level.ghost_cells.add(g.position.x / CellGrid::CELL_SIZE, g.position.y / CellGrid::CELL_SIZE);
+	level.indexFood();
+	level.ghost_index_stale = true;
+	resume(sink.h);
+}
+
+// The rest of restoring or loading, once the level is in.
+void Game::resume(const SimState::Header &h)
+{
+	// Only started once the rest is in, so it doesn't compete with it.
+	if (h.next_level_seed != next_level_seed_ || !next_level_.valid())
+	{
+		if (next_level_.valid())
+			next_level_.wait();
+		generateLevel(h.next_level_seed);
+	}
+
+	tick_ = h.tick;
+	move_progress_ = h.move_progress;
+	player_.position = h.player;
+	player_.previous = h.player_previous;
+	tap_ = h.tap;
+	game_over = (h.flags & SimState::GAME_OVER) != 0;
+	game_won = (h.flags & SimState::GAME_WON) != 0;
+
+	moved_ghosts_.clear();
+	moved_outside_tick_ = false;
+	eaten_cells_.clear();
+	++level_id_;
+}
+
+int Game::advance(int n)
+{
+	int ran = 0;
+	for (; ran < n && !game_over; ++ran)
+		tick();
+	return ran;
+}
+
+// Compares the memory and eat-check cost of the Food vector against the
+// CellGrid bitset for a 1000x1000 cell map.
+void runFoodBenchmark()
+{
+	const int COLS = 1000;
+	const int ROWS = 1000;
+	const int C = CellGrid::CELL_SIZE;
+
+	std::vector<Food> food(static_cast<std::size_t>(COLS) * ROWS);
+	for (std::size_t i = 0; i < food.size(); ++i)
+		food[i].position = {static_cast<int>(i % COLS) * C, static_cast<int>(i / COLS) * C};
+
+	CellGrid grid;
+	grid.reset(COLS, ROWS);
+	for (int cy = 0; cy < ROWS; ++cy)
+		for (int cx = 0; cx < COLS; ++cx)
+			grid.set(cx, cy);
+
+	printf("food cells          : %d\n", COLS * ROWS);
+	printf("vector<Food> memory : %zu bytes\n", food.size() * sizeof(Food));
+	printf("CellGrid memory     : %zu bytes\n", grid.memoryBytes());
+
+	// Eat a handful of cells near the end of the map, where find_if is slowest.
+	const int EATS = 10;
+	Player p;
+	Time t;
+	for (int i = 0; i < EATS; ++i)
+	{
+		p.position = {(COLS - 1 - i) * C, (ROWS - 1) * C};
+		auto iter = std::find_if(food.begin(), food.end(), [&](const Food &f){
+			return rectangleIntersect(p.bounds(), f.bounds());
+		});
+		if (iter != food.end())
+			food.erase(iter);
+	}
+	long vector_ns = t.time();
+
+	Time t2;
+	for (int i = 0; i < EATS; ++i)
+		grid.testAndClear(COLS - 1 - i, ROWS - 1);
+	long grid_ns = t2.time();
+
+	printf("vector<Food> eat    : %ld ns/eat\n", vector_ns / EATS);
+	printf("CellGrid eat        : %ld ns/eat\n", grid_ns / EATS);
+	printf("CellGrid remaining  : %zu\n", grid.remaining());
+}
+
+
+// Placement throughput at a fixed density (about a quarter of the buckets
+// filled), checking the separation guarantee on the smaller runs.
+void runSpawnBenchmark()
+{
+	const std::size_t counts[] = {10'000, 1'000'000, 10'000'000};
+	const int SEPARATION = 2;
+
+	for (std::size_t count: counts)
+	{
+		int side = static_cast<int>(std::ceil(std::sqrt(count * 12.0)));
+
+		SpawnRules rules;
+		rules.cols = side;
+		rules.rows = side;
+		rules.min_separation = SEPARATION;
+		rules.exclusions.push_back({0, 0, 10, 10});
+
+		Time t;
+		std::vector<Point> spawns = SpawnPlacer().place(rules, count, 12345);
+		double ms = t.time() / 1e6;
+
+		printf("%9zu spawns on %5dx%-5d: %9.1f ms  %6.2f M/s  placed %zu\n",
+		       count, side, side, ms, spawns.size() / ms / 1e3, spawns.size());
+
+		if (count > 1'000'000)
+			continue;
+
+		std::vector<unsigned char> occupied(static_cast<std::size_t>(side) * side, 0);
+		for (const Point &p: spawns)
+			occupied[static_cast<std::size_t>(p.y) * side + p.x] = 1;
+		std::size_t violations = 0;
+		for (const Point &p: spawns)
+		{
+			violations += (p.x < 10 && p.y < 10);
+			for (int dy = -(SEPARATION - 1); dy < SEPARATION; ++dy)
+				for (int dx = -(SEPARATION - 1); dx < SEPARATION; ++dx)
+				{
+					int x = p.x + dx, y = p.y + dy;
+					if ((dx || dy) && x >= 0 && y >= 0 && x < side && y < side)
+						violations += occupied[static_cast<std::size_t>(y) * side + x];
+				}
+		}
+		printf("%9s separation violations: %zu\n", "", violations);
+	}
+}
+
+
+// Draws a 200-rect frame the way the game does, geometry check included,
+// with every available backend on the current $DISPLAY.  Run it once with a
+// local socket display (:0) and once over TCP (localhost:0) to compare.
+void runDisplayBenchmark(int frames)
+{
+	const char *backends[] = {"xlib", "xcb"};
+	const int C = CellGrid::CELL_SIZE;
+
+	for (const char *backend: backends)
+	{
+		std::unique_ptr<GameDisplay> d;
+		try
+		{
+			d = createDisplay(backend);
+		}
+		catch (const std::exception &e)
+		{
+			printf("%-5s: %s\n", backend, e.what());
+			continue;
+		}
+
+		d->sync();
+		ProtocolStats before = d->protocolTotals();
+		Time t;
+		for (int f = 0; f < frames; ++f)
+		{
+			d->clear();
+			for (int i = 0; i < 200; ++i)
+				d->drawRect(i < 100 ? 0xe0f731 : 0xff0000, (i * 37 + f) % 80 * C, (i * 11) % 60 * C, C, C);
+			d->drawText(100, 100, "BENCHMARK");
+			d->getGeometry();
+			d->flush();
+		}
+		d->sync();
+		double ms = t.time() / 1e6;
+
+		ProtocolStats used = d->protocolTotals() - before;
+		printf("%-5s: %d frames, %.3f ms/frame, %.1f requests/frame, %.0f bytes/frame, %.2f round trips/frame\n",
+		       backend, frames, ms / frames, static_cast<double>(used.requests) / frames,
+		       static_cast<double>(used.bytes) / frames, static_cast<double>(used.round_trips - 1) / frames);
+	}
+}
+
+
+// Frame cost on a 100k-food level, redrawing every food rect each frame
+// against copying the cached static layer.  Runs on the software backend
+// and on any X backend that can open $DISPLAY.
+void runStaticLayerBenchmark()
+{
+	const int COLS = 400;
+	const int ROWS = 250;
+	const int C = CellGrid::CELL_SIZE;
+	const int FRAMES = 20;
+	const Food food;
+	const Ghost ghost;
+
+	CellGrid grid;
+	grid.reset(COLS, ROWS);
+	for (int cy = 0; cy < ROWS; ++cy)
+		for (int cx = 0; cx < COLS; ++cx)
+			grid.set(cx, cy);
+
+	const char *backends[] = {"software", "xlib", "xcb"};
+	for (const char *backend: backends)
+	{
+		std::unique_ptr<GameDisplay> d;
+		try
+		{
+			if (std::strcmp(backend, "software") == 0)
+				d = std::make_unique<SoftwareDisplay>(COLS * C, ROWS * C);
+			else
+				d = createDisplay(backend);
+		}
+		catch (const std::exception &e)
+		{
+			printf("%-8s: %s\n", backend, e.what());
+			continue;
+		}
+
+		auto drawFood = [&] {
+			grid.forEach([&](int cx, int cy) {
+				d->drawRect(food.color, cx * C, cy * C, food.size.width, food.size.height);
+			});
+		};
+		auto drawMovers = [&](int f) {
+			for (int i = 0; i < 10; ++i)
+				d->drawRect(ghost.color, (i * 7 + f) % COLS * C, i * 3 * C, C, C);
+		};
+
+		d->sync();
+		ProtocolStats before = d->protocolTotals();
+		Time full;
+		for (int f = 0; f < FRAMES; ++f)
+		{
+			d->clear();
+			drawFood();
+			drawMovers(f);
+			d->flush();
+		}
+		d->sync();
+		double full_ms = full.time() / 1e6 / FRAMES;
+		ProtocolStats full_used = d->protocolTotals() - before;
+
+		Time build;
+		d->beginStaticLayer(true);
+		drawFood();
+		d->endStaticLayer();
+		d->sync();
+		double build_ms = build.time() / 1e6;
+
+		before = d->protocolTotals();
+		Time cached;
+		for (int f = 0; f < FRAMES; ++f)
+		{
+			d->drawStaticLayer();
+			drawMovers(f);
+			d->flush();
+		}
+		d->sync();
+		double cached_ms = cached.time() / 1e6 / FRAMES;
+		ProtocolStats cached_used = d->protocolTotals() - before;
+
+		printf("%-8s: full redraw %.3f ms/frame (%ld requests), cached layer %.3f ms/frame (%ld requests), "
+		       "layer build %.3f ms\n", backend, full_ms, full_used.requests / FRAMES,
+		       cached_ms, cached_used.requests / FRAMES, build_ms);
+	}
+}
+
+// Frame time with 10k entities on screen, as flat rects and as sprites from
+// the atlas.  Runs on the software backend and on any X backend that can
+// open $DISPLAY.
+void runSpriteBenchmark()
+{
+	const int COUNT = 10'000;
+	const int FRAMES = 20;
+	const int C = CellGrid::CELL_SIZE;
+	const int COLS = GameDisplay::DEFAULT_WIDTH / C;
+	const int ROWS = GameDisplay::DEFAULT_HEIGHT / C;
+	const SpriteAtlas atlas = SpriteAtlas::makeDefault();
+	const unsigned long colors[] = {0x6091ab, 0xff0000, 0xe0f731, 0x8a8f99};
+
+	// Grouped by sprite, as the game draws them.
+	std::array<std::vector<Point>, SPRITE_COUNT> positions;
+	Rng rng(1);
+	for (int i = 0; i < COUNT; ++i)
+		positions[i % SPRITE_COUNT].push_back({static_cast<int>(rng.uniform(COLS)) * C,
+		                                       static_cast<int>(rng.uniform(ROWS)) * C});
+
+	const char *backends[] = {"software", "xlib", "xcb"};
+	for (const char *backend: backends)
+	{
+		std::unique_ptr<GameDisplay> d;
+		try
+		{
+			d = createDisplay(backend);
+			Time upload;
+			d->loadSprites(atlas);
+			d->sync();
+			printf("%-8s: atlas upload %.3f ms\n", backend, upload.time() / 1e6);
+		}
+		catch (const std::exception &e)
+		{
+			printf("%-8s: %s\n", backend, e.what());
+			continue;
+		}
+
+		auto measure = [&](const char *label, bool sprites) {
+			d->sync();
+			ProtocolStats before = d->protocolTotals();
+			Time t;
+			for (int f = 0; f < FRAMES; ++f)
+			{
+				d->clear();
+				for (int s = 0; s < SPRITE_COUNT; ++s)
+				{
+					if (sprites)
+						d->drawSprites(s, positions[s].data(), positions[s].size());
+					else
+						for (const Point &p: positions[s])
+							d->drawRect(colors[s], p.x, p.y, C, C);
+				}
+				d->flush();
+			}
+			d->sync();
+			ProtocolStats used = d->protocolTotals() - before;
+			printf("%-8s: %d %s, %.3f ms/frame, %ld requests/frame, %ld bytes/frame\n", backend, COUNT, label,
+			       t.time() / 1e6 / FRAMES, used.requests / FRAMES, used.bytes / FRAMES);
+		};
+
+		measure("rects  ", false);
+		measure("sprites", true);
+	}
+}
+
+
+// Per-frame cost of a HUD line and a message, laid out and drawn every
+// frame with numbers that change.  Runs on the software backend and on any
+// X backend that can open $DISPLAY.
+void runTextBenchmark()
+{
+	const int FRAMES = 10'000;
+
+	const char *backends[] = {"software", "xlib", "xcb"};
+	for (const char *backend: backends)
+	{
+		std::unique_ptr<GameDisplay> d;
+		try
+		{
+			d = createDisplay(backend);
+		}
+		catch (const std::exception &e)
+		{
+			printf("%-8s: %s\n", backend, e.what());
+			continue;
+		}
+
+		d->sync();
+		ProtocolStats before = d->protocolTotals();
+		Time t;
+		for (int f = 0; f < FRAMES; ++f)
+		{
+			char line[64];
+			int len = std::snprintf(line, sizeof(line), "FOOD LEFT %d   LAST FRAME %.2f MS", f % 1000, f * 0.01);
+			d->drawText(4, 12, std::string_view(line, len));
+			d->drawText(100, 100, "YOU WIN!!  PRESS SPACEBAR TO RESTART...");
+			d->flush();
+		}
+		d->sync();
+		ProtocolStats used = d->protocolTotals() - before;
+		printf("%-8s: %.2f us/frame, %.2f requests/frame, %.0f bytes/frame\n", backend, t.time() / 1e3 / FRAMES,
+		       static_cast<double>(used.requests) / FRAMES, static_cast<double>(used.bytes) / FRAMES);
+	}
+}
+
+
+// Per-tick snapshot and per-frame interpolation over 100k movers, at a few
+// frames per tick.  Positions go into a buffer sized once up front, as a
+// batched draw would take them.
+void runInterpolationBenchmark()
+{
+	const int COUNT = 100'000;
+	const int TICKS = 200;
+	const int C = CellGrid::CELL_SIZE;
+
+	std::vector<Character> movers(COUNT, Character(0xff0000, {0, 0}, {C, C}));
+	std::vector<Point> out(COUNT);
+	Rng rng(1);
+	for (auto &m: movers)
+		m.place({static_cast<int>(rng.uniform(400)) * C, static_cast<int>(rng.uniform(250)) * C});
+
+	for (int frames_per_tick: {1, 2, 4, 8})
+	{
+		double snapshot_ns = 0;
+		double lerp_ns = 0;
+		long checksum = 0;
+		for (int t = 0; t < TICKS; ++t)
+		{
+			Time snap;
+			for (auto &m: movers)
+				m.previous = m.position;
+			snapshot_ns += snap.time();
+
+			for (auto &m: movers)
+				m.position.x += (rng.next() & 1) ? C : -C;
+
+			for (int f = 0; f < frames_per_tick; ++f)
+			{
+				int alpha = (f + 1) * 65536 / frames_per_tick;
+				Time lerp;
+				for (std::size_t i = 0; i < movers.size(); ++i)
+					out[i] = interpolate(movers[i].previous, movers[i].position, alpha);
+				lerp_ns += lerp.time();
+				checksum += out[t % COUNT].x;
+			}
+		}
+
+		printf("%d frame(s)/tick: snapshot %.1f us/tick, interpolate %.1f us/frame per 100k movers (checksum %ld)\n",
+		       frames_per_tick, snapshot_ns / TICKS / 1e3, lerp_ns / (TICKS * frames_per_tick) / 1e3, checksum);
+	}
+}
+
+
+// Frame cost as the world grows from 1x to 1000x the window's area, with
+// food, walls and ghosts at a constant density and the camera in the middle.
+// Drawing every entity with an on-screen test is shown alongside drawing
+// only what the cell-range and bucket queries return.
+void runWorldBenchmark()
+{
+	const int C = CellGrid::CELL_SIZE;
+	const int W = GameDisplay::DEFAULT_WIDTH;
+	const int H = GameDisplay::DEFAULT_HEIGHT;
+	const int FRAMES = 20;
+	const Food food;
+	const Ghost ghost_template;
+
+	for (int scale: {1, 10, 100, 1000})
+	{
+		double side = std::sqrt(static_cast<double>(scale));
+		int cols = static_cast<int>(W * side) / C;
+		int rows = static_cast<int>(H * side) / C;
+
+		Rng rng(scale);
+		CellGrid food_grid, walls;
+		food_grid.reset(cols, rows);
+		walls.reset(cols, rows);
+		std::vector<Character> ghosts;
+		BucketGrid ghost_index;
+		ghost_index.reset(cols, rows);
+		for (int cy = 0; cy < rows; ++cy)
+			for (int cx = 0; cx < cols; ++cx)
+			{
+				std::uint64_t r = rng.uniform(100);
+				if (r < 10)
+					food_grid.set(cx, cy);
+				else if (r < 13)
+					walls.set(cx, cy);
+				else if (r < 14)
+					ghosts.push_back(Character(ghost_template.color, {cx * C, cy * C}, {C, C}));
+			}
+		ghost_index.build(ghosts.size(), [&](std::size_t i) { return ghosts[i].position; });
+
+		SoftwareDisplay d(W, H);
+		Point camera {(cols * C - W) / 2, (rows * C - H) / 2};
+		int v[4] = {camera.x / C - 1, (camera.x + W) / C + 1, camera.y / C - 1, (camera.y + H) / C + 1};
+		auto visible = [&](int x, int y) { return x > -C && y > -C && x < W && y < H; };
+
+		long drawn = 0;
+		Time all;
+		for (int f = 0; f < FRAMES; ++f)
+		{
+			d.clear();
+			auto cell = [&](unsigned long col) {
+				return [&, col](int cx, int cy) {
+					int x = cx * C - camera.x, y = cy * C - camera.y;
+					if (visible(x, y))
+						d.drawRect(col, x, y, C, C);
+				};
+			};
+			walls.forEach(cell(0x8a8f99));
+			food_grid.forEach(cell(food.color));
+			for (const Character &g: ghosts)
+				if (visible(g.position.x - camera.x, g.position.y - camera.y))
+					d.drawRect(g.color, g.position.x - camera.x, g.position.y - camera.y, C, C);
+		}
+		double all_ms = all.time() / 1e6 / FRAMES;
+
+		Time culled;
+		for (int f = 0; f < FRAMES; ++f)
+		{
+			d.clear();
+			drawn = 0;
+			auto cell = [&](unsigned long col) {
+				return [&, col](int cx, int cy) {
+					d.drawRect(col, cx * C - camera.x, cy * C - camera.y, C, C);
+					++drawn;
+				};
+			};
+			walls.forEachIn(v[0], v[2], v[1], v[3], cell(0x8a8f99));
+			food_grid.forEachIn(v[0], v[2], v[1], v[3], cell(food.color));
+			ghost_index.query(v[0], v[2], v[1], v[3], [&](std::size_t i) {
+				const Character &g = ghosts[i];
+				if (visible(g.position.x - camera.x, g.position.y - camera.y))
+				{
+					d.drawRect(g.color, g.position.x - camera.x, g.position.y - camera.y, C, C);
+					++drawn;
+				}
+			});
+		}
+		double culled_ms = culled.time() / 1e6 / FRAMES;
+
+		printf("%5dx (%5d x %4d cells, %7zu ghosts): draw all %8.3f ms/frame, culled %.3f ms/frame (%ld drawn)\n",
+		       scale, cols, rows, ghosts.size(), all_ms, culled_ms, drawn);
+	}
+}
+
+
+// Tick lateness with rendering on the simulation thread and on its own,
+// with the display made artificially slow.  Uses the software backend so
+// it runs anywhere; each case plays for two seconds.
+void runThreadBenchmark()
+{
+	const int delays[] = {0, 20, 50};
+	for (int delay: delays)
+	{
+		for (bool threaded: {false, true})
+		{
+			GameOptions options;
+			options.display_backend = "software";
+			options.ghost_count = 200;
+			options.render_hz = 60;
+			options.run_seconds = 2;
+			options.print_stats = false;
+			options.threaded = threaded;
+			options.render_delay_ms = delay;
+
+			Game g(options);
+			g.run();
+			const LatencyHistogram &late = g.stats().tick_lateness;
+			printf("%-9s render delay %2d ms: %5ld ticks, %5ld frames, tick lateness p50 %7.3f ms, p99 %7.3f ms\n",
+			       threaded ? "threaded" : "single", delay, late.count(), g.stats().renders,
+			       late.percentile(50), late.percentile(99));
+		}
+	}
+}
+
+
+// Ghost-versus-player collision per tick, testing every ghost against the
+// player as before and testing only the ghosts that moved.  Ghosts each move
+// every 250 ms, so about one in fifteen moves on any 60 Hz tick.
+void runCollisionBenchmark()
+{
+	const int C = CellGrid::CELL_SIZE;
+	const int TICKS = 60;
+
+	for (int count: {1'000, 10'000, 100'000, 1'000'000})
+	{
+		// About one cell in ten holds a ghost.
+		int side = static_cast<int>(std::sqrt(count * 10.0));
+		Rng rng(count);
+		std::vector<Character> ghosts;
+		OccupancyGrid cells;
+		cells.reset(side, side);
+		for (int i = 0; i < count; ++i)
+		{
+			Point p {static_cast<int>(rng.uniform(side)) * C, static_cast<int>(rng.uniform(side)) * C};
+			ghosts.push_back(Character(0xff0000, p, {C, C}));
+			cells.add(p.x / C, p.y / C);
+		}
+		Character player(0x6091ab, {side / 2 * C, side / 2 * C}, {C, C});
+
+		std::vector<std::uint32_t> moved;
+		long hits_all = 0, hits_moved = 0;
+		double all_ns = 0, moved_ns = 0, move_ns = 0;
+		for (int t = 0; t < TICKS; ++t)
+		{
+			Time mv;
+			moved.clear();
+			for (int i = t % 15; i < count; i += 15)
+			{
+				Character &g = ghosts[i];
+				Point from = g.position;
+				int d = static_cast<int>(rng.uniform(4));
+				g.position.x += d == 0 ? C : d == 1 ? -C : 0;
+				g.position.y += d == 2 ? C : d == 3 ? -C : 0;
+				cells.move(from, g.position);
+				moved.push_back(static_cast<std::uint32_t>(i));
+			}
+			move_ns += mv.time();
+
+			Time all;
+			hits_all += std::any_of(ghosts.begin(), ghosts.end(), [&](const Character &g) {
+				return rectangleIntersect(player.bounds(), g.bounds());
+			});
+			all_ns += all.time();
+
+			Time some;
+			hits_moved += std::any_of(moved.begin(), moved.end(), [&](std::uint32_t i) {
+				return rectangleIntersect(player.bounds(), ghosts[i].bounds());
+			});
+			moved_ns += some.time();
+		}
+
+		Time around;
+		long hits_around = 0;
+		for (int t = 0; t < TICKS; ++t)
+			hits_around += cells.anyAround(player.position.x / C + t % 3, player.position.y / C);
+		double around_ns = around.time();
+
+		printf("%8d ghosts, %6zu moving: all ghosts %9.1f us/tick, movers only %7.1f us/tick "
+		       "(+%7.1f us keeping the grid), player move %.2f us (hits %ld/%ld/%ld)\n",
+		       count, moved.size(), all_ns / 1e3 / TICKS, moved_ns / 1e3 / TICKS, move_ns / 1e3 / TICKS,
+		       around_ns / 1e3 / TICKS, hits_all, hits_moved, hits_around);
+	}
+}
+
+// Movers at 180 cells/s, tested against a player going just as fast: final
+// positions only, as rectangleIntersect did, against swept boxes, at 60 Hz
+// and with sub-steps up to 1 kHz.  Times are per simulated second; "hit"
+// counts the movers the player touched at some point in that second, which
+// the discrete test misses when they pass through each other.
+void runSweptBenchmark()
+{
+	const int C = CellGrid::CELL_SIZE;
+	const double SPEED = 180 * C;     // pixels per second
+	const Size S {C, C};
+
+	for (int count: {1'000, 100'000})
+	{
+		const int side = static_cast<int>(std::sqrt(count * 20.0)) * C;
+		for (int hz: {60, 240, 1000})
+		{
+			Rng rng(7);
+			struct Body { double x, y, vx, vy; Point from, to; };
+			std::vector<Body> bodies(count + 1);     // the last one is the player
+			for (Body &b: bodies)
+			{
+				double angle = rng.uniform(360) * M_PI / 180;
+				b.x = static_cast<double>(rng.uniform(side - C));
+				b.y = static_cast<double>(rng.uniform(side - C));
+				b.vx = SPEED * std::cos(angle) / hz;
+				b.vy = SPEED * std::sin(angle) / hz;
+			}
+
+			std::vector<char> discrete_hit(count), swept_hit(count);
+			double discrete_ns = 0, swept_ns = 0;
+			for (int t = 0; t < hz; ++t)
+			{
+				for (Body &b: bodies)
+				{
+					b.from = {static_cast<int>(b.x), static_cast<int>(b.y)};
+					b.x += b.vx;
+					b.y += b.vy;
+					if (b.x < 0 || b.x > side - C)
+						b.vx = -b.vx, b.x = std::clamp(b.x, 0.0, static_cast<double>(side - C));
+					if (b.y < 0 || b.y > side - C)
+						b.vy = -b.vy, b.y = std::clamp(b.y, 0.0, static_cast<double>(side - C));
+					b.to = {static_cast<int>(b.x), static_cast<int>(b.y)};
+				}
+				const Body &player = bodies.back();
+				Rect pr {player.to.x, player.to.y, C, C};
+
+				Time d;
+				for (int i = 0; i < count; ++i)
+					discrete_hit[i] |= rectangleIntersect(pr, {bodies[i].to.x, bodies[i].to.y, C, C});
+				discrete_ns += d.time();
+
+				Time sw;
+				for (int i = 0; i < count; ++i)
+					swept_hit[i] |= sweptContact(player.from, player.to, S, bodies[i].from, bodies[i].to, S) >= 0;
+				swept_ns += sw.time();
+			}
+
+			auto hits = [](const std::vector<char> &v) { return std::count(v.begin(), v.end(), 1); };
+			printf("%6d movers, %4d Hz: final positions %8.3f ms/s (%3ld hit), swept %8.3f ms/s (%3ld hit)\n",
+			       count, hz, discrete_ns / 1e6, hits(discrete_hit), swept_ns / 1e6, hits(swept_hit));
+		}
+	}
+}
+
+// Steps per second of VecEnv with random actions, from one instance to 4096,
+// on every hardware thread.
+void runVecEnvBenchmark()
+{
+	const long STEPS = 4'000'000;    // instance steps per measurement
+	unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+
+	for (std::size_t count = 1; count <= 4096; count *= 4)
+	{
+		VecEnvConfig config;
+		config.threads = threads;
+		VecEnv env(count, config);
+
+		std::vector<std::uint8_t> actions(count * 64);
+		Rng rng(count);
+		for (std::uint8_t &a: actions)
+			a = static_cast<std::uint8_t>(rng.uniform(ACTION_COUNT));
+		std::vector<float> rewards(count);
+		std::vector<std::uint8_t> dones(count);
+
+		long calls = std::max<long>(STEPS / static_cast<long>(count), 1);
+		long episodes = env.episodes();
+		Time t;
+		for (long c = 0; c < calls; ++c)
+			env.step(&actions[(c % 64) * count], rewards.data(), dones.data());
+		double secs = t.time() / 1e9;
+
+		printf("%5zu instances: %7.2f M steps/s, %8.0f calls/s, %ld episodes finished\n", count,
+		       calls * count / secs / 1e6, calls / secs, env.episodes() - episodes);
+	}
+}
+
+// Observation encoding: the bit expansion on its own against a plain loop,
+// then steps per second with no observations, an 84x84 window and the
+// whole level, checking the whole-level planes against the state first.
+void runObservationBenchmark()
+{
+	const int ROWS = 1'000'000;
+	std::vector<std::uint64_t> bits(ROWS);
+	Rng rng(7);
+	for (std::uint64_t &b: bits)
+		b = rng.next();
+	std::vector<std::uint8_t> out(64);
+	long sum = 0;
+
+	Time t;
+	for (std::uint64_t b: bits)
+	{
+		for (int i = 0; i < 64; ++i)
+			out[i] = (b >> i) & 1;
+		sum += out[b & 63];
+	}
+	double scalar_ns = static_cast<double>(t.time()) / ROWS;
+	Time t2;
+	for (std::uint64_t b: bits)
+	{
+		expandBits(b, out.data(), 64);
+		sum += out[b & 63];
+	}
+	double simd_ns = static_cast<double>(t2.time()) / ROWS;
+	printf("expand 64 bits: %.1f ns scalar, %.1f ns expandBits (%ld)\n", scalar_ns, simd_ns, sum);
+
+	VecEnvConfig config;
+	config.walls = true;
+	{
+		VecEnv env(4, config);
+		std::vector<std::uint8_t> obs(env.size() * env.observationBytes());
+		env.setObservations(obs.data(), config.cols, config.rows);
+		std::size_t plane = static_cast<std::size_t>(config.cols) * config.rows;
+		long walls = 0;
+		for (std::size_t i = 0; i < env.size(); ++i)
+		{
+			const std::uint8_t *o = &obs[i * env.observationBytes()];
+			for (std::size_t k = 0; k < plane; ++k)
+			{
+				walls += o[VecEnv::OBS_WALLS * plane + k];
+				if (o[VecEnv::OBS_WALLS * plane + k] + o[VecEnv::OBS_FOOD * plane + k] > 1)
+					throw std::runtime_error("observation has food inside a wall");
+			}
+			if (std::count(o + VecEnv::OBS_PLAYER * plane, o + (VecEnv::OBS_PLAYER + 1) * plane, 1) != 1)
+				throw std::runtime_error("observation doesn't have exactly one player");
+		}
+		printf("whole-level check: %ld wall cells in %zu instances\n", walls, env.size());
+	}
+
+	const std::size_t COUNT = 256;
+	const long STEPS = 1'000'000;
+	struct Size2 { int width, height; const char *name; };
+	const Size2 sizes[] = {{0, 0, "none"}, {84, 84, "84x84"}, {config.cols, config.rows, "whole level"}};
+	std::vector<unsigned> thread_counts {1};
+	if (std::thread::hardware_concurrency() > 1)
+		thread_counts.push_back(std::thread::hardware_concurrency());
+	for (unsigned threads: thread_counts)
+	{
+		config.threads = threads;
+		VecEnv env(COUNT, config);
+		std::vector<std::uint8_t> actions(COUNT * 64);
+		for (std::uint8_t &a: actions)
+			a = static_cast<std::uint8_t>(rng.uniform(ACTION_COUNT));
+		std::vector<float> rewards(COUNT);
+		std::vector<std::uint8_t> dones(COUNT);
+		std::vector<std::uint8_t> obs;
+
+		for (const Size2 &size: sizes)
+		{
+			if (size.width)
+			{
+				env.setObservations(nullptr, size.width, size.height);
+				obs.assign(COUNT * env.observationBytes(), 0);
+				env.setObservations(obs.data(), size.width, size.height);
+			}
+			else
+				env.setObservations(nullptr, config.cols, config.rows);
+
+			long calls = STEPS / static_cast<long>(COUNT);
+			Time t3;
+			for (long c = 0; c < calls; ++c)
+				env.step(&actions[(c % 64) * COUNT], rewards.data(), dones.data());
+			double secs = t3.time() / 1e9;
+			double steps = static_cast<double>(calls) * COUNT;
+			printf("%u thread%s, %-11s: %6.2f M steps/s, %7.1f ns/step, %6.2f GB/s of observations\n",
+			       threads, threads == 1 ? " " : "s", size.name, steps / secs / 1e6, secs * 1e9 / steps,
+			       size.width ? steps * env.observationBytes() / secs / 1e9 : 0.0);
+		}
+	}
+}
+
+// Snapshot and restore at a few level sizes, restoring back and forth
+// between states a second apart as a rollback would, then a replay check:
+// the game restored to a snapshot and run on again has to end up byte for
+// byte where it did the first time.
+void runSnapshotBenchmark()
+{
+	for (int count: {10, 1'000, 100'000})
+	{
+		GameOptions options;
+		options.display_backend = "software";
+		options.food_count = count;
+		options.ghost_count = count;
+		options.world_scale = std::max(1, count / 20);
+		options.print_stats = false;
+		Game g(options);
+		g.advance(60);
+
+		const int REPS = count >= 100'000 ? 20 : 2000;
+		SimState start, later;
+		g.snapshot(start);
+		Time t;
+		for (int r = 0; r < REPS; ++r)
+			g.snapshot(start);
+		double snapshot_ns = static_cast<double>(t.time()) / REPS;
+		g.advance(60);
+		g.snapshot(later);
+		Time t2;
+		for (int r = 0; r < REPS; ++r)
+			g.restore(r % 2 ? later : start);
+		double restore_ns = static_cast<double>(t2.time()) / REPS;
+		g.restore(start);
+
+		SimState first, second;
+		int ticks = g.advance(600);
+		g.snapshot(first);
+		g.restore(start);
+		g.advance(600);
+		g.snapshot(second);
+
+		printf("%6d food and ghosts: %8zu bytes, snapshot %9.0f ns, restore %9.0f ns, replay of %d ticks %s\n",
+		       count, start.bytes(), snapshot_ns, restore_ns, ticks, first == second ? "matches" : "DIFFERS");
+		if (first != second)
+			throw std::runtime_error("Replay from a snapshot diverged");
+	}
+}
+
+static double threadCpuSeconds()
+{
+	rusage usage;
+	getrusage(RUSAGE_THREAD, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// An idle game has to stay off the CPU and pick up where it left off.
+// Headless games are left unfocused or hidden for two seconds and the
+// thread's CPU time is held to 1% of the wall time.  Then a game is
+// unfocused for a second mid-run and has to match one that ran the same
+// ticks straight through, so no ghost timer moves while nothing ticks.
+void runIdleBenchmark()
+{
+	const double IDLE_SECONDS = 2, MAX_CPU_SHARE = 0.01;
+	GameOptions options;
+	options.display_backend = "software";
+	options.ghost_count = 1;
+	options.world_scale = 4;
+	options.print_stats = false;
+
+	XEvent unfocus = {};
+	unfocus.xfocus.type = FocusOut;
+	unfocus.xfocus.mode = NotifyNormal;
+	XEvent focus = unfocus;
+	focus.xfocus.type = FocusIn;
+	XEvent hide = {};
+	hide.xvisibility.type = VisibilityNotify;
+	hide.xvisibility.state = VisibilityFullyObscured;
+
+	for (const XEvent *ev: {&unfocus, &hide})
+	{
+		options.run_seconds = IDLE_SECONDS;
+		auto display = std::make_unique<SoftwareDisplay>(GameDisplay::DEFAULT_WIDTH, GameDisplay::DEFAULT_HEIGHT);
+		display->postEvent(*ev, 0);
+		Game g(options, std::move(display));
+
+		Time wall;
+		double cpu = threadCpuSeconds();
+		g.run();
+		double wall_s = wall.time() / 1e9;
+		cpu = threadCpuSeconds() - cpu;
+
+		printf("%-9s %.2f s idle: %.2f ms CPU, %.3f%% of the wall time\n",
+		       ev == &hide ? "hidden" : "unfocused", wall_s, cpu * 1e3, 100 * cpu / wall_s);
+		if (cpu > MAX_CPU_SHARE * wall_s)
+			throw std::runtime_error("An idle game kept the CPU busy");
+	}
+
+	// 0.5 s playing, 1 s unfocused, 0.5 s playing again.
+	options.run_seconds = 2;
+	auto display = std::make_unique<SoftwareDisplay>(GameDisplay::DEFAULT_WIDTH, GameDisplay::DEFAULT_HEIGHT);
+	display->postEvent(unfocus, 500'000'000);
+	display->postEvent(focus, 1'500'000'000);
+	Game g(options, std::move(display));
+	SimState before, after, straight;
+	g.snapshot(before);
+	g.run();
+	g.snapshot(after);
+
+	long ticks = static_cast<long>(after.header().tick - before.header().tick);
+	Game reference(options);
+	reference.restore(before);
+	reference.advance(static_cast<int>(ticks));
+	reference.snapshot(straight);
+
+	printf("unfocused for 1 s of a 2 s run: %ld ticks, replay straight through %s\n",
+	       ticks, after == straight ? "matches" : "DIFFERS");
+	// About a second's worth of ticks at sim_hz, not two.
+	if (ticks > options.sim_hz * 3 / 2)
+		throw std::runtime_error("The game kept ticking while unfocused");
+	if (after != straight)
+		throw std::runtime_error("Ghost timers jumped across an idle period");
+}
+
+// Save and load at a thousand and a million food and ghosts, then the
+// round trip: a game loaded into a fresh Game and run on has to match the
+// one that was saved and never stopped.  The load is timed as --load does
+// it, from opening the file to the Game being ready, with the decode alone
+// shown alongside.
+void runSaveBenchmark()
+{
+	const std::string path = std::string(P_tmpdir) + "/x11game-bench.sav";
+	for (int count: {1'000, 1'000'000})
+	{
+		GameOptions options;
+		options.display_backend = "software";
+		options.food_count = count / 2;
+		options.ghost_count = count / 2;
+		options.world_scale = std::max(1, count / 500);
+		options.print_stats = false;
+		SimState state, loaded, a, b;
+		int ticks;
+		double save_ms, decode_ms;
+		{
+			Game saved(options);
+			saved.advance(60);
+			saved.snapshot(state);
+			Time t;
+			SaveFile::write(state, path);
+			save_ms = t.time() / 1e6;
+			Time t2;
+			SaveFile::read(path, loaded);
+			decode_ms = t2.time() / 1e6;
+			if (loaded != state)
+				throw std::runtime_error("Loaded state differs from the one saved");
+
+			ticks = saved.advance(600);
+			saved.snapshot(a);
+		}   // waits for the level it was generating, so the load has the CPU to itself
+
+		GameOptions load_options = options;
+		load_options.load_path = path;
+		Time t3;
+		Game resumed(load_options);
+		double load_ms = t3.time() / 1e6;
+		resumed.advance(600);
+		resumed.snapshot(b);
+
+		FILE *f = std::fopen(path.c_str(), "rb");
+		std::fseek(f, 0, SEEK_END);
+		long file_bytes = std::ftell(f);
+		std::fclose(f);
+		printf("%7d entities: %9zu bytes in memory, %9ld on disk; save %7.2f ms, load %7.2f ms (decode %7.2f ms); "
+		       "%d ticks after loading %s\n", count, state.bytes(), file_bytes, save_ms, load_ms, decode_ms,
+		       ticks, a == b ? "match" : "DIFFER");
+		if (a != b)
+			throw std::runtime_error("Loaded game diverged from the saved one");
+	}
+	std::remove(path.c_str());
+}
+
+// A server thread and a fleet of clients on one machine, every client
+// holding a random direction that changes now and then and sending it
+// every tick.  The server's figures include the time the clients took to
+// join; the share of states that reached the clients is over the run only.
+// Over UDP: a Unix datagram socket queues only net.unix.max_dgram_qlen
+// datagrams (10 by default), which a few hundred clients overrun.
+void runServerBenchmark()
+{
+	const double SECONDS = 3;
+	const std::string address = "udp:47311";
+	for (int count: {50, 200, 500})
+	{
+		MatchConfig config;
+		config.cols = 160;
+		config.rows = 120;
+		config.food = 200;
+		config.ghosts = 40;
+		config.walls = true;
+		config.players = count;
+
+		MatchServer server(config, address);
+		std::atomic<bool> running {true};
+		std::thread serve([&] { server.run(running, 0); });
+
+		// Everyone joins at once, and those already in read and acknowledge
+		// every tick.  Datagrams queued for a Unix socket count against the
+		// sender's buffer, so clients sitting on unread full states would
+		// soon leave the server unable to answer the rest.
+		const long period_ns = 1'000'000'000L / config.sim_hz;
+		std::vector<std::unique_ptr<MatchClient>> clients;
+		for (int i = 0; i < count; ++i)
+			clients.push_back(std::make_unique<MatchClient>(address));
+		Time joining;
+		for (int joined = 0; joined < count;)
+		{
+			joined = 0;
+			for (auto &c: clients)
+			{
+				if (c->tryJoin())
+				{
+					c->sendInput(ACTION_NONE);
+					++joined;
+				}
+			}
+			if (joining.time() > 5'000'000'000L)
+				throw std::runtime_error("Not every client got in");
+			std::this_thread::sleep_for(std::chrono::nanoseconds(period_ns));
+		}
+
+		std::vector<std::uint8_t> actions(count, ACTION_NONE);
+		std::vector<std::uint64_t> first_tick(count, 0);
+		std::vector<long> first_states(count, 0);
+		Rng rng(1);
+		Time t;
+		long next_ns = 0;
+		for (bool first = true; t.time() < SECONDS * 1e9; first = false)
+		{
+			for (int i = 0; i < count; ++i)
+			{
+				MatchClient &c = *clients[i];
+				c.receive();
+				if (first)
+				{
+					first_tick[i] = c.tick();
+					first_states[i] = c.states();
+				}
+				if (rng.uniform(30) == 0)
+					actions[i] = static_cast<std::uint8_t>(rng.uniform(ACTION_COUNT));
+				c.sendInput(actions[i]);
+			}
+			next_ns += period_ns;
+			long wait_ns = next_ns - t.time();
+			if (wait_ns > 0)
+				std::this_thread::sleep_for(std::chrono::nanoseconds(wait_ns));
+		}
+
+		long got = 0;
+		long expected = 0;
+		long bytes = 0;
+		for (int i = 0; i < count; ++i)
+		{
+			clients[i]->receive();
+			got += clients[i]->states() - first_states[i];
+			expected += static_cast<long>(clients[i]->tick() - first_tick[i]);
+			bytes += clients[i]->bytesIn();
+		}
+		clients.clear();
+		running = false;
+		serve.join();
+
+		const MatchServer::Stats &s = server.stats();
+		printf("%3d clients: tick p50 %.1f ms, p99 %.1f ms, max %.2f ms; %ld of %ld ticks missed; "
+		       "%.0f bytes a state, %ld sent whole; clients got %.1f%% of states, %.0f kB/s each\n",
+		       count, s.tick_ms.percentile(50), s.tick_ms.percentile(99), s.tick_ms.percentile(100),
+		       s.missed_ticks, s.ticks + s.missed_ticks,
+		       s.states_sent ? static_cast<double>(s.bytes_out) / s.states_sent : 0.0, s.full_states,
+		       expected ? 100.0 * got / expected : 0.0, bytes / 1e3 / count / t.time() * 1e9);
+	}
+}
+
+// Matches per core: hosts ever more matches the size of the default game
+// (10 food, 10 ghosts, one bot player each) until over 1% of shard ticks
+// finish late.  Tried with one shard, a shard per core, and twice that,
+// where shards lose their core part way through ticks and the rest steal
+// their work.
+void runHostBenchmark()
+{
+	const double SECONDS = 2;
+	unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<unsigned> shard_counts {1};
+	if (hw > 1)
+		shard_counts.push_back(hw);
+	shard_counts.push_back(2 * hw);
+
+	for (unsigned shards: shard_counts)
+	{
+		unsigned cores = std::min(shards, hw);
+		int best = 0;
+		for (int matches = 1000; matches <= 512'000; matches *= 2)
+		{
+			MatchHostConfig config;
+			config.match.players = 1;
+			config.matches = matches;
+			config.shards = shards;
+			MatchHost host(config);
+			host.run(SECONDS);
+
+			MatchHost::Stats s = host.stats();
+			double late = 100.0 * s.late_ticks / std::max(s.ticks, 1L);
+			printf("%2u shard%s, %6d matches (%6.0f a core, %5.1f MB): %5.2f us a step, %5.1f%% busy, "
+			       "%5.2f%% of ticks late, finish p99 %5.1f ms, %ld of %ld chunks stolen, %ld matches replaced\n",
+			       shards, shards == 1 ? " " : "s", matches, static_cast<double>(matches) / cores,
+			       matches * host.blockBytes() / 1e6, s.match_steps ? s.busy_s / s.match_steps * 1e6 : 0.0,
+			       100.0 * s.busy_s / (SECONDS * cores), late, s.finish_ms.percentile(99), s.stolen_chunks, s.chunks,
+			       s.matches_started - matches);
+			if (late > 1)
+				break;
+			best = matches;
+		}
+		printf("  %u shard%s: %d matches a core with at most 1%% of ticks late\n",
+		       shards, shards == 1 ? "" : "s", best / static_cast<int>(cores));
+	}
+}
+
+// What the job pool costs per task, on graphs of empty tasks that are all
+// independent and that form one long chain, then the game's tick graph with
+// enough food and ghosts that its collision checks are worth splitting.
+void runJobBenchmark()
+{
+	const int TASKS = 1000;
+	const int RUNS = 200;
+	unsigned hw = std::max(2u, std::thread::hardware_concurrency());
+
+	for (unsigned threads: {0u, 1u, 2u, 4u, hw})
+	{
+		std::unique_ptr<JobPool> pool;
+		if (threads > 0)
+			pool = std::make_unique<JobPool>(threads);
+
+		TaskGraph fan("fan");
+		TaskGraph chain("chain");
+		std::atomic<long> sink {0};
+		for (int i = 0; i < TASKS; ++i)
+		{
+			auto empty = [&] { sink.fetch_add(1, std::memory_order_relaxed); };
+			fan.add("empty", empty);
+			if (i == 0)
+				chain.add("empty", empty);
+			else
+				chain.add("empty", empty, {i - 1});
+		}
+
+		auto perTask = [&](TaskGraph &g) {
+			Time t;
+			for (int r = 0; r < RUNS; ++r)
+				g.run(pool.get());
+			return static_cast<double>(t.time()) / RUNS / TASKS;
+		};
+		double fan_ns = perTask(fan);
+		double chain_ns = perTask(chain);
+		printf("%-8s: %5.0f ns/task independent, %5.0f ns/task chained\n",
+		       threads ? (std::to_string(threads) + " thr").c_str() : "serial", fan_ns, chain_ns);
+	}
+
+	for (int jobs: {0, static_cast<int>(hw)})
+	{
+		GameOptions options;
+		options.display_backend = "software";
+		options.world_scale = 100;
+		options.food_count = 20'000;
+		options.ghost_count = 20'000;
+		options.run_seconds = 2;
+		options.print_stats = false;
+		options.jobs = jobs;
+
+		Game g(options);
+		g.run();
+		const TaskGraph &tick = g.tickGraph();
+		printf("tick graph, %s: %ld ticks, %.1f us/tick\n",
+		       jobs ? (std::to_string(jobs) + " threads").c_str() : "serial", tick.runs(), tick.meanWallUs());
+	}
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+	mygame::GameOptions options;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--food-grid")
+			options.use_food_grid = true;
+		else if (arg == "--legacy-input")
+			options.legacy_input = true;
+		else if (arg == "--rt-budget" && i + 1 < argc)
+			options.round_trip_budget = std::atoi(argv[++i]);
+		else if (arg == "--display-backend" && i + 1 < argc)
+			options.display_backend = argv[++i];
+		else if (arg == "--bench-display" && i + 1 < argc)
+		{
+			mygame::runDisplayBenchmark(std::atoi(argv[++i]));
+			return 0;
+		}
+		else if (arg == "--synthetic-input" && i + 1 < argc)
+			options.synthetic_inputs = std::atoi(argv[++i]);
+		else if (arg == "--walls")
+			options.walls = true;
+		else if (arg == "--food" && i + 1 < argc)
+			options.food_count = std::atoi(argv[++i]);
+		else if (arg == "--ghosts" && i + 1 < argc)
+			options.ghost_count = std::atoi(argv[++i]);
+		else if (arg == "--sprites")
+			options.sprites = true;
+		else if (arg == "--atlas" && i + 1 < argc)
+		{
+			options.sprites = true;
+			options.atlas_path = argv[++i];
+		}
+		else if (arg == "--save-atlas" && i + 1 < argc)
+		{
+			mygame::SpriteAtlas::makeDefault().save(argv[++i]);
+			return 0;
+		}
+		else if (arg == "--bench-sprites")
+		{
+			mygame::runSpriteBenchmark();
+			return 0;
+		}
+		else if (arg == "--world" && i + 1 < argc)
+			options.world_scale = std::atoi(argv[++i]);
+		else if (arg == "--bench-world")
+		{
+			mygame::runWorldBenchmark();
+			return 0;
+		}
+		else if (arg == "--render-hz" && i + 1 < argc)
+			options.render_hz = std::atoi(argv[++i]);
+		else if (arg == "--threaded")
+			options.threaded = true;
+		else if (arg == "--render-delay" && i + 1 < argc)
+			options.render_delay_ms = std::atoi(argv[++i]);
+		else if (arg == "--run-seconds" && i + 1 < argc)
+			options.run_seconds = std::atof(argv[++i]);
+		else if (arg == "--bench-threads")
+		{
+			mygame::runThreadBenchmark();
+			return 0;
+		}
+		else if (arg == "--jobs" && i + 1 < argc)
+			options.jobs = std::atoi(argv[++i]);
+		else if (arg == "--dump-tasks" && i + 1 < argc)
+			options.task_dot_path = argv[++i];
+		else if (arg == "--bench-collision")
+		{
+			mygame::runCollisionBenchmark();
+			return 0;
+		}
+		else if (arg == "--sim-hz" && i + 1 < argc)
+		{
+			options.sim_hz = std::atoi(argv[++i]);
+			if (options.sim_hz < 1 || options.sim_hz > 1000)
+			{
+				fprintf(stderr, "--sim-hz must be between 1 and 1000\n");
+				return 1;
+			}
+		}
+		else if (arg == "--player-speed" && i + 1 < argc)
+			options.player_speed = std::atof(argv[++i]);
+		else if (arg == "--ghost-step" && i + 1 < argc)
+			options.ghost_step = std::max(1, std::atoi(argv[++i]));
+		else if (arg == "--rewind" && i + 1 < argc)
+			options.rewind_ticks = std::max(0, std::atoi(argv[++i]));
+		else if (arg == "--load" && i + 1 < argc)
+			options.load_path = argv[++i];
+		else if (arg == "--save" && i + 1 < argc)
+			options.save_path = argv[++i];
+		else if (arg == "--server" && i + 1 < argc)
+			options.server_address = argv[++i];
+		else if (arg == "--connect" && i + 1 < argc)
+			options.connect_address = argv[++i];
+		else if (arg == "--players" && i + 1 < argc)
+			options.players = std::max(1, std::atoi(argv[++i]));
+		else if (arg == "--bot" && i + 1 < argc)
+			options.bot = argv[++i];
+		else if (arg == "--bot-games" && i + 1 < argc)
+			options.bot_games = std::max(0, std::atoi(argv[++i]));
+		else if (arg == "--bench-host")
+		{
+			mygame::runHostBenchmark();
+			return 0;
+		}
+		else if (arg == "--bench-server")
+		{
+			mygame::runServerBenchmark();
+			return 0;
+		}
+		else if (arg == "--bench-idle")
+		{
+			mygame::runIdleBenchmark();
+			return 0;
+		}
+		else if (arg == "--bench-save")
+		{
+			mygame::runSaveBenchmark();
+			return 0;
+		}
+		else if (arg == "--bench-snapshot")
+		{
+			mygame::runSnapshotBenchmark();
+			return 0;
+		}
+		else if (arg == "--bench-swept")
+		{
+			mygame::runSweptBenchmark();
+			return 0;
+		}
+		else if (arg == "--bench-vecenv")
+		{
+			mygame::runVecEnvBenchmark();
+			return 0;
+		}
+		else if (arg == "--bench-obs")
+		{
+			mygame::runObservationBenchmark();
+			return 0;
+		}
+		else if (arg == "--bench-jobs")
+		{
+			mygame::runJobBenchmark();
+			return 0;
+		}
+		else if (arg == "--bench-interp")
+		{
+			mygame::runInterpolationBenchmark();
+			return 0;
+		}
+		else if (arg == "--bench-text")
+		{
+			mygame::runTextBenchmark();
+			return 0;
+		}
+		else if (arg == "--bench-static")
+		{
+			mygame::runStaticLayerBenchmark();
+			return 0;
+		}
+		else if (arg == "--bench-spawn")
+		{
+			mygame::runSpawnBenchmark();
+			return 0;
+		}
+		else if (arg == "--bench-food")
+		{
+			mygame::runFoodBenchmark();
+			return 0;
+		}
+		else
+		{
+			fprintf(stderr, "Unknown option: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+#ifndef HAVE_XTEST
+	if (options.synthetic_inputs > 0 && options.display_backend != "software")
+	{
+		fprintf(stderr, "--synthetic-input needs the XTEST extension, which this build lacks, or the software backend\n");
+		return 1;
+	}
+#endif
+	if (options.threaded && options.synthetic_inputs > 0)
+	{
+		fprintf(stderr, "--synthetic-input and --threaded can't be used together\n");
+		return 1;
+	}
+
+	if (!options.server_address.empty())
+		return mygame::runServer(options);
+
+	mygame::Game g(options);
+
+	return g.run();
 }
@@ -0,0 +1,415 @@
+/* 	x11game -- Demonstrates how to make a simple game in C++ using X11.
+
+    Copyright (C) 2022 Punched Tape Media
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdexcept>
+#include <cstring>
+#include <string>
+
+#include "vecenv.h"
+#include "x11game_env.h"
+
+namespace mygame {
+
+std::vector<Point> generateCells(int cols, int rows, bool walls, std::size_t spawns, Rng &rng, CellGrid &wall_grid)
+{
+	const int SPAWN_CLEAR = 4;
+	const Point spawn {PLAYER_SPAWN.x / CellGrid::CELL_SIZE, PLAYER_SPAWN.y / CellGrid::CELL_SIZE};
+
+	wall_grid.reset(cols, rows);
+	if (walls)
+	{
+		int segments = cols * rows / 400;
+		for (int s = 0; s < segments; ++s)
+		{
+			int len = 4 + rng.uniform(9);
+			bool horizontal = rng.uniform(2) == 0;
+			int x = rng.uniform(cols);
+			int y = rng.uniform(rows);
+			for (int k = 0; k < len; ++k)
+			{
+				int cx = horizontal ? x + k : x;
+				int cy = horizontal ? y : y + k;
+				if (wall_grid.inGrid(cx, cy) && (std::abs(cx - spawn.x) > 2 || std::abs(cy - spawn.y) > 2))
+					wall_grid.set(cx, cy);
+			}
+		}
+	}
+
+	SpawnRules rules;
+	rules.cols = cols;
+	rules.rows = rows;
+	rules.min_separation = 2;
+	rules.walls = &wall_grid;
+	rules.threads = 1;
+	rules.exclusions.push_back({spawn.x - SPAWN_CLEAR, spawn.y - SPAWN_CLEAR, 2 * SPAWN_CLEAR + 1, 2 * SPAWN_CLEAR + 1});
+	return SpawnPlacer().place(rules, spawns, rng.next());
+}
+
+VecEnv::VecEnv(std::size_t count, const VecEnvConfig &config)
+: config_(config), count_(count), words_per_row_((config.cols + 63) / 64),
+  grid_words_(static_cast<std::size_t>(words_per_row_) * config.rows),
+  obs_width_(config.cols), obs_height_(config.rows)
+{
+	if (count == 0 || config.cols < 10 || config.rows < 10)
+		throw std::runtime_error("VecEnv needs at least one instance of at least 10x10 cells");
+	// Ghost timers are 16 bits.
+	if (config.ghost_period < 1 || config.ghost_period > 65535)
+		throw std::runtime_error("VecEnv ghost period must be 1 to 65535 steps");
+
+	player_x_.resize(count);
+	player_y_.resize(count);
+	food_left_.resize(count);
+	steps_.resize(count);
+	episodes_.assign(count, 0);
+	rng_.resize(count);
+	ghost_x_.resize(count * config.ghosts);
+	ghost_y_.resize(count * config.ghosts);
+	ghost_timer_.resize(count * config.ghosts);
+	walls_.resize(count * grid_words_);
+	food_.resize(count * grid_words_);
+
+	unsigned threads = config.threads ? config.threads : std::max(1u, std::thread::hardware_concurrency());
+	std::size_t ranges = std::min<std::size_t>(threads, count);
+	if (ranges > 1)
+		pool_ = std::make_unique<JobPool>(static_cast<unsigned>(ranges));
+	scratch_.resize(ranges);
+	for (std::size_t r = 0; r < ranges; ++r)
+	{
+		std::size_t from = count * r / ranges;
+		std::size_t to = count * (r + 1) / ranges;
+		graph_.add("instances", [this, from, to, r] { stepRange(from, to, scratch_[r]); });
+	}
+
+	reset();
+}
+
+long VecEnv::episodes() const
+{
+	long n = 0;
+	for (std::uint32_t e: episodes_)
+		n += e;
+	return n;
+}
+
+void VecEnv::reset()
+{
+	for (std::size_t i = 0; i < count_; ++i)
+		resetInstance(i, scratch_[0]);
+}
+
+void VecEnv::setObservations(std::uint8_t *buffer, int width, int height)
+{
+	if (width < 1 || height < 1 || width > 4096 || height > 4096)
+		throw std::runtime_error("VecEnv observations must be 1 to 4096 cells on a side");
+
+	obs_ = buffer;
+	obs_width_ = width;
+	obs_height_ = height;
+	if (obs_)
+		for (std::size_t i = 0; i < count_; ++i)
+			observe(i, obs_ + i * observationBytes());
+}
+
+// The 64 cells of a row starting at column cx, which may be off either
+// end; cells beyond the level read as outside.
+std::uint64_t VecEnv::rowBits(const std::uint64_t *row, int cx, bool outside) const
+{
+	auto word = [&](int w) {
+		if (w < 0 || w >= words_per_row_)
+			return outside ? ~std::uint64_t(0) : 0;
+		std::uint64_t bits = row[w];
+		int valid = config_.cols - w * 64;
+		if (outside && valid < 64)
+			bits |= ~std::uint64_t(0) << valid;
+		return bits;
+	};
+
+	int w = cx >= 0 ? cx / 64 : -((63 - cx) / 64);
+	int shift = cx - w * 64;
+	if (shift == 0)
+		return word(w);
+	return (word(w) >> shift) | (word(w + 1) << (64 - shift));
+}
+
+void VecEnv::observe(std::size_t i, std::uint8_t *out) const
+{
+	const int W = obs_width_;
+	const int H = obs_height_;
+	const std::size_t plane = static_cast<std::size_t>(W) * H;
+	const bool whole = W == config_.cols && H == config_.rows;
+	const int x0 = whole ? 0 : player_x_[i] - W / 2;
+	const int y0 = whole ? 0 : player_y_[i] - H / 2;
+
+	// Walls and food are bitsets, so rows expand 64 cells at a time.
+	std::uint8_t *walls = out + OBS_WALLS * plane;
+	std::uint8_t *food = out + OBS_FOOD * plane;
+	for (int r = 0; r < H; ++r)
+	{
+		int cy = y0 + r;
+		if (cy < 0 || cy >= config_.rows)
+		{
+			std::memset(walls + r * W, 1, W);
+			std::memset(food + r * W, 0, W);
+			continue;
+		}
+		std::size_t at = i * grid_words_ + static_cast<std::size_t>(cy) * words_per_row_;
+		for (int c = 0; c < W; c += 64)
+		{
+			int n = std::min(64, W - c);
+			expandBits(rowBits(&walls_[at], x0 + c, true), walls + r * W + c, n);
+			expandBits(rowBits(&food_[at], x0 + c, false), food + r * W + c, n);
+		}
+	}
+
+	// Ghosts and the player are points.
+	std::uint8_t *ghosts = out + OBS_GHOSTS * plane;
+	std::uint8_t *player = out + OBS_PLAYER * plane;
+	std::memset(ghosts, 0, 2 * plane);
+	for (std::size_t g = i * config_.ghosts; g < (i + 1) * config_.ghosts; ++g)
+	{
+		int x = ghost_x_[g] - x0;
+		int y = ghost_y_[g] - y0;
+		if (x >= 0 && y >= 0 && x < W && y < H)
+			ghosts[static_cast<std::size_t>(y) * W + x] = 1;
+	}
+	int px = player_x_[i] - x0;
+	int py = player_y_[i] - y0;
+	if (px >= 0 && py >= 0 && px < W && py < H)
+		player[static_cast<std::size_t>(py) * W + px] = 1;
+}
+
+void VecEnv::step(const std::uint8_t *actions, float *rewards, std::uint8_t *dones)
+{
+	actions_ = actions;
+	rewards_ = rewards;
+	dones_ = dones;
+	graph_.run(pool_.get());
+}
+
+// A fresh level, generated as Game::createLevel does.
+void VecEnv::resetInstance(std::size_t i, CellGrid &walls)
+{
+	const Point spawn {PLAYER_SPAWN.x / CellGrid::CELL_SIZE, PLAYER_SPAWN.y / CellGrid::CELL_SIZE};
+	Rng rng(config_.seed ^ (0x9e3779b97f4a7c15ull * (i + 1)) ^ (std::uint64_t(++episodes_[i]) << 40));
+
+	std::vector<Point> spawns = generateCells(config_.cols, config_.rows, config_.walls,
+	                                          config_.food + config_.ghosts, rng, walls);
+	std::copy_n(walls.words(), grid_words_, walls_.begin() + i * grid_words_);
+
+	// Food first, as in the game; ghosts that found no room wait off the grid.
+	std::uint64_t *food = &food_[i * grid_words_];
+	std::fill_n(food, grid_words_, 0);
+	std::size_t n_food = std::min<std::size_t>(config_.food, spawns.size());
+	for (std::size_t k = 0; k < n_food; ++k)
+		food[static_cast<std::size_t>(spawns[k].y) * words_per_row_ + (spawns[k].x >> 6)] |= std::uint64_t(1) << (spawns[k].x & 63);
+	for (int g = 0; g < config_.ghosts; ++g)
+	{
+		std::size_t k = n_food + g;
+		std::size_t gi = i * config_.ghosts + g;
+		ghost_x_[gi] = k < spawns.size() ? static_cast<std::int16_t>(spawns[k].x) : -100;
+		ghost_y_[gi] = k < spawns.size() ? static_cast<std::int16_t>(spawns[k].y) : -100;
+		ghost_timer_[gi] = static_cast<std::uint16_t>(config_.ghost_period);
+	}
+
+	player_x_[i] = static_cast<std::int16_t>(spawn.x);
+	player_y_[i] = static_cast<std::int16_t>(spawn.y);
+	food_left_[i] = static_cast<std::uint32_t>(n_food);
+	steps_[i] = 0;
+	rng_[i] = rng.next();
+
+	if (obs_)
+		observe(i, obs_ + i * observationBytes());
+}
+
+void VecEnv::stepRange(std::size_t from, std::size_t to, CellGrid &scratch)
+{
+	static const int DX[ACTION_COUNT] = {0, 0, 0, -1, 1};
+	static const int DY[ACTION_COUNT] = {0, -1, 1, 0, 0};
+	const int G = config_.ghosts;
+
+	for (std::size_t i = from; i < to; ++i)
+	{
+		int a = actions_[i] < ACTION_COUNT ? actions_[i] : 0;
+		int x = player_x_[i] + DX[a];
+		int y = player_y_[i] + DY[a];
+		if (blocked(i, x, y))
+		{
+			x = player_x_[i];
+			y = player_y_[i];
+		}
+		player_x_[i] = static_cast<std::int16_t>(x);
+		player_y_[i] = static_cast<std::int16_t>(y);
+
+		float reward = 0;
+		std::uint64_t &food = food_[i * grid_words_ + static_cast<std::size_t>(y) * words_per_row_ + (x >> 6)];
+		std::uint64_t bit = std::uint64_t(1) << (x & 63);
+		if (food & bit)
+		{
+			food &= ~bit;
+			--food_left_[i];
+			reward += 1;
+		}
+
+		Rng rng(rng_[i]);
+		bool hit = false;
+		for (std::size_t g = i * G; g < (i + 1) * G; ++g)
+		{
+			if (--ghost_timer_[g] == 0)
+			{
+				ghost_timer_[g] = static_cast<std::uint16_t>(config_.ghost_period);
+				int d = 1 + rng.uniform(4);
+				int gx = ghost_x_[g] + DX[d];
+				int gy = ghost_y_[g] + DY[d];
+				if (ghost_x_[g] >= 0 && !blocked(i, gx, gy))
+				{
+					ghost_x_[g] = static_cast<std::int16_t>(gx);
+					ghost_y_[g] = static_cast<std::int16_t>(gy);
+				}
+			}
+			// Everything moves one cell at most and touching counts, so two
+			// movers can't pass through each other unseen.
+			hit |= std::abs(ghost_x_[g] - x) <= 1 && std::abs(ghost_y_[g] - y) <= 1;
+		}
+		rng_[i] = rng.state;
+
+		bool done = true;
+		if (hit)
+			reward -= 10;
+		else if (food_left_[i] == 0)
+			reward += 10;
+		else
+			done = ++steps_[i] >= static_cast<std::uint32_t>(config_.max_steps);
+
+		rewards_[i] = reward;
+		dones_[i] = done;
+		if (done)
+			resetInstance(i, scratch);
+		else if (obs_)
+			observe(i, obs_ + i * observationBytes());
+	}
+}
+
+}
+
+// The C interface in x11game_env.h.  Errors are kept per thread for
+// x11game_env_last_error(), since exceptions can't cross into C.
+
+struct x11game_env {
+	// VecEnv's tasks point back at it, so it is built in place.
+	x11game_env(std::size_t count, const mygame::VecEnvConfig &config) : env(count, config) {}
+	mygame::VecEnv env;
+};
+
+static_assert(int(X11GAME_ACTION_RIGHT) == int(mygame::ACTION_RIGHT) && X11GAME_ENV_CHANNELS == mygame::VecEnv::OBS_CHANNELS,
+              "x11game_env.h is out of step with VecEnv");
+
+namespace {
+
+thread_local std::string env_error;
+
+template <typename F>
+auto catchToC(F &&f, decltype(f()) failed) -> decltype(f())
+{
+	try
+	{
+		return f();
+	}
+	catch (std::exception &e)
+	{
+		env_error = e.what();
+		return failed;
+	}
+}
+
+}
+
+extern "C" {
+
+void x11game_env_default_config(x11game_env_config *config)
+{
+	mygame::VecEnvConfig defaults;
+	config->cols = defaults.cols;
+	config->rows = defaults.rows;
+	config->food = defaults.food;
+	config->ghosts = defaults.ghosts;
+	config->walls = defaults.walls;
+	config->ghost_period = defaults.ghost_period;
+	config->max_steps = defaults.max_steps;
+	config->threads = defaults.threads;
+	config->seed = defaults.seed;
+}
+
+x11game_env *x11game_env_create(size_t count, const x11game_env_config *config)
+{
+	return catchToC([&] {
+		mygame::VecEnvConfig c;
+		c.cols = config->cols;
+		c.rows = config->rows;
+		c.food = config->food;
+		c.ghosts = config->ghosts;
+		c.walls = config->walls != 0;
+		c.ghost_period = config->ghost_period;
+		c.max_steps = config->max_steps;
+		c.threads = config->threads;
+		c.seed = config->seed;
+		if (c.cols > 4096 || c.rows > 4096 || c.food < 0 || c.ghosts < 0 || c.ghost_period < 1 || c.ghost_period > 65535
+		    || c.max_steps < 1)
+			throw std::runtime_error("x11game_env_config is out of range");
+		return new x11game_env(count, c);
+	}, static_cast<x11game_env *>(nullptr));
+}
+
+void x11game_env_destroy(x11game_env *env)
+{
+	delete env;
+}
+
+const char *x11game_env_last_error(void)
+{
+	return env_error.c_str();
+}
+
+size_t x11game_env_size(const x11game_env *env)
+{
+	return env->env.size();
+}
+
+int x11game_env_set_observations(x11game_env *env, uint8_t *buffer, int width, int height)
+{
+	return catchToC([&] {
+		const mygame::VecEnvConfig &c = env->env.config();
+		env->env.setObservations(buffer, width ? width : c.cols, height ? height : c.rows);
+		return 0;
+	}, -1);
+}
+
+size_t x11game_env_observation_bytes(const x11game_env *env)
+{
+	return env->env.observationBytes();
+}
+
+void x11game_env_reset(x11game_env *env)
+{
+	env->env.reset();
+}
+
+void x11game_env_step(x11game_env *env, const uint8_t *actions, float *rewards, uint8_t *dones)
+{
+	env->env.step(actions, rewards, dones);
+}
+
+}
@@ -0,0 +1,166 @@
+/* 	x11game -- Demonstrates how to make a simple game in C++ using X11.
+
+    Copyright (C) 2022 Punched Tape Media
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* VecEnv, the batched headless games behind x11game_env.h, and the level
+   generation it shares with the game's Match.  Nothing here needs X, so
+   libx11game_env is built from vecenv.cpp alone.
+*/
+#ifndef X11GAME_VECENV_H
+#define X11GAME_VECENV_H
+
+#include "core.h"
+
+#include <memory>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace mygame {
+
+// Moves in the cell-level simulations (VecEnv, Match).
+enum VecAction : std::uint8_t { ACTION_NONE, ACTION_UP, ACTION_DOWN, ACTION_LEFT, ACTION_RIGHT, ACTION_COUNT };
+
+// Walls and spawn cells for a cols x rows level, laid out as
+// Game::createLevel does: a few wall segments clear of the player's spawn,
+// then up to `spawns` cells at least two apart and away from the spawn.
+// For the cell-level simulations, which generate many levels.
+std::vector<Point> generateCells(int cols, int rows, bool walls, std::size_t spawns, Rng &rng, CellGrid &wall_grid);
+
+// Rules for VecEnv.  Sizes are in cells; the defaults match the game's
+// window and a 60 Hz tick.
+struct VecEnvConfig {
+	int cols = WINDOW_WIDTH / CellGrid::CELL_SIZE;
+	int rows = WINDOW_HEIGHT / CellGrid::CELL_SIZE;
+	int food = 10;
+	int ghosts = 10;
+	bool walls = false;
+	int ghost_period = 15;        // steps between ghost moves, up to 65535: 250 ms at 60 Hz
+	int max_steps = 2000;         // episodes are cut off after this many
+	unsigned threads = 0;         // 0 = one per hardware thread
+	std::uint64_t seed = 1;
+};
+
+// Writes the low n (up to 64) bits of bits as n bytes of 0 or 1.  Sixteen
+// at a time with SSE2: each half of the register holds one byte of bits
+// repeated, and testing it against 1, 2, 4 ... 128 picks out one bit per byte.
+inline void expandBits(std::uint64_t bits, std::uint8_t *out, int n)
+{
+	int i = 0;
+#ifdef __SSE2__
+	const __m128i select = _mm_set_epi8(-128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1);
+	const __m128i one = _mm_set1_epi8(1);
+	const std::uint64_t SPREAD = 0x0101010101010101ull;
+
+	for (; i + 16 <= n; i += 16)
+	{
+		std::uint64_t lo = (bits >> i) & 0xff;
+		std::uint64_t hi = (bits >> (i + 8)) & 0xff;
+		__m128i v = _mm_set_epi64x(static_cast<long long>(hi * SPREAD), static_cast<long long>(lo * SPREAD));
+		v = _mm_cmpeq_epi8(_mm_and_si128(v, select), select);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_and_si128(v, one));
+	}
+#endif
+	for (; i < n; ++i)
+		out[i] = (bits >> i) & 1;
+}
+
+// Many independent headless games stepped together, for training bots.  One
+// step is one tick: the player moves one cell, ghosts move on their timers,
+// and collisions follow the game's rules (touching a ghost, including
+// diagonally, loses).  Rewards are +1 per food, +10 for clearing the level
+// and -10 for a ghost.  Instances that finish are reset before step()
+// returns, from a seed made of the base seed, the instance and its episode
+// count, so every run is reproducible.
+//
+// State is held as one array per field with instances side by side (ghosts
+// instance-major), and the walls and food of each instance are a CellGrid
+// word layout at a fixed stride.  Instances are split into one contiguous
+// range per thread and stepped as a TaskGraph on a JobPool.
+class VecEnv {
+public:
+	VecEnv(std::size_t count, const VecEnvConfig &config);
+
+	std::size_t size() const { return count_; }
+	const VecEnvConfig &config() const { return config_; }
+	long episodes() const;
+
+	// Resets every instance.
+	void reset();
+
+	// actions[i] is a VecAction for instance i; rewards[i] and dones[i] are
+	// written for every instance.
+	void step(const std::uint8_t *actions, float *rewards, std::uint8_t *dones);
+
+	// Observations are OBS_CHANNELS planes of 0 or 1 bytes per instance,
+	// [instance][channel][row][column], written into the caller's buffer by
+	// every reset and step (by the thread that stepped the instance) and
+	// once now.  A width x height of cols x rows is the whole level; any
+	// other size is a window centred on the player, where cells beyond the
+	// level read as walls.  A null buffer stops observations.
+	enum ObsChannel { OBS_WALLS, OBS_FOOD, OBS_GHOSTS, OBS_PLAYER, OBS_CHANNELS };
+	void setObservations(std::uint8_t *buffer, int width, int height);
+	std::size_t observationBytes() const { return std::size_t(OBS_CHANNELS) * obs_width_ * obs_height_; }
+
+	// Writes instance i's observation to out, observationBytes() long.
+	void observe(std::size_t i, std::uint8_t *out) const;
+
+private:
+	VecEnvConfig config_;
+	std::size_t count_;
+	int words_per_row_;
+	std::size_t grid_words_;            // per instance
+
+	std::vector<std::int16_t> player_x_;
+	std::vector<std::int16_t> player_y_;
+	std::vector<std::uint32_t> food_left_;
+	std::vector<std::uint32_t> steps_;
+	std::vector<std::uint32_t> episodes_;
+	std::vector<std::uint64_t> rng_;
+	std::vector<std::int16_t> ghost_x_;
+	std::vector<std::int16_t> ghost_y_;
+	std::vector<std::uint16_t> ghost_timer_;
+	std::vector<std::uint64_t> walls_;
+	std::vector<std::uint64_t> food_;
+
+	std::unique_ptr<JobPool> pool_;
+	TaskGraph graph_ {"vecenv"};
+	std::vector<CellGrid> scratch_;     // one per range, for level generation
+	const std::uint8_t *actions_ = nullptr;
+	float *rewards_ = nullptr;
+	std::uint8_t *dones_ = nullptr;
+	std::uint8_t *obs_ = nullptr;
+	int obs_width_;
+	int obs_height_;
+
+	void resetInstance(std::size_t i, CellGrid &scratch);
+	void stepRange(std::size_t from, std::size_t to, CellGrid &scratch);
+
+	bool test(const std::vector<std::uint64_t> &grid, std::size_t i, int cx, int cy) const
+	{
+		return grid[i * grid_words_ + static_cast<std::size_t>(cy) * words_per_row_ + (cx >> 6)]
+		       & (std::uint64_t(1) << (cx & 63));
+	}
+	bool blocked(std::size_t i, int cx, int cy) const
+	{
+		return cx < 0 || cy < 0 || cx >= config_.cols || cy >= config_.rows || test(walls_, i, cx, cy);
+	}
+	std::uint64_t rowBits(const std::uint64_t *row, int cx, bool outside) const;
+};
+}
+
+#endif
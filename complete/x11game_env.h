@@ -0,0 +1,91 @@
+/* 	x11game -- Demonstrates how to make a simple game in C++ using X11.
+
+    Copyright (C) 2022 Punched Tape Media
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* A plain C interface to the batched headless games (VecEnv), for driving
+   them from other languages.  Link against libx11game_env.
+
+   Observations are uint8 planes of 0 or 1 in the order walls, food, ghosts,
+   player, laid out [instance][channel][row][column] in one contiguous
+   buffer owned by the caller.  Once a buffer is set, every reset and step
+   writes straight into it.  An observation the size of the level covers the
+   whole level; any other size is a window centred on the player, with
+   cells beyond the level's edge reading as walls.
+*/
+#ifndef X11GAME_ENV_H
+#define X11GAME_ENV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define X11GAME_ENV_CHANNELS 4
+
+enum {
+	X11GAME_ACTION_NONE,
+	X11GAME_ACTION_UP,
+	X11GAME_ACTION_DOWN,
+	X11GAME_ACTION_LEFT,
+	X11GAME_ACTION_RIGHT
+};
+
+typedef struct x11game_env x11game_env;
+
+typedef struct x11game_env_config {
+	int cols;                 /* level size in cells */
+	int rows;
+	int food;
+	int ghosts;
+	int walls;                /* nonzero for random wall segments */
+	int ghost_period;         /* steps between ghost moves, 1 to 65535 */
+	int max_steps;            /* episodes are cut off after this many */
+	unsigned threads;         /* 0 = one per hardware thread */
+	uint64_t seed;
+} x11game_env_config;
+
+/* Fills in the defaults. */
+void x11game_env_default_config(x11game_env_config *config);
+
+/* Returns NULL on failure; x11game_env_last_error() then says why. */
+x11game_env *x11game_env_create(size_t count, const x11game_env_config *config);
+void x11game_env_destroy(x11game_env *env);
+const char *x11game_env_last_error(void);
+
+size_t x11game_env_size(const x11game_env *env);
+
+/* Sets where observations go: count * x11game_env_observation_bytes()
+   bytes, which must stay valid until replaced.  A width or height of 0
+   means the level's size.  NULL stops observations.  The current state is
+   written at once.  Returns 0, or -1 on bad sizes. */
+int x11game_env_set_observations(x11game_env *env, uint8_t *buffer, int width, int height);
+size_t x11game_env_observation_bytes(const x11game_env *env);
+
+void x11game_env_reset(x11game_env *env);
+
+/* actions[i] is an X11GAME_ACTION_* for instance i; rewards[i] and
+   dones[i] are written for every instance.  Finished instances are reset
+   before this returns, so their observation is the new episode's first. */
+void x11game_env_step(x11game_env *env, const uint8_t *actions, float *rewards, uint8_t *dones);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif